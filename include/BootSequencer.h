@@ -0,0 +1,164 @@
+#ifndef _BOOTSEQUENCER
+
+#define _BOOTSEQUENCER
+
+#include <Arduino.h>
+
+#define BOOT_MAX_STEPS 16
+
+// Bit for a step in BootStepConfig::needs
+#define BOOT_NEEDS(step) (1UL << (step))
+
+// Where a boot step is
+enum BootStatus {
+    BOOT_WAITING, // not started, waiting on the steps it needs
+    BOOT_PENDING, // started, waiting on hardware, called again
+    BOOT_DONE,
+    BOOT_FAILED, // ran, the hardware is missing or did not answer
+    BOOT_TIMEOUT // still pending after its timeout
+};
+
+// A boot step, returns BOOT_PENDING instead of waiting on hardware so other
+// steps run in the meantime
+typedef BootStatus (*BootFunction)(void);
+
+struct BootStepConfig {
+    const char * name;
+    BootFunction run;
+    uint32_t needs; // BOOT_NEEDS() of the steps that must be finished first
+    uint16_t timeout; // ms a pending step may take, 0 = no limit
+};
+
+// Runs the boot steps in dependency order. A step starts once every step it
+// needs has finished, failed or not, so a missing sensor never stops the
+// boot. Pending steps are polled between the others, which is how a slow
+// device overlaps with the rest of the boot. Timeouts only bound the polling,
+// a library call that blocks is bounded by the library.
+class BootSequencer {
+
+    private:
+    const BootStepConfig * steps;
+    int nSteps;
+    uint32_t safetyMask;
+
+    bool finished(int i) {
+        return status[i] != BOOT_WAITING && status[i] != BOOT_PENDING;
+    }
+
+    bool ready(int i) {
+        for (int j = 0; j < nSteps; j++) {
+            if ((steps[i].needs & BOOT_NEEDS(j)) && !finished(j))
+                return false;
+        }
+        return true;
+    }
+
+    void finish(int i, BootStatus s) {
+        status[i] = s;
+        endUs[i] = micros();
+        if (safetyUs == 0 && safetyMask != 0) {
+            for (int j = 0; j < nSteps; j++) {
+                if ((safetyMask & BOOT_NEEDS(j)) && !finished(j))
+                    return;
+            }
+            safetyUs = endUs[i];
+        }
+    }
+
+    public:
+    BootStatus status[BOOT_MAX_STEPS];
+    uint32_t startUs[BOOT_MAX_STEPS]; // micros() since reset
+    uint32_t endUs[BOOT_MAX_STEPS];
+    uint16_t calls[BOOT_MAX_STEPS];
+    uint32_t safetyUs; // when the safety steps had all finished
+    uint32_t doneUs;
+
+    BootSequencer() {
+        steps = NULL;
+        nSteps = 0;
+        safetyMask = 0;
+        safetyUs = 0;
+        doneUs = 0;
+    }
+
+    // Run all steps to the end. safety is the BOOT_NEEDS() of the steps after
+    // which the safety checks are active, for the boot log.
+    void run(const BootStepConfig * steps, int n, uint32_t safety) {
+        this->steps = steps;
+        nSteps = n < BOOT_MAX_STEPS ? n : BOOT_MAX_STEPS;
+        safetyMask = safety;
+        for (int i = 0; i < nSteps; i++) {
+            status[i] = BOOT_WAITING;
+            startUs[i] = 0;
+            endUs[i] = 0;
+            calls[i] = 0;
+        }
+
+        int left = nSteps;
+        while (left > 0) {
+            bool progress = false;
+            for (int i = 0; i < nSteps; i++) {
+                if (status[i] == BOOT_WAITING) {
+                    if (!ready(i))
+                        continue;
+                    startUs[i] = micros();
+                }
+                else if (status[i] != BOOT_PENDING) {
+                    continue;
+                }
+
+                calls[i]++;
+                BootStatus s = steps[i].run();
+                if (s == BOOT_PENDING) {
+                    if (status[i] == BOOT_WAITING)
+                        progress = true;
+                    status[i] = BOOT_PENDING;
+                    if (steps[i].timeout > 0 && micros() - startUs[i] >= steps[i].timeout * 1000UL)
+                        s = BOOT_TIMEOUT;
+                    else
+                        continue;
+                }
+                finish(i, s);
+                progress = true;
+                left--;
+            }
+
+            // Steps that need each other can never start
+            if (!progress && left > 0) {
+                bool pending = false;
+                for (int i = 0; i < nSteps; i++)
+                    pending |= status[i] == BOOT_PENDING;
+                if (!pending) {
+                    for (int i = 0; i < nSteps; i++) {
+                        if (status[i] == BOOT_WAITING)
+                            finish(i, BOOT_FAILED);
+                    }
+                    break;
+                }
+            }
+        }
+        doneUs = micros();
+    }
+
+    void print(Stream * ui) {
+        static const char * names[] = { "waiting", "pending", "done", "FAILED", "TIMEOUT" };
+        char output[80];
+        ui->println();
+        ui->println("Step        Start (ms)  Time (ms)  Calls  Status");
+        for (int i = 0; i < nSteps; i++) {
+            uint32_t t = endUs[i] - startUs[i];
+            sprintf(output, "%-10s  %6lu.%lu  %7lu.%lu  %5u  %s", steps[i].name,
+                (unsigned long)(startUs[i] / 1000), (unsigned long)(startUs[i] / 100 % 10),
+                (unsigned long)(t / 1000), (unsigned long)(t / 100 % 10), calls[i], names[status[i]]);
+            ui->println(output);
+        }
+        sprintf(output, "Safety checks active at %lu ms, boot done at %lu ms",
+            (unsigned long)(safetyUs / 1000), (unsigned long)(doneUs / 1000));
+        ui->println(output);
+    }
+};
+
+// Global boot sequencer
+BootSequencer _boot;
+
+#endif
@@ -4,6 +4,8 @@
 
 #include <Arduino.h>
 #include "Config.h"
+#include "DataBus.h"
+#include "TxQueue.h"
 
 #define MAX_BUFFER_LENGTH 256
 
@@ -72,9 +74,22 @@ class CTD {
             newData = true;
         }
 
+        if (newData)
+            publishSample();
+
         return newData;
     }
 
+    // Publish the last parsed values on the data bus
+    void publishSample() {
+        CtdSample * s = _bus.ctd.claim();
+        s->timestamp = millis();
+        s->pressure = dBar;
+        s->temperature = temp;
+        s->conductivity = cond;
+        _bus.ctd.publish();
+    }
+
     void readData(Stream * port) {
         
         if (port != NULL && port->available()) {
@@ -90,8 +105,7 @@ class CTD {
                             parseData(buffer);
                             bufferIndex = 0;
                             if (echoData) {
-                                UI1.println(buffer);
-                                UI2.println(buffer);
+                                _tx.printAll(buffer, TX_TELEMETRY, TX_UI1 | TX_UI2);
                             }
                             
                         }
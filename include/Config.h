@@ -4,6 +4,7 @@
 
 #include <Arduino.h>
 #include "wiring_private.h" // pinPeripheral() function
+#include "SerialRx.h"
 
 // Define additional serial ports
 
@@ -31,15 +32,23 @@ void configSerialPins() {
     pinPeripheral(10, PIO_SERCOM);
 }
 
+// Hardware ports with optional DMA receive (HWPORTnRXBUF). Serial0 and Serial1
+// are created by the Moteino M0 variant on SERCOM5 and SERCOM0, their
+// handlers are in the variant too so they can't use DMA.
+RxPort SerialRx0(&Serial0, SERCOM5, SERCOM5_DMAC_ID_RX, 0, false);
+RxPort SerialRx1(&Serial1, SERCOM0, SERCOM0_DMAC_ID_RX, 1, false);
+RxPort SerialRx2(&Serial2, SERCOM2, SERCOM2_DMAC_ID_RX, 2, true);
+RxPort SerialRx3(&Serial3, SERCOM1, SERCOM1_DMAC_ID_RX, 3, true);
+
 // Serial handlers
 void SERCOM2_Handler()
 {
-  Serial2.IrqHandler();
+  SerialRx2.irqHandler();
 }
 
 void SERCOM1_Handler()
 {
-  Serial3.IrqHandler();
+  SerialRx3.irqHandler();
 }
 
 // Power Control
@@ -49,6 +58,21 @@ void SERCOM1_Handler()
 #define CAM_POWER 38
 #define POWER_SWITCH A3
 
+// INA260 alert lines (open drain, active low), -1 if the line is not wired.
+// Each needs its own EIC line, the Moteino M0 variant maps A0 to PA02
+// (EXTINT2), A3 to PA04 (EXTINT4, power button) and A4 to PA05 (EXTINT5).
+// A5 is PB02 on EXTINT2 as well, so the CAM alert can't share A0's line and
+// is left unwired, its rail is still cut with the rest of the camera. The
+// routing of these lines on the console board is not in this repo, so the
+// pins are only armed with RAILALERTPINS = 1. A miswired ORIN line would cut
+// the Orin without a shutdown, check it against the schematic first.
+#define SYS_ALERT A0
+#define PROBE_ALERT -1
+#define ORIN_ALERT A4
+#define DISP_ALERT -1
+#define CAM_ALERT -1
+#define NO_PIN -1
+
 // Define GPIOs
 #define GPIO_1_IO 42
 #define GPIO_2_IO SWIO
@@ -75,10 +99,10 @@ void SERCOM1_Handler()
 #define SDCARD_CS 13
 
 #define DEBUGPORT Serial
-#define HWPORT0 Serial0
-#define HWPORT1 Serial1
-#define HWPORT2 Serial2
-#define HWPORT3 Serial3
+#define HWPORT0 SerialRx0
+#define HWPORT1 SerialRx1
+#define HWPORT2 SerialRx2
+#define HWPORT3 SerialRx3
 
 #define UI1 HWPORT0
 #define UI2 HWPORT1
@@ -120,6 +144,55 @@ void SERCOM1_Handler()
 #define ECHORBR "ECHORBR"
 #define USERBRCLOCK "USERBRCLOCK"
 #define CTDTYPE "CTDTYPE"
+#define RAILFASTAVG "RAILFASTAVG"
+#define RAILFASTCONV "RAILFASTCONV"
+#define RAILIDLEAVG "RAILIDLEAVG"
+#define RAILIDLECONV "RAILIDLECONV"
+#define RAILIDLEOFF "RAILIDLEOFF"
+#define RAILFASTTIME "RAILFASTTIME"
+#define PROBEILIMIT "PROBEILIMIT"
+#define ORINILIMIT "ORINILIMIT"
+#define DISPILIMIT "DISPILIMIT"
+#define CAMILIMIT "CAMILIMIT"
+#define BATTPOLLINT "BATTPOLLINT"
+#define BATTPEC "BATTPEC"
+#define ENERGYSAVEINT "ENERGYSAVEINT"
+#define BATTCAPACITY "BATTCAPACITY"
+#define ENERGYBLEND "ENERGYBLEND"
+#define TRENDWINDOW "TRENDWINDOW"
+#define TRENDWARNTIME "TRENDWARNTIME"
+#define TRENDSHUTDOWNTIME "TRENDSHUTDOWNTIME"
+#define HWPORT0RXBUF "HWPORT0RXBUF"
+#define HWPORT1RXBUF "HWPORT1RXBUF"
+#define HWPORT2RXBUF "HWPORT2RXBUF"
+#define HWPORT3RXBUF "HWPORT3RXBUF"
+#define HBTIMEOUT "HBTIMEOUT"
+#define HBBOOTGRACE "HBBOOTGRACE"
+#define HALTGRACE "HALTGRACE"
+#define IDLESTANDBY "IDLESTANDBY"
+#define SEQORINDELAY "SEQORINDELAY"
+#define SEQDISPDELAY "SEQDISPDELAY"
+#define SEQCAMDELAY "SEQCAMDELAY"
+#define SEQOFFDELAY "SEQOFFDELAY"
+#define SEQSETTLE "SEQSETTLE"
+#define SEQSETTLEMA "SEQSETTLEMA"
+#define JETSONSETTLE "JETSONSETTLE"
+#define STROBEMAXDUTY "STROBEMAXDUTY"
+#define STROBEPOWER "STROBEPOWER"
+#define STROBEBUDGET "STROBEBUDGET"
+#define LOGIDLE "LOGIDLE"
+#define LOGBOOT "LOGBOOT"
+#define LOGIMAGING "LOGIMAGING"
+#define LOGSHUTDOWN "LOGSHUTDOWN"
+#define LOGFAULT "LOGFAULT"
+#define LOGHEARTBEAT "LOGHEARTBEAT"
+#define LOGDBTEMP "LOGDBTEMP"
+#define LOGDBPRES "LOGDBPRES"
+#define LOGDBHUM "LOGDBHUM"
+#define LOGDBVOLT "LOGDBVOLT"
+#define LOGDBPOWER "LOGDBPOWER"
+#define RAILALERTPINS "RAILALERTPINS"
+#define LOGINTIDLE "LOGINTIDLE"
 
 // Define Commands
 #define CFG "CFG"
@@ -134,6 +207,19 @@ void SERCOM1_Handler()
 #define PRINTEVENTS "PRINTEVENTS"
 #define CLEAREVENTS "CLEAREVENTS"
 #define GOTOSLEEP "GOTOSLEEP"
+#define BATTERY "BATTERY"
+#define ENERGY "ENERGY"
+#define BENCHMATH "BENCHMATH"
+#define SERIALSTATS "SERIALSTATS"
+#define JETSON "JETSON"
+#define POWERSTATS "POWERSTATS"
+#define BOOTLOG "BOOTLOG"
+#define TASKSTATS "TASKS"
+#define CRASHLOG "CRASHLOG"
+#define EVENTLOG "EVENTS"
+#define RAILCTRL "RAIL"
+#define STROBEBUDGETCMD "STROBE"
+#define TELEMCMD "TELEMETRY"
 
 
 #endif
\ No newline at end of file
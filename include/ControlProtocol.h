@@ -0,0 +1,247 @@
+#ifndef _CONTROLPROTOCOL
+
+#define _CONTROLPROTOCOL
+
+#include <Arduino.h>
+#include "Config.h"
+#include "TxQueue.h"
+#include "Utils.h"
+
+// Binary control protocol for the Jetson and the UI ports.
+//
+// Frames are COBS encoded and sent between 0x00 delimiters, a host should send a
+// 0x00 before each frame so a partial frame can't swallow the next one. The
+// decoded frame is
+//
+//   [op] [id] [body ...] [crc lo] [crc hi]
+//
+// where crc is crc16() over op, id and body. Every request is answered with
+// op | PROTO_REPLY and the same id, in the order received, so a host can keep
+// several requests in flight. Events from a subscription use id 0. All numbers
+// are little endian.
+//
+// A '!' on a UI port outside a frame still opens the interactive CLI.
+
+#define PROTO_MAX_FRAME 256 // decoded bytes
+#define PROTO_MAX_ENCODED (PROTO_MAX_FRAME + PROTO_MAX_FRAME / 254 + 3)
+
+// Bytes after a delimiter are taken as frame data until the port is idle this
+// long in ms
+#define PROTO_FRAME_TIMEOUT 100
+
+#define PROTO_REPLY 0x80
+
+// Requests
+#define OP_PING 0x01 // body echoed back
+#define OP_GET 0x02 // n x u16 param index -> n x (u16 index, u8 status, i32 value)
+#define OP_SET 0x03 // n x (u16 index, i32 value) -> n x (u16 index, u8 status, i32 value)
+#define OP_SNAPSHOT 0x04 // -> state snapshot, see SystemControl::writeSnapshot()
+#define OP_PARAMINFO 0x05 // u16 index -> u16 index, i32 min, i32 max, i32 value, name\0, units\0
+#define OP_SUBSCRIBE 0x06 // u32 event mask -> u32 event mask
+#define OP_SHUTDOWN 0x07 // -> u8 status
+#define OP_SAVECONFIG 0x08 // -> u8 status
+// Orin ops are only taken on JETSONPORT, other ports get ERR_UNKNOWN_OP
+#define OP_HEARTBEAT 0x09 // Orin: [u32 uptime s] -> u8 power state, u8 flags (bit 0 shutdown requested)
+#define OP_HALTING 0x0A // Orin: shutdown started -> u8 status
+#define OP_HALTED 0x0B // Orin: filesystems synced, cut power -> u8 status
+#define OP_ERROR 0x7F // reply only: u8 error code
+
+// Unsolicited events
+#define OP_EVENT 0x40 // u8 event type, event data
+
+// Event types, also the bits of the subscription mask
+#define EVT_ALERT 0x01 // alert text
+#define EVT_POWER 0x02 // u8 power state
+#define EVT_SNAPSHOT 0x04 // state snapshot at the log interval
+#define EVT_SHUTDOWN 0x08 // shutdown requested, always sent to the Jetson port
+
+// Status of a param in GET/SET and of commands
+#define STATUS_OK 0
+#define STATUS_UNKNOWN 1
+#define STATUS_RANGE 2
+#define STATUS_REFUSED 3
+
+// OP_ERROR codes
+#define ERR_UNKNOWN_OP 1
+#define ERR_BAD_LENGTH 2
+
+// COBS encode n bytes, returns the encoded length. out needs n + n / 254 + 1 bytes.
+int cobsEncode(const uint8_t * in, int n, uint8_t * out) {
+    int code = 0; // position of the current code byte
+    int o = 1;
+    uint8_t run = 1;
+    for (int i = 0; i < n; i++) {
+        if (in[i] == 0) {
+            out[code] = run;
+            code = o++;
+            run = 1;
+        }
+        else {
+            out[o++] = in[i];
+            run++;
+            if (run == 0xFF) {
+                out[code] = run;
+                code = o++;
+                run = 1;
+            }
+        }
+    }
+    out[code] = run;
+    return o;
+}
+
+// COBS decode in place, returns the decoded length or -1 if malformed
+int cobsDecode(uint8_t * buf, int n) {
+    int i = 0;
+    int o = 0;
+    while (i < n) {
+        uint8_t code = buf[i++];
+        if (code == 0 || i + code - 1 > n)
+            return -1;
+        for (int j = 1; j < code; j++)
+            buf[o++] = buf[i++];
+        if (code != 0xFF && i < n)
+            buf[o++] = 0;
+    }
+    return o;
+}
+
+// Collects the bytes of one port into frames
+class FrameDecoder {
+
+    private:
+    uint8_t buf[PROTO_MAX_ENCODED];
+    int n;
+    bool armed; // a delimiter was seen recently
+    bool overflow;
+    unsigned long lastByte;
+
+    public:
+    unsigned long frames;
+    unsigned long errors; // bad COBS, CRC or length
+
+    FrameDecoder() {
+        n = 0;
+        armed = false;
+        overflow = false;
+        lastByte = 0;
+        frames = 0;
+        errors = 0;
+    }
+
+    // True while bytes belong to a frame rather than to text input
+    bool inFrame() {
+        if (armed && millis() - lastByte > PROTO_FRAME_TIMEOUT) {
+            armed = false;
+            n = 0;
+        }
+        return armed;
+    }
+
+    // Feed one byte, returns the decoded length (without CRC) when a valid frame
+    // is complete and 0 otherwise. The frame is at data().
+    int feed(uint8_t c) {
+        bool wasArmed = inFrame();
+        lastByte = millis();
+        if (c == 0) {
+            int len = 0;
+            if (wasArmed && n > 0) {
+                len = overflow ? -1 : cobsDecode(buf, n);
+                if (len < 4 || crc16(buf, len - 2) != (buf[len - 2] | (buf[len - 1] << 8))) {
+                    errors++;
+                    len = 0;
+                }
+                else {
+                    frames++;
+                    len -= 2;
+                }
+            }
+            armed = true;
+            overflow = false;
+            n = 0;
+            return len;
+        }
+        if (!wasArmed)
+            return 0;
+        if (n < PROTO_MAX_ENCODED)
+            buf[n++] = c;
+        else
+            overflow = true;
+        return 0;
+    }
+
+    const uint8_t * data() {
+        return buf;
+    }
+};
+
+// Builds one frame and queues it on a port
+class FrameWriter {
+
+    private:
+    uint8_t buf[PROTO_MAX_FRAME];
+    int n;
+
+    public:
+
+    FrameWriter(uint8_t op, uint8_t id) {
+        n = 0;
+        buf[n++] = op;
+        buf[n++] = id;
+    }
+
+    // Bytes left for the body
+    int room() {
+        return PROTO_MAX_FRAME - 2 - n;
+    }
+
+    void put8(uint8_t v) {
+        if (room() >= 1)
+            buf[n++] = v;
+    }
+
+    void put16(uint16_t v) {
+        put8(v & 0xFF);
+        put8(v >> 8);
+    }
+
+    void put32(uint32_t v) {
+        put16(v & 0xFFFF);
+        put16(v >> 16);
+    }
+
+    void putBytes(const uint8_t * data, int len) {
+        for (int i = 0; i < len; i++)
+            put8(data[i]);
+    }
+
+    // Zero terminated string, truncated to fit
+    void putString(const char * s) {
+        while (*s && room() > 1)
+            put8(*s++);
+        put8(0);
+    }
+
+    // Add the CRC, encode and queue the frame on TxPorts port i
+    bool send(int port, TxPriority priority) {
+        uint16_t crc = crc16(buf, n);
+        buf[n++] = crc & 0xFF;
+        buf[n++] = crc >> 8;
+        uint8_t out[PROTO_MAX_ENCODED];
+        out[0] = 0;
+        int len = cobsEncode(buf, n, out + 1) + 1;
+        out[len++] = 0;
+        return _tx.queue(port)->pushFrame(out, len, priority);
+    }
+};
+
+// Read little endian values from a request body
+uint16_t get16(const uint8_t * p) {
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t get32(const uint8_t * p) {
+    return (uint32_t)get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+#endif
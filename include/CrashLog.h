@@ -0,0 +1,268 @@
+#ifndef _CRASHLOG
+
+#define _CRASHLOG
+
+#include <Arduino.h>
+#include <RTCZero.h>
+#include "SystemConfig.h"
+#include "TaskSupervisor.h"
+#include "Utils.h"
+
+#define CRASH_MAGIC 0x43525348 // "CRSH"
+#define CRASH_LOG_SECTORS 2
+#define CRASH_SLOT_SIZE 512
+#define CRASH_SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / CRASH_SLOT_SIZE)
+#define CRASH_LOG_SLOTS (CRASH_LOG_SECTORS * CRASH_SLOTS_PER_SECTOR)
+
+// Alert lines kept for the post-mortem
+#define CRASH_NOTES 8
+#define CRASH_NOTE_LEN 44
+
+// What ended a run
+enum CrashType {
+    CRASH_NONE, // reset without a capture: reset pin, brown out or software
+    CRASH_HARDFAULT,
+    CRASH_WATCHDOG
+};
+
+struct CrashNote {
+    uint32_t uptime; // millis()
+    char text[CRASH_NOTE_LEN];
+};
+
+// A run's last moments, kept in RAM the startup code does not clear and
+// copied to flash on the next boot
+struct CrashRecord {
+    uint32_t magic;
+    uint32_t seq; // flash record number
+    uint8_t type;
+    uint8_t resetCause; // PM->RCAUSE of the boot after
+    int8_t task; // supervisor task running, -1 if none
+    uint8_t nextNote;
+    uint32_t pc; // stacked by the fault, 0 for the watchdog
+    uint32_t lr;
+    uint32_t sp;
+    uint32_t psr;
+    uint32_t uptime; // millis()
+    uint32_t epoch; // RTC
+    CrashNote notes[CRASH_NOTES];
+    uint16_t crc;
+};
+
+static_assert(sizeof(CrashRecord) <= CRASH_SLOT_SIZE, "CrashRecord does not fit a flash slot");
+
+CrashRecord _crashRecord __attribute__((section(".noinit")));
+
+// Start of the heap, from the linker script
+extern "C" char end;
+
+// True if the no-init records sit below the heap, where noinit.ld puts them.
+// Above it the params allocated at boot would overwrite them.
+bool noinitBelowHeap() {
+    return (char *)(&_crashRecord + 1) <= &end && (char *)(&_supervisorRecord + 1) <= &end;
+}
+
+// Captures HardFaults and watchdog early warnings into _crashRecord and keeps
+// the last alert lines there. On the next boot begin() stores the record in a
+// flash ring if the run did not end by power loss. The ring works like the
+// energy log: a sector is erased just before its first slot is reused.
+class CrashLog {
+
+    private:
+    RTCZero * rtc;
+    int slot; // next flash slot to write
+    uint32_t seq;
+
+    uint32_t slotAddress(int i) {
+        return CRASH_LOG_ADDR + (uint32_t)i * CRASH_SLOT_SIZE;
+    }
+
+    uint16_t recordCrc(const CrashRecord * r) {
+        return crc16(r, offsetof(CrashRecord, crc));
+    }
+
+    bool readSlot(int i, CrashRecord * r) {
+        _flash.readBytes(slotAddress(i), (void*)r, sizeof(CrashRecord));
+        return r->magic == CRASH_MAGIC && r->crc == recordCrc(r);
+    }
+
+    void clearRecord() {
+        memset(&_crashRecord, 0, sizeof(_crashRecord));
+        _crashRecord.magic = CRASH_MAGIC;
+        _crashRecord.task = -1;
+    }
+
+    static const char * causeName(uint8_t cause) {
+        if (cause & PM_RCAUSE_WDT) return "watchdog";
+        if (cause & PM_RCAUSE_SYST) return "system reset";
+        if (cause & PM_RCAUSE_EXT) return "reset pin";
+        if (cause & (PM_RCAUSE_BOD12 | PM_RCAUSE_BOD33)) return "brown out";
+        if (cause & PM_RCAUSE_POR) return "power on";
+        return "unknown";
+    }
+
+    static const char * typeName(uint8_t type) {
+        static const char * names[] = { "reset", "HardFault", "watchdog" };
+        return type <= CRASH_WATCHDOG ? names[type] : "?";
+    }
+
+    public:
+    bool saved; // a record from the last run was stored this boot
+    CrashRecord last; // newest record in flash
+
+    CrashLog() {
+        rtc = NULL;
+        slot = 0;
+        seq = 0;
+        saved = false;
+        memset(&last, 0, sizeof(last));
+    }
+
+    // Store the last run's record if RAM survived the reset, then start a
+    // fresh one. Needs the flash.
+    void begin(RTCZero * rtc) {
+        this->rtc = rtc;
+        uint8_t cause = PM->RCAUSE.reg;
+
+        // Find the newest record to continue the ring after it
+        CrashRecord r;
+        bool found = false;
+        for (int i = 0; i < CRASH_LOG_SLOTS; i++) {
+            if (readSlot(i, &r) && (!found || (int32_t)(r.seq - seq) > 0)) {
+                found = true;
+                seq = r.seq;
+                slot = (i + 1) % CRASH_LOG_SLOTS;
+                last = r;
+            }
+        }
+
+        bool retained = _crashRecord.magic == CRASH_MAGIC && !(cause & PM_RCAUSE_POR);
+        if (retained && (_crashRecord.type != CRASH_NONE || (cause & (PM_RCAUSE_WDT | PM_RCAUSE_SYST | PM_RCAUSE_EXT)))) {
+            _crashRecord.seq = ++seq;
+            _crashRecord.resetCause = cause;
+            _crashRecord.crc = recordCrc(&_crashRecord);
+            if (slot % CRASH_SLOTS_PER_SECTOR == 0)
+                _flash.blockErase4K(slotAddress(slot));
+            _flash.writeBytes(slotAddress(slot), (void*)&_crashRecord, sizeof(_crashRecord));
+            slot = (slot + 1) % CRASH_LOG_SLOTS;
+            last = _crashRecord;
+            saved = true;
+        }
+        clearRecord();
+    }
+
+    // Keep a line for the post-mortem, cheap enough for every alert
+    void note(const char * text) {
+        if (_crashRecord.magic != CRASH_MAGIC)
+            clearRecord();
+        CrashNote * n = &_crashRecord.notes[_crashRecord.nextNote % CRASH_NOTES];
+        n->uptime = millis();
+        strncpy(n->text, text, CRASH_NOTE_LEN - 1);
+        n->text[CRASH_NOTE_LEN - 1] = '\0';
+        _crashRecord.nextNote = (_crashRecord.nextNote + 1) % CRASH_NOTES;
+    }
+
+    // Fill in the record from a fault or the watchdog early warning. frame
+    // is the exception stack frame, NULL if there is none.
+    void capture(CrashType type, const uint32_t * frame) {
+        _crashRecord.magic = CRASH_MAGIC;
+        _crashRecord.type = type;
+        _crashRecord.task = (int8_t)_supervisorRecord.current;
+        _crashRecord.uptime = millis();
+        _crashRecord.epoch = rtc != NULL ? rtc->getEpoch() : 0;
+        if (frame != NULL) {
+            // r0-r3, r12, lr, pc, xpsr
+            _crashRecord.lr = frame[5];
+            _crashRecord.pc = frame[6];
+            _crashRecord.psr = frame[7];
+            _crashRecord.sp = (uint32_t)(frame + 8);
+        }
+        else {
+            _crashRecord.lr = 0;
+            _crashRecord.pc = 0;
+            _crashRecord.psr = 0;
+            _crashRecord.sp = __get_MSP();
+        }
+    }
+
+    // One line on the record stored this boot, false if there is none
+    bool describeSaved(char * output) {
+        if (!saved)
+            return false;
+        sprintf(output, "Last run ended by %s (%s) in task %s at PC 0x%08lX, see CRASHLOG",
+            typeName(last.type), causeName(last.resetCause),
+            last.task >= 0 && last.task < NUM_TASKS ? TASKS[last.task].name : "none", (unsigned long)last.pc);
+        return true;
+    }
+
+    void printRecord(Stream * ui, const CrashRecord * r, bool notes) {
+        char output[128];
+        sprintf(output, "#%lu  %s (%s)  epoch %lu  uptime %lu s  task %s", (unsigned long)r->seq,
+            typeName(r->type), causeName(r->resetCause), (unsigned long)r->epoch,
+            (unsigned long)(r->uptime / 1000), r->task >= 0 && r->task < NUM_TASKS ? TASKS[r->task].name : "none");
+        ui->println(output);
+        if (r->type == CRASH_NONE)
+            return;
+        sprintf(output, "    PC 0x%08lX  LR 0x%08lX  SP 0x%08lX  xPSR 0x%08lX", (unsigned long)r->pc,
+            (unsigned long)r->lr, (unsigned long)r->sp, (unsigned long)r->psr);
+        ui->println(output);
+        if (!notes)
+            return;
+        for (int i = 0; i < CRASH_NOTES; i++) {
+            const CrashNote * n = &r->notes[(r->nextNote + i) % CRASH_NOTES];
+            if (n->text[0] == '\0')
+                continue;
+            sprintf(output, "    %8lu ms  ", (unsigned long)n->uptime);
+            ui->print(output);
+            ui->println(n->text);
+        }
+    }
+
+    // All records in flash, newest first, with the alert lines of the newest
+    void print(Stream * ui) {
+        ui->println();
+        int n = 0;
+        CrashRecord r;
+        for (int i = 1; i <= CRASH_LOG_SLOTS; i++) {
+            int s = (slot - i + CRASH_LOG_SLOTS) % CRASH_LOG_SLOTS;
+            if (!readSlot(s, &r))
+                continue;
+            printRecord(ui, &r, n == 0);
+            n++;
+        }
+        if (n == 0)
+            ui->println("No crash records");
+    }
+};
+
+// Global crash log
+CrashLog _crash;
+
+// Called by HardFault_Handler with the stack frame of the faulting code
+extern "C" void hardFaultCapture(const uint32_t * frame) {
+    _crash.capture(CRASH_HARDFAULT, frame);
+    NVIC_SystemReset();
+}
+
+// Pass the frame from whichever stack was in use to hardFaultCapture().
+// Replaces the weak HardFault_Handler of the core.
+extern "C" __attribute__((naked)) void HardFault_Handler(void) {
+    __asm volatile (
+        "movs r0, #4        \n"
+        "mov r1, lr         \n"
+        "tst r0, r1         \n"
+        "beq 1f             \n"
+        "mrs r0, psp        \n"
+        "b 2f               \n"
+        "1: mrs r0, msp     \n"
+        "2: ldr r1, =hardFaultCapture \n"
+        "bx r1              \n"
+    );
+}
+
+// WDTZero calls this from the early warning interrupt just before the reset
+void watchdogCapture() {
+    _crash.capture(CRASH_WATCHDOG, NULL);
+}
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef _DATABUS
+
+#define _DATABUS
+
+#include <Arduino.h>
+#include "Config.h"
+#include "FixedPoint.h"
+#include "PowerRails.h"
+
+// Number of samples retained per topic, must be a power of two
+#define BUS_DEPTH 8
+
+// Timestamped sample records published on the bus. All timestamps are millis()
+// at the time the producer filled the record.
+
+// Readings of every rail in the RAILS table, indexed by RailIndex
+// A rail whose read failed holds its last good reading and has its bit clear
+#define RAIL_VALID(i) (1 << (i))
+
+static_assert(NUM_RAILS <= 8, "PowerSample::valid has a bit per rail");
+
+struct PowerSample : RailReadings<NUM_RAILS> {
+    uint32_t timestamp;
+    uint8_t valid; // RAIL_VALID bits
+};
+
+// Valid flags of an EnvSample, a glitched channel holds its last good value
+#define ENV_TEMP_VALID 0x01
+#define ENV_PRES_VALID 0x02
+#define ENV_HUM_VALID 0x04
+
+struct EnvSample {
+    uint32_t timestamp;
+    CentiDegrees temperature;
+    Pascals pressure;
+    CentiPercent humidity;
+    uint8_t valid; // ENV_*_VALID flags
+};
+
+struct CtdSample {
+    uint32_t timestamp;
+    float pressure; // in dBar
+    float temperature; // in C
+    float conductivity;
+};
+
+struct BatterySample {
+    uint32_t timestamp;
+    int soc[4]; // in %, -1 if the pack did not respond
+    CentiPercent charge; // average of all packs
+};
+
+// Fixed capacity ring of samples for a single topic. Producers claim the next slot,
+// fill it in place and publish it. Consumers get const pointers into the ring so
+// nothing is copied, a pointer stays valid until BUS_DEPTH - 1 newer samples have
+// been published.
+template <class T>
+class Topic {
+
+    private:
+    T slots[BUS_DEPTH];
+    volatile uint32_t seq; // number of samples published so far
+
+    public:
+
+    Topic() {
+        seq = 0;
+    }
+
+    // Slot for the next sample, only visible to readers after publish()
+    T * claim() {
+        return &slots[seq & (BUS_DEPTH - 1)];
+    }
+
+    // Commit the claimed slot and return its sequence number
+    uint32_t publish() {
+        return seq++;
+    }
+
+    // Sequence number the next published sample will get
+    uint32_t head() {
+        return seq;
+    }
+
+    // Sample with sequence number s, or NULL if it has not been published yet
+    // or has already been overwritten
+    const T * read(uint32_t s) {
+        if (s >= seq || seq - s >= BUS_DEPTH)
+            return NULL;
+        return &slots[s & (BUS_DEPTH - 1)];
+    }
+
+    const T * latest() {
+        if (seq == 0)
+            return NULL;
+        return &slots[(seq - 1) & (BUS_DEPTH - 1)];
+    }
+
+    // True if the latest sample is no older than maxAge ms
+    bool fresh(unsigned long maxAge) {
+        const T * s = latest();
+        return s != NULL && millis() - s->timestamp <= maxAge;
+    }
+};
+
+// Read cursor into a topic. Each consumer keeps its own so it sees every sample
+// exactly once, samples it fell too far behind on are skipped and counted.
+template <class T>
+class Subscriber {
+
+    private:
+    Topic<T> * topic;
+    uint32_t next;
+
+    public:
+    uint32_t dropped;
+
+    Subscriber(Topic<T> * topic) {
+        this->topic = topic;
+        next = topic->head();
+        dropped = 0;
+    }
+
+    // Next unseen sample or NULL if we are caught up
+    const T * poll() {
+        uint32_t head = topic->head();
+        if (next >= head)
+            return NULL;
+        if (head - next >= BUS_DEPTH) {
+            dropped += head - next - (BUS_DEPTH - 1);
+            next = head - (BUS_DEPTH - 1);
+        }
+        return topic->read(next++);
+    }
+
+    bool available() {
+        return next < topic->head();
+    }
+
+    // Catch up without reading, for samples that should not be fed on
+    void skip() {
+        next = topic->head();
+    }
+};
+
+// All topics published in the system
+class DataBus {
+    public:
+    Topic<PowerSample> power;
+    Topic<EnvSample> env;
+    Topic<CtdSample> ctd;
+    Topic<BatterySample> battery;
+};
+
+// Global data bus
+DataBus _bus;
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef _ENERGYMETER
+
+#define _ENERGYMETER
+
+#include <Arduino.h>
+#include "Config.h"
+#include "DataBus.h"
+#include "PowerRails.h"
+#include "Stats.h"
+#include "SystemConfig.h"
+#include "Utils.h"
+
+#define ENERGY_MAGIC 0x454E5247
+#define ENERGY_LOG_SECTORS 2
+#define ENERGY_SLOT_SIZE 128
+#define ENERGY_SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / ENERGY_SLOT_SIZE)
+#define ENERGY_LOG_SLOTS (ENERGY_LOG_SECTORS * ENERGY_SLOTS_PER_SECTOR)
+
+// Gaps between samples longer than this (in ms) are not integrated
+#define ENERGY_MAX_GAP 10000
+
+// uJ (mW * ms) in one mWh, also uC (mA * ms) in one mAh
+#define UJ_PER_MWH 3600000ULL
+
+// Checkpoint of the per-rail counters, one per flash slot
+struct EnergyRecord {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t energy[NUM_RAILS]; // in uJ
+    uint64_t charge[NUM_RAILS]; // in uC
+    uint16_t crc;
+};
+
+static_assert(sizeof(EnergyRecord) <= ENERGY_SLOT_SIZE, "EnergyRecord does not fit a flash slot");
+
+// Integrates each rail's power and current into energy and charge counters at
+// the sensor sample rate. Counters are checkpointed to flash as appended records
+// that walk through ENERGY_LOG_SECTORS sectors, so each sector is only erased
+// once every ENERGY_SLOTS_PER_SECTOR checkpoints.
+class EnergyMeter {
+
+    private:
+    EnergyRecord totals;
+    Subscriber<PowerSample> sub;
+    uint32_t lastTimestamp;
+    bool haveLast;
+    int slot; // next flash slot to write
+    unsigned long lastCheckpoint;
+
+    // Estimate of the energy left in the batteries
+    int64_t remaining; // in uJ
+    bool remainingValid;
+    uint32_t batterySeq;
+    Ewma<MilliWatts> avgPower; // long term average system power
+
+    uint32_t slotAddress(int i) {
+        return ENERGY_LOG_ADDR + (uint32_t)i * ENERGY_SLOT_SIZE;
+    }
+
+    uint16_t recordCrc(const EnergyRecord * r) {
+        return crc16(r, offsetof(EnergyRecord, crc));
+    }
+
+    void integrate(const PowerSample * p, uint32_t dt) {
+        for (int i = 0; i < NUM_RAILS; i++) {
+            int32_t pw = p->power[i].raw;
+            int32_t c = p->current[i].raw;
+            if (pw > 0)
+                totals.energy[i] += (uint64_t)pw * dt;
+            if (c > 0)
+                totals.charge[i] += (uint64_t)c * dt;
+        }
+
+        MilliWatts sys = p->power[RAIL_SYS];
+        if (remainingValid)
+            remaining -= (int64_t)sys.raw * dt;
+        avgPower.update(sys);
+    }
+
+    void printAmount(Stream * ui, uint64_t micro) {
+        uint32_t milli = micro / UJ_PER_MWH;
+        char output[32];
+        sprintf(output, "%10lu.%03lu", (unsigned long)(milli / 1000), (unsigned long)(milli % 1000));
+        ui->print(output);
+    }
+
+    public:
+
+    EnergyMeter() : sub(&_bus.power), avgPower(6) {
+        memset(&totals, 0, sizeof(totals));
+        lastTimestamp = 0;
+        haveLast = false;
+        slot = 0;
+        lastCheckpoint = 0;
+        remaining = 0;
+        remainingValid = false;
+        batterySeq = 0;
+    }
+
+    // Restore the counters from the newest valid checkpoint in flash
+    void begin() {
+        EnergyRecord r;
+        int best = -1;
+        uint32_t bestSeq = 0;
+        for (int i = 0; i < ENERGY_LOG_SLOTS; i++) {
+            _flash.readBytes(slotAddress(i), (void*)&r, sizeof(r));
+            if (r.magic == ENERGY_MAGIC && r.crc == recordCrc(&r) && (best < 0 || r.seq > bestSeq)) {
+                best = i;
+                bestSeq = r.seq;
+            }
+        }
+
+        if (best >= 0) {
+            _flash.readBytes(slotAddress(best), (void*)&totals, sizeof(totals));
+            slot = (best + 1) % ENERGY_LOG_SLOTS;
+            DEBUGPORT.print("Energy counters restored from checkpoint ");
+            DEBUGPORT.println(totals.seq);
+        }
+        else {
+            memset(&totals, 0, sizeof(totals));
+            slot = 0;
+        }
+        lastCheckpoint = millis();
+    }
+
+    // Integrate all new power samples, call at least once per BUS_DEPTH samples
+    void update() {
+        const PowerSample * p;
+        while ((p = sub.poll()) != NULL) {
+            if (haveLast) {
+                uint32_t dt = p->timestamp - lastTimestamp;
+                if (dt <= ENERGY_MAX_GAP)
+                    integrate(p, dt);
+            }
+            lastTimestamp = p->timestamp;
+            haveLast = true;
+        }
+    }
+
+    // Pull the estimate of remaining energy towards the battery SOC each time a
+    // new battery sample arrives. blend is the weight in % kept from coulomb
+    // counting, the SOC is coarse so most of the short term change should come
+    // from the integrated power.
+    void blendBattery(int capacityWh, int blend) {
+        if (_bus.battery.head() == batterySeq)
+            return;
+        batterySeq = _bus.battery.head();
+
+        const BatterySample * b = _bus.battery.latest();
+        // charge in 0.01 % times Wh is 0.1 mWh per unit
+        int64_t socEnergy = (int64_t)b->charge.raw * capacityWh * (int64_t)(UJ_PER_MWH / 10);
+        if (!remainingValid) {
+            remaining = socEnergy;
+            remainingValid = true;
+        }
+        else {
+            remaining += (socEnergy - remaining) * (100 - blend) / 100;
+        }
+    }
+
+    // Estimated minutes of runtime left at the average system power, -1 if unknown
+    long runtimeMinutes() {
+        if (!remainingValid || avgPower.get().raw <= 0)
+            return -1;
+        if (remaining <= 0)
+            return 0;
+        return (long)(remaining / avgPower.get().raw / 60000);
+    }
+
+    // Energy used on a rail
+    MilliWattHours energyMilliWh(int rail) {
+        return MilliWattHours((int32_t)(totals.energy[rail] / UJ_PER_MWH));
+    }
+
+    // Write a checkpoint if interval ms have passed since the last one
+    void checkpoint(unsigned long interval) {
+        if (millis() - lastCheckpoint >= interval)
+            save();
+    }
+
+    void save() {
+        totals.magic = ENERGY_MAGIC;
+        totals.seq++;
+        totals.crc = recordCrc(&totals);
+
+        // Erase a sector just before its first slot is reused
+        if (slot % ENERGY_SLOTS_PER_SECTOR == 0)
+            _flash.blockErase4K(slotAddress(slot));
+        _flash.writeBytes(slotAddress(slot), (void*)&totals, sizeof(totals));
+
+        slot = (slot + 1) % ENERGY_LOG_SLOTS;
+        lastCheckpoint = millis();
+    }
+
+    void reset() {
+        for (int i = 0; i < NUM_RAILS; i++) {
+            totals.energy[i] = 0;
+            totals.charge[i] = 0;
+        }
+        save();
+    }
+
+    void print(Stream * ui) {
+        ui->println();
+        ui->println("Rail              Wh             Ah");
+        for (int i = 0; i < NUM_RAILS; i++) {
+            char name[8];
+            sprintf(name, "%-6s", RAILS[i].name);
+            ui->print(name);
+            printAmount(ui, totals.energy[i]);
+            ui->print(" ");
+            printAmount(ui, totals.charge[i]);
+            ui->println();
+        }
+        ui->print("Runtime remaining: ");
+        long minutes = runtimeMinutes();
+        if (minutes < 0) {
+            ui->println("unknown");
+        }
+        else {
+            ui->print(minutes);
+            ui->println(" min");
+        }
+    }
+};
+
+// Global energy meter
+EnergyMeter _energy;
+
+#endif
@@ -0,0 +1,295 @@
+#ifndef _EVENTJOURNAL
+
+#define _EVENTJOURNAL
+
+#include <Arduino.h>
+#include <RTCLib.h>
+#include "SystemConfig.h"
+#include "Utils.h"
+
+// Records kept in RAM until the main loop writes them to flash
+#define EVENT_RING 64
+
+#define EVENT_LOG_SECTORS 4
+#define EVENT_SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / sizeof(EventRecord))
+#define EVENT_LOG_SLOTS (EVENT_LOG_SECTORS * EVENT_SLOTS_PER_SECTOR)
+
+// Code of an erased flash slot
+#define EVENT_EMPTY 0xFFFF
+
+// State changes worth keeping, must match the order of the EVENT_TYPES table
+enum EventCode {
+    EVENT_BOOT,
+    EVENT_CAMERA_ON,
+    EVENT_CAMERA_OFF,
+    EVENT_SHUTDOWN,
+    EVENT_HALTED,
+    EVENT_HEARTBEAT_LOST,
+    EVENT_LOW_VOLTAGE,
+    EVENT_VOLTAGE_OK,
+    EVENT_ENV_LIMIT,
+    EVENT_ENV_OK,
+    EVENT_TREND,
+    EVENT_RAIL_ALERT,
+    EVENT_CONFIG,
+    EVENT_CONFIG_SAVE,
+    EVENT_SLEEP,
+    EVENT_WAKE,
+    EVENT_RAIL_ON,
+    EVENT_RAIL_OFF,
+    EVENT_JETSON_READY,
+    EVENT_CODES
+};
+
+struct EventInfo {
+    const char * name; // also the filter of the EVENTS command
+    const char * arg1; // label of each argument, NULL if unused
+    const char * arg2;
+};
+
+constexpr EventInfo EVENT_TYPES[] = {
+    // name,       arg1,      arg2
+    { "BOOT",      "rcause",  NULL },
+    { "CAMON",     NULL,      NULL },
+    { "CAMOFF",    NULL,      NULL },
+    { "SHUTDOWN",  "agent",   NULL },
+    { "HALTED",    NULL,      NULL },
+    { "HBLOST",    "cycles",  NULL },
+    { "LOWVOLT",   NULL,      "mV" },
+    { "VOLTOK",    NULL,      "mV" },
+    { "ENVLIMIT",  "hum",     "value" },
+    { "ENVOK",     NULL,      NULL },
+    { "TREND",     "hum",     "level" },
+    { "RAILALERT", "rail",    "cut" },
+    { "CONFIG",    "uid",     "value" },
+    { "SAVECFG",   NULL,      NULL },
+    { "SLEEP",     "wake",    "in_s" },
+    { "WAKE",      "wake",    "slept_s" },
+    { "RAILON",    "rail",    "peak_mA" },
+    { "RAILOFF",   "rail",    NULL },
+    { "READY",     "source",  "boot_s" },
+};
+
+static_assert(sizeof(EVENT_TYPES) / sizeof(EVENT_TYPES[0]) == EVENT_CODES, "EventCode does not match the EVENT_TYPES table");
+
+// One journal entry, the same in RAM and in flash
+struct EventRecord {
+    uint32_t time; // RTC epoch
+    uint16_t code;
+    uint16_t arg1;
+    int32_t arg2;
+};
+
+static_assert(sizeof(EventRecord) == 12, "EventRecord must stay 12 bytes");
+
+// Which records EVENTS prints
+struct EventFilter {
+    int code; // -1 for all
+    uint32_t from;
+    uint32_t to;
+};
+
+// Binary journal of state changes. add() only copies 12 bytes into a RAM
+// ring, with interrupts held off, so it is safe from an ISR and costs far
+// less than formatting a line. The main loop moves new records into a flash
+// ring with flush(). The flash ring always keeps the sector after the one
+// being written erased, so the end of the journal is found at boot from the
+// first slot of each sector and a search within the last one.
+class EventJournal {
+
+    private:
+    EventRecord ring[EVENT_RING];
+    volatile uint32_t added; // records ever added, ring index is added % EVENT_RING
+    uint32_t flushed;
+    volatile uint32_t clockEpoch; // RTC epoch at clockMillis, set by the main loop
+    volatile uint32_t clockMillis;
+    bool ready; // flash found
+    int slot; // next flash slot to write
+
+    uint32_t slotAddress(int i) {
+        return EVENT_LOG_ADDR + (uint32_t)(i / EVENT_SLOTS_PER_SECTOR) * FLASH_SECTOR_SIZE
+            + (uint32_t)(i % EVENT_SLOTS_PER_SECTOR) * sizeof(EventRecord);
+    }
+
+    void readSlot(int i, EventRecord * r) {
+        _flash.readBytes(slotAddress(i), (void*)r, sizeof(EventRecord));
+    }
+
+    bool slotEmpty(int i) {
+        EventRecord r;
+        readSlot(i, &r);
+        return r.code == EVENT_EMPTY;
+    }
+
+    void eraseSector(int s) {
+        _flash.blockErase4K(EVENT_LOG_ADDR + (uint32_t)s * FLASH_SECTOR_SIZE);
+    }
+
+    void writeSlot(const EventRecord * r) {
+        // Keep the next sector erased before the first write to this one
+        if (slot % EVENT_SLOTS_PER_SECTOR == 0)
+            eraseSector((slot / EVENT_SLOTS_PER_SECTOR + 1) % EVENT_LOG_SECTORS);
+        _flash.writeBytes(slotAddress(slot), (void*)r, sizeof(EventRecord));
+        slot = (slot + 1) % EVENT_LOG_SLOTS;
+    }
+
+    bool matches(const EventRecord * r, const EventFilter * f) {
+        if (r->code >= EVENT_CODES)
+            return false;
+        if (f->code >= 0 && r->code != f->code)
+            return false;
+        return r->time >= f->from && r->time <= f->to;
+    }
+
+    void printRecord(Stream * ui, const EventRecord * r) {
+        char output[96];
+        char timeString[24] = "YYYY-MM-DD hh:mm:ss";
+        DateTime(r->time).toString(timeString);
+        const EventInfo * info = &EVENT_TYPES[r->code];
+        int len = sprintf(output, "%s  %-9s", timeString, info->name);
+        if (info->arg1 != NULL)
+            len += sprintf(output + len, "  %s=%u", info->arg1, r->arg1);
+        if (info->arg2 != NULL)
+            len += sprintf(output + len, "  %s=%ld", info->arg2, (long)r->arg2);
+        ui->println(output);
+    }
+
+    public:
+    uint32_t lost; // records overwritten in RAM before they reached flash
+
+    EventJournal() {
+        added = 0;
+        flushed = 0;
+        clockEpoch = 0;
+        clockMillis = 0;
+        ready = false;
+        slot = 0;
+        lost = 0;
+    }
+
+    // Find the end of the flash journal, records added before this are kept
+    // in RAM and written by the next flush()
+    void begin(bool flashOkay) {
+        ready = flashOkay;
+        if (!ready)
+            return;
+
+        // The last written sector is the one followed by an erased sector
+        int current = -1;
+        for (int s = 0; s < EVENT_LOG_SECTORS; s++) {
+            int next = (s + 1) % EVENT_LOG_SECTORS;
+            if (!slotEmpty(s * EVENT_SLOTS_PER_SECTOR) && slotEmpty(next * EVENT_SLOTS_PER_SECTOR)) {
+                current = s;
+                break;
+            }
+        }
+
+        // Nothing written yet or no erased gap, start over
+        if (current < 0) {
+            eraseSector(0);
+            slot = 0;
+            return;
+        }
+
+        // Written slots are a prefix of the sector
+        int lo = 1;
+        int hi = EVENT_SLOTS_PER_SECTOR;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (slotEmpty(current * EVENT_SLOTS_PER_SECTOR + mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        slot = (current * EVENT_SLOTS_PER_SECTOR + lo) % EVENT_LOG_SLOTS;
+    }
+
+    // Tie the record time to the RTC, call from the main loop before add()
+    // and after anything that held millis()
+    void setClock(uint32_t epoch) {
+        clockEpoch = epoch;
+        clockMillis = millis();
+    }
+
+    // Append a record, safe from interrupt context
+    void add(EventCode code, uint16_t arg1, int32_t arg2) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        EventRecord * r = &ring[added % EVENT_RING];
+        r->time = clockEpoch + (millis() - clockMillis) / 1000;
+        r->code = code;
+        r->arg1 = arg1;
+        r->arg2 = arg2;
+        added = added + 1;
+        __set_PRIMASK(primask);
+    }
+
+    // Write the records added since the last call to flash
+    void flush() {
+        if (!ready)
+            return;
+        while (flushed != added) {
+            EventRecord r;
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            if (added - flushed > EVENT_RING) {
+                lost += added - flushed - EVENT_RING;
+                flushed = added - EVENT_RING;
+            }
+            r = ring[flushed % EVENT_RING];
+            __set_PRIMASK(primask);
+            writeSlot(&r);
+            flushed++;
+        }
+    }
+
+    // Print the matching records, oldest first. Reads the flash journal, or
+    // the RAM ring without flash.
+    void print(Stream * ui, const EventFilter * f) {
+        ui->println();
+        int n = 0;
+        EventRecord r;
+        if (ready) {
+            flush();
+            // The oldest sector follows the erased one after the current,
+            // or the current one if nothing is written to it yet
+            int skip = slot % EVENT_SLOTS_PER_SECTOR == 0 ? 1 : 2;
+            int first = ((slot / EVENT_SLOTS_PER_SECTOR + skip) % EVENT_LOG_SECTORS) * EVENT_SLOTS_PER_SECTOR;
+            for (int i = first; i != slot; i = (i + 1) % EVENT_LOG_SLOTS) {
+                readSlot(i, &r);
+                if (matches(&r, f)) {
+                    printRecord(ui, &r);
+                    n++;
+                }
+            }
+        }
+        else {
+            uint32_t end = added;
+            uint32_t i = end > EVENT_RING ? end - EVENT_RING : 0;
+            for (; i != end; i++) {
+                r = ring[i % EVENT_RING];
+                if (matches(&r, f)) {
+                    printRecord(ui, &r);
+                    n++;
+                }
+            }
+        }
+        char output[64];
+        sprintf(output, "%d events, %lu lost", n, (unsigned long)lost);
+        ui->println(output);
+    }
+
+    // Event code by name, -1 if unknown
+    static int codeByName(const char * name) {
+        for (int i = 0; i < EVENT_CODES; i++) {
+            if (strlen(name) == strlen(EVENT_TYPES[i].name) && strncmp_ci(EVENT_TYPES[i].name, name, strlen(name)) == 0)
+                return i;
+        }
+        return -1;
+    }
+};
+
+// Global event journal
+EventJournal _journal;
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _FIXEDPOINT
+
+#define _FIXEDPOINT
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Fixed point sensor values. Each quantity is an int32 count of a unit tag, the
+// tag's SCALE is the number of counts in one display unit (e.g. mV per V). Mixing
+// units does not compile, and float only shows up in fromFloat()/toFloat() for
+// the libraries that hand us floats.
+
+struct MilliVoltUnit { static const int32_t SCALE = 1000; }; // V
+struct MilliAmpUnit { static const int32_t SCALE = 1000; }; // A
+struct MilliWattUnit { static const int32_t SCALE = 1000; }; // W
+struct MilliWattHourUnit { static const int32_t SCALE = 1000; }; // Wh
+struct CentiDegreeUnit { static const int32_t SCALE = 100; }; // C
+struct PascalUnit { static const int32_t SCALE = 1000; }; // kPa
+struct CentiPercentUnit { static const int32_t SCALE = 100; }; // %
+
+template <class U>
+class Fixed {
+
+    public:
+    int32_t raw;
+
+    Fixed() : raw(0) {}
+
+    explicit Fixed(int32_t raw) : raw(raw) {}
+
+    // Whole display units, e.g. Fixed<MilliVoltUnit>::fromUnits(12) is 12 V
+    static Fixed fromUnits(int32_t units) {
+        return Fixed(units * U::SCALE);
+    }
+
+    // Float in display units, rounded to the nearest count
+    static Fixed fromFloat(float units) {
+        float counts = units * U::SCALE;
+        return Fixed((int32_t)(counts >= 0 ? counts + 0.5f : counts - 0.5f));
+    }
+
+    float toFloat() const {
+        return (float)raw / U::SCALE;
+    }
+
+    Fixed operator+(Fixed o) const { return Fixed(raw + o.raw); }
+    Fixed operator-(Fixed o) const { return Fixed(raw - o.raw); }
+    Fixed operator*(int32_t k) const { return Fixed(raw * k); }
+    Fixed operator/(int32_t k) const { return Fixed(raw / k); }
+    Fixed & operator+=(Fixed o) { raw += o.raw; return *this; }
+    Fixed & operator-=(Fixed o) { raw -= o.raw; return *this; }
+
+    bool operator<(Fixed o) const { return raw < o.raw; }
+    bool operator>(Fixed o) const { return raw > o.raw; }
+    bool operator<=(Fixed o) const { return raw <= o.raw; }
+    bool operator>=(Fixed o) const { return raw >= o.raw; }
+    bool operator==(Fixed o) const { return raw == o.raw; }
+    bool operator!=(Fixed o) const { return raw != o.raw; }
+
+    // Print in display units with the given number of decimals, rounded half
+    // away from zero. Returns the number of chars written like sprintf.
+    int format(char * buf, int decimals) const {
+        int32_t p = 1;
+        for (int i = 0; i < decimals; i++)
+            p *= 10;
+        int64_t scaled = (int64_t)raw * p;
+        int32_t r = (int32_t)((scaled + (raw < 0 ? -U::SCALE / 2 : U::SCALE / 2)) / U::SCALE);
+        uint32_t a = r < 0 ? -r : r;
+        if (decimals == 0)
+            return sprintf(buf, "%s%lu", r < 0 ? "-" : "", (unsigned long)a);
+        return sprintf(buf, "%s%lu.%0*lu", r < 0 ? "-" : "", (unsigned long)(a / p), decimals, (unsigned long)(a % p));
+    }
+};
+
+typedef Fixed<MilliVoltUnit> MilliVolts;
+typedef Fixed<MilliAmpUnit> MilliAmps;
+typedef Fixed<MilliWattUnit> MilliWatts;
+typedef Fixed<MilliWattHourUnit> MilliWattHours;
+typedef Fixed<CentiDegreeUnit> CentiDegrees;
+typedef Fixed<PascalUnit> Pascals;
+typedef Fixed<CentiPercentUnit> CentiPercent;
+
+#endif
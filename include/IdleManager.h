@@ -0,0 +1,323 @@
+#ifndef _IDLEMANAGER
+
+#define _IDLEMANAGER
+
+#include <Arduino.h>
+#include <RTCZero.h>
+#include "SerialRx.h"
+
+// Shortest gap in ms worth a standby. The RTC alarm only matches whole
+// seconds, so shorter gaps are slept in idle.
+#define IDLE_STANDBY_MIN 2000
+
+// Ports that can wake the chip from standby
+#define IDLE_WAKE_PORTS 2
+
+// Generic clock generators set up by the Arduino core and RTCZero
+#define IDLE_GCLK_MAIN 0 // DFLL48M, stops in standby
+#define IDLE_GCLK_RTC 2 // 1024 Hz from XOSC32K, runs in standby
+#define IDLE_GCLK_OSC8M 3 // OSC8M, started on demand in standby
+
+// Processor power states counted by IdleManager
+enum IdleState {
+    IDLE_ACTIVE, // running code
+    IDLE_WFI, // core clock stopped, waiting for the next interrupt
+    IDLE_STANDBY, // all fast clocks stopped until an RTC alarm, UART or EIC wake
+    IDLE_STATES
+};
+
+// What ended a standby
+enum WakeReason {
+    WAKE_ALARM,
+    WAKE_UART,
+    WAKE_OTHER, // EIC, the power button or a rail alert
+    WAKE_REASONS
+};
+
+extern "C" void SysTick_DefaultHandler(void);
+
+// Puts the core to sleep between tasks. Short gaps are slept in WFI, where
+// SysTick still wakes the core every ms so millis() and the Uart interrupts
+// behave as before. Long gaps with nothing to do are slept in standby:
+//
+// - The wake ports are moved onto OSC8M, which starts in a few us, with
+//   start-of-frame detection so the first byte of a command wakes the chip
+//   and is still received.
+// - The EIC is moved onto the RTC clock so the rail alerts and the power
+//   button still see their edges.
+// - The RTC alarm ends the sleep on the last whole second of the gap.
+//
+// millis() does not count in standby. On wake it is advanced by the slept
+// time by replaying SysTick ticks. Standby starts on an RTC second edge, so
+// after an alarm wake the slept time is exact. After an early wake it is
+// known to half a second.
+class IdleManager {
+
+    private:
+    RTCZero * rtc;
+    RxPort * wakePorts[IDLE_WAKE_PORTS];
+    int nWakePorts;
+    uint16_t savedBaud[IDLE_WAKE_PORTS];
+    unsigned long since; // millis() when the counters were cleared
+    bool watching; // waiting for an RTC second edge to start a standby
+    uint32_t watchEpoch;
+
+    static uint8_t sercomIndex(Sercom * s) {
+        if (s == SERCOM0) return 0;
+        if (s == SERCOM1) return 1;
+        if (s == SERCOM2) return 2;
+        if (s == SERCOM3) return 3;
+        if (s == SERCOM4) return 4;
+        return 5;
+    }
+
+    static void setClock(uint8_t id, uint8_t generator) {
+        GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(id) | GCLK_CLKCTRL_GEN(generator) | GCLK_CLKCTRL_CLKEN;
+        while (GCLK->STATUS.bit.SYNCBUSY);
+    }
+
+    static void setGeneratorRunStandby(uint8_t generator) {
+        // Select the generator, then read it back and set RUNSTDBY
+        *((volatile uint8_t *)&GCLK->GENCTRL.reg) = generator;
+        while (GCLK->STATUS.bit.SYNCBUSY);
+        GCLK->GENCTRL.reg |= GCLK_GENCTRL_RUNSTDBY;
+        while (GCLK->STATUS.bit.SYNCBUSY);
+    }
+
+    static void usartEnable(SercomUsart * u, bool on) {
+        u->CTRLA.bit.ENABLE = on;
+        while (u->SYNCBUSY.bit.ENABLE);
+    }
+
+    // BAUD for 16x fractional sampling, the mode Uart::begin() uses
+    static uint16_t fractionalBaud(uint32_t clock, uint32_t baud) {
+        uint32_t times8 = (uint32_t)((uint64_t)clock * 8 / (16 * (uint64_t)baud));
+        return (times8 / 8) | ((times8 % 8) << 13);
+    }
+
+    // Move a wake port onto OSC8M with start-of-frame wake, interrupts are off
+    void armPort(int i) {
+        Sercom * s = wakePorts[i]->getSercom();
+        SercomUsart * u = &s->USART;
+        usartEnable(u, false);
+        setClock(GCLK_CLKCTRL_ID_SERCOM0_CORE_Val + sercomIndex(s), IDLE_GCLK_OSC8M);
+        savedBaud[i] = u->BAUD.reg;
+        u->BAUD.reg = fractionalBaud(8000000, wakePorts[i]->getBaud());
+        u->CTRLA.bit.RUNSTDBY = 1;
+        u->CTRLB.bit.SFDE = 1;
+        while (u->SYNCBUSY.bit.CTRLB);
+        u->INTFLAG.reg = SERCOM_USART_INTFLAG_RXS;
+        u->INTENSET.reg = SERCOM_USART_INTENSET_RXS;
+        usartEnable(u, true);
+    }
+
+    // Put a wake port back on the main clock, returns true if it woke the chip
+    bool restorePort(int i) {
+        Sercom * s = wakePorts[i]->getSercom();
+        SercomUsart * u = &s->USART;
+        bool woke = u->INTFLAG.reg & SERCOM_USART_INTFLAG_RXS;
+        u->INTENCLR.reg = SERCOM_USART_INTENCLR_RXS;
+        u->INTFLAG.reg = SERCOM_USART_INTFLAG_RXS;
+        usartEnable(u, false);
+        u->CTRLB.bit.SFDE = 0;
+        while (u->SYNCBUSY.bit.CTRLB);
+        u->CTRLA.bit.RUNSTDBY = 0;
+        u->BAUD.reg = savedBaud[i];
+        setClock(GCLK_CLKCTRL_ID_SERCOM0_CORE_Val + sercomIndex(s), IDLE_GCLK_MAIN);
+        usartEnable(u, true);
+        return woke;
+    }
+
+    // Stop the core until the next interrupt, SysTick ends it within a ms
+    void wfi() {
+        uint32_t t = micros();
+        SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+        __DSB();
+        __WFI();
+        wfiUs += micros() - t;
+    }
+
+    // Add ms to the millis() counter, one tick at a time like SysTick would
+    static void advanceMillis(uint32_t ms) {
+        while (ms--)
+            SysTick_DefaultHandler();
+    }
+
+    public:
+    uint64_t wfiUs; // time in WFI
+    uint32_t standbyMs; // time in standby
+    unsigned long standbys;
+    unsigned long wakes[WAKE_REASONS];
+    uint32_t wakeLatencyMin; // us from the end of a standby until the loop runs again
+    uint32_t wakeLatencyMax;
+    uint64_t wakeLatencyTotal;
+
+    IdleManager() {
+        rtc = NULL;
+        nWakePorts = 0;
+        watching = false;
+        watchEpoch = 0;
+        clear();
+    }
+
+    // Set up the clocks standby needs, once after the ports are started
+    void begin(RTCZero * rtc, RxPort * port0, RxPort * port1) {
+        this->rtc = rtc;
+        wakePorts[0] = port0;
+        wakePorts[1] = port1;
+        nWakePorts = IDLE_WAKE_PORTS;
+
+        // OSC8M only runs in standby while a wake port asks for it
+        SYSCTRL->OSC8M.bit.ONDEMAND = 1;
+        SYSCTRL->OSC8M.bit.RUNSTDBY = 1;
+        setGeneratorRunStandby(IDLE_GCLK_OSC8M);
+
+        // Errata: the NVM must not power down in sleep or the wake can hang
+        NVMCTRL->CTRLB.bit.SLEEPPRM = NVMCTRL_CTRLB_SLEEPPRM_DISABLED_Val;
+    }
+
+    // Sleep for up to ms, returning early on any interrupt. Call in a loop that
+    // does the pending work between calls. Standby is only used if deep is set
+    // and the gap is long enough, the caller decides whether anything needs
+    // the fast clocks. The calls before a standby are slept in WFI until the
+    // RTC second changes, so the standby starts on a second edge.
+    void sleep(unsigned long ms, bool deep) {
+        if (ms == 0)
+            return;
+        if (!deep || rtc == NULL || ms < IDLE_STANDBY_MIN) {
+            watching = false;
+            wfi();
+            return;
+        }
+
+        uint32_t now = rtc->getEpoch();
+        if (!watching || now == watchEpoch) {
+            watching = true;
+            watchEpoch = now;
+            wfi();
+            return;
+        }
+        watching = false;
+        standby(now, ms / 1000);
+    }
+
+    // Idle until the RTC second changes and return the new epoch, a standby
+    // started right after it sleeps whole seconds
+    uint32_t secondEdge() {
+        uint32_t start = rtc->getEpoch();
+        uint32_t now;
+        while ((now = rtc->getEpoch()) == start)
+            wfi();
+        return now;
+    }
+
+    // Standby from the second edge t0 for up to seconds s. Replaying the
+    // SysTick ticks costs about a ms per second slept, long sleeps timed by
+    // the RTC alone can leave millis() where it stopped with keepMillis off.
+    WakeReason standby(uint32_t t0, uint32_t seconds, bool keepMillis = true) {
+        __disable_irq();
+
+        // Interrupts stay masked, a pending one still ends the WFI and its
+        // handler runs once everything is restored
+        for (int i = 0; i < nWakePorts; i++)
+            armPort(i);
+        setClock(GCLK_CLKCTRL_ID_EIC_Val, IDLE_GCLK_RTC);
+        rtc->setAlarmEpoch(t0 + seconds);
+        rtc->enableAlarm(RTCZero::MATCH_HHMMSS);
+
+        SysTick->CTRL &= ~SysTick_CTRL_TICKINT_Msk;
+        SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+        __DSB();
+        __WFI();
+        uint32_t t = micros();
+
+        SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+        SysTick->CTRL |= SysTick_CTRL_TICKINT_Msk;
+        bool alarm = RTC->MODE2.INTFLAG.bit.ALARM0;
+        rtc->disableAlarm();
+        setClock(GCLK_CLKCTRL_ID_EIC_Val, IDLE_GCLK_MAIN);
+        bool uart = false;
+        for (int i = 0; i < nWakePorts; i++)
+            uart |= restorePort(i);
+
+        // Whole seconds slept, plus half of the second we woke in if early.
+        // A wake before the next second edge is counted as no time at all.
+        uint32_t now = rtc->getEpoch();
+        uint32_t slept = (now - t0) * 1000;
+        if (!alarm && now != t0 && slept < seconds * 1000)
+            slept += 500;
+        uint32_t latency = micros() - t;
+        __enable_irq();
+
+        // With interrupts on so the Uarts are served meanwhile. The state shares
+        // are of millis(), sleeps it does not count are left out.
+        if (keepMillis) {
+            advanceMillis(slept);
+            standbyMs += slept;
+        }
+
+        WakeReason reason = alarm ? WAKE_ALARM : (uart ? WAKE_UART : WAKE_OTHER);
+        standbys++;
+        wakes[reason]++;
+        if (latency < wakeLatencyMin)
+            wakeLatencyMin = latency;
+        if (latency > wakeLatencyMax)
+            wakeLatencyMax = latency;
+        wakeLatencyTotal += latency;
+        return reason;
+    }
+
+    // Time in a state since the counters were cleared
+    uint32_t stateMs(IdleState state) {
+        uint32_t total = millis() - since;
+        uint32_t wfiMs = wfiUs / 1000;
+        switch (state) {
+            case IDLE_WFI:
+                return wfiMs;
+            case IDLE_STANDBY:
+                return standbyMs;
+            default:
+                return total - wfiMs - standbyMs;
+        }
+    }
+
+    void print(Stream * ui) {
+        static const char * states[IDLE_STATES] = { "Active", "WFI", "Standby" };
+        char output[96];
+        uint32_t total = millis() - since;
+        ui->println();
+        ui->println("State     Time (s)  Share");
+        for (int i = 0; i < IDLE_STATES; i++) {
+            uint32_t t = stateMs((IdleState)i);
+            sprintf(output, "%-8s  %8lu  %4lu.%lu %%", states[i], (unsigned long)(t / 1000),
+                (unsigned long)(total > 0 ? (uint64_t)t * 100 / total : 0),
+                (unsigned long)(total > 0 ? (uint64_t)t * 1000 / total % 10 : 0));
+            ui->println(output);
+        }
+        sprintf(output, "Standbys: %lu, woken by alarm %lu, UART %lu, other %lu", standbys,
+            wakes[WAKE_ALARM], wakes[WAKE_UART], wakes[WAKE_OTHER]);
+        ui->println(output);
+        if (standbys > 0) {
+            sprintf(output, "Wake latency (us): min %lu, avg %lu, max %lu", (unsigned long)wakeLatencyMin,
+                (unsigned long)(wakeLatencyTotal / standbys), (unsigned long)wakeLatencyMax);
+            ui->println(output);
+        }
+    }
+
+    void clear() {
+        since = millis();
+        wfiUs = 0;
+        standbyMs = 0;
+        standbys = 0;
+        for (int i = 0; i < WAKE_REASONS; i++)
+            wakes[i] = 0;
+        wakeLatencyMin = 0xFFFFFFFF;
+        wakeLatencyMax = 0;
+        wakeLatencyTotal = 0;
+    }
+};
+
+// Global idle manager
+IdleManager _idle;
+
+#endif
@@ -0,0 +1,232 @@
+#ifndef _JETSONLINK
+
+#define _JETSONLINK
+
+#include <Arduino.h>
+#include "FixedPoint.h"
+#include "Stats.h"
+
+// The Orin counts as running the protocol agent while heartbeats are newer
+// than this in s
+#define JETSON_ALIVE_TIME 30
+
+// Orin rail power that shows the boot has started
+#define JETSON_BOOT_MW 3000
+
+// Band in % around the average Orin power that counts as steady
+#define JETSON_SETTLE_BAND 15
+
+// Lines on the Jetson port that mean the Orin is up, the first one is printed
+// by the agent when it starts, the second is the serial console getty
+#define JETSON_READY_BANNER "BUMREADY"
+#define JETSON_LOGIN_BANNER "login:"
+
+// Where the Orin is in its shutdown, as reported over the control protocol
+enum JetsonHaltState {
+    JETSON_RUNNING,
+    JETSON_HALTING, // shutdown acknowledged, services stopping
+    JETSON_HALTED // filesystems synced, safe to cut power
+};
+
+// Where the Orin is in its boot
+enum JetsonBootState {
+    JETSON_OFF,
+    JETSON_BOOTING, // camera rails on, not ready yet
+    JETSON_READY
+};
+
+// What showed the Orin was ready
+enum JetsonReadySource {
+    READY_NONE,
+    READY_HEARTBEAT, // first heartbeat from the agent
+    READY_BANNER, // ready banner or login prompt on the Jetson port
+    READY_POWER // Orin power steady for JETSONSETTLE s
+};
+
+// Heartbeat and shutdown handshake state of the Orin. The agent on the Orin
+// sends OP_HEARTBEAT every few seconds, OP_HALTING once it starts shutting down
+// and OP_HALTED as the last step before the kernel halts. Times are RTC epoch
+// seconds like the other power timers.
+//
+// After power on the Orin is ready at the first heartbeat, at a ready banner
+// on the Jetson port, or once its rail power has settled after the boot,
+// whichever comes first. The power signature covers an Orin without the agent
+// and with its console elsewhere.
+class JetsonLink {
+
+    private:
+    uint32_t poweredAt; // camera rails switched on
+    uint32_t lastHeartbeat;
+    uint32_t haltedAt;
+    bool seen; // a heartbeat arrived since power on
+    bool drawing; // Orin power went above JETSON_BOOT_MW since power on
+    uint32_t steadySince; // ms timestamp the Orin power entered the band
+    Ewma<MilliWatts> orinPower;
+    uint8_t bannerMatch; // chars of each banner matched so far
+    uint8_t loginMatch;
+    bool announce; // became ready, not reported yet
+
+    void ready(JetsonReadySource source, uint32_t now) {
+        if (bootState != JETSON_BOOTING)
+            return;
+        bootState = JETSON_READY;
+        readySource = source;
+        bootTime = now - poweredAt;
+        bootTimes.update(bootTime);
+        announce = true;
+    }
+
+    // Advance a banner match by one char, true once all of it matched
+    static bool matchBanner(const char * banner, uint8_t * matched, char c) {
+        if (c != banner[*matched])
+            *matched = 0;
+        if (c == banner[*matched])
+            (*matched)++;
+        if (banner[*matched] != '\0')
+            return false;
+        *matched = 0;
+        return true;
+    }
+
+    public:
+    JetsonHaltState state;
+    uint32_t uptime; // Orin uptime in s from the last heartbeat
+    unsigned long heartbeats;
+    unsigned long powerCycles; // watchdog power cycles after a lost heartbeat
+    JetsonBootState bootState;
+    JetsonReadySource readySource;
+    uint32_t bootTime; // s from power on to ready, last boot
+    Welford bootTimes;
+
+    JetsonLink() : orinPower(3) {
+        poweredAt = 0;
+        lastHeartbeat = 0;
+        haltedAt = 0;
+        seen = false;
+        state = JETSON_RUNNING;
+        uptime = 0;
+        heartbeats = 0;
+        powerCycles = 0;
+        bootState = JETSON_OFF;
+        readySource = READY_NONE;
+        bootTime = 0;
+        drawing = false;
+        steadySince = 0;
+        bannerMatch = 0;
+        loginMatch = 0;
+        announce = false;
+    }
+
+    // Start over when the camera rails are switched on
+    void powerOn(uint32_t now) {
+        poweredAt = now;
+        seen = false;
+        state = JETSON_RUNNING;
+        uptime = 0;
+        bootState = JETSON_BOOTING;
+        readySource = READY_NONE;
+        drawing = false;
+        orinPower.clear();
+        bannerMatch = 0;
+        loginMatch = 0;
+        announce = false;
+    }
+
+    void powerOff() {
+        bootState = JETSON_OFF;
+        announce = false;
+    }
+
+    void heartbeat(uint32_t now, uint32_t uptime) {
+        lastHeartbeat = now;
+        this->uptime = uptime;
+        seen = true;
+        heartbeats++;
+        ready(READY_HEARTBEAT, now);
+    }
+
+    // Text on the Jetson port outside protocol frames
+    void text(char c, uint32_t now) {
+        if (bootState != JETSON_BOOTING)
+            return;
+        bool banner = matchBanner(JETSON_READY_BANNER, &bannerMatch, c);
+        bool login = matchBanner(JETSON_LOGIN_BANNER, &loginMatch, c);
+        if (banner || login)
+            ready(READY_BANNER, now);
+    }
+
+    // An Orin rail sample, timestamp in ms. The boot shows as a rise above
+    // JETSON_BOOT_MW with large swings, ready is power staying within
+    // JETSON_SETTLE_BAND of its average for settle s. A settle of 0 turns
+    // the power signature off.
+    void power(uint32_t timestamp, MilliWatts p, uint32_t settle, uint32_t now) {
+        if (bootState != JETSON_BOOTING || settle == 0)
+            return;
+        if (!drawing) {
+            if (p < MilliWatts(JETSON_BOOT_MW))
+                return;
+            drawing = true;
+            steadySince = timestamp;
+        }
+        MilliWatts avg = orinPower.update(p);
+        if (abs(p.raw - avg.raw) > avg.raw * JETSON_SETTLE_BAND / 100)
+            steadySince = timestamp;
+        else if (timestamp - steadySince >= settle * 1000)
+            ready(READY_POWER, now);
+    }
+
+    bool isReady() {
+        return bootState == JETSON_READY;
+    }
+
+    // True once after the Orin became ready
+    bool takeReady() {
+        bool r = announce;
+        announce = false;
+        return r;
+    }
+
+    static const char * sourceName(JetsonReadySource source) {
+        static const char * names[] = { "none", "heartbeat", "banner", "power" };
+        return names[source];
+    }
+
+    void halting() {
+        if (state == JETSON_RUNNING)
+            state = JETSON_HALTING;
+    }
+
+    void halted(uint32_t now) {
+        if (state != JETSON_HALTED)
+            haltedAt = now;
+        state = JETSON_HALTED;
+    }
+
+    // True if the Orin speaks the protocol, without it the controller falls
+    // back to the shell command and the Orin rail power
+    bool isAlive(uint32_t now) {
+        return seen && now - lastHeartbeat <= JETSON_ALIVE_TIME;
+    }
+
+    // True once the heartbeat has been missing for timeout s, or never came
+    // within bootGrace s of power on. A timeout of 0 disables the check.
+    bool heartbeatLost(uint32_t now, uint32_t timeout, uint32_t bootGrace) {
+        if (timeout == 0 || state != JETSON_RUNNING)
+            return false;
+        if (!seen)
+            return now - poweredAt > bootGrace;
+        return now - lastHeartbeat > timeout;
+    }
+
+    // True grace s after the Orin reported halted
+    bool readyToCut(uint32_t now, uint32_t grace) {
+        return state == JETSON_HALTED && now - haltedAt >= grace;
+    }
+
+    // Seconds since the last heartbeat, -1 if none since power on
+    long heartbeatAge(uint32_t now) {
+        return seen ? (long)(now - lastHeartbeat) : -1;
+    }
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef _MATHBENCH
+
+#define _MATHBENCH
+
+#include <Arduino.h>
+#include "FixedPoint.h"
+#include "Stats.h"
+
+#define BENCH_SAMPLES 256
+
+// The kernels below also build on the host, see tools/mathbench. Only the
+// cycle counter and the BENCHMATH command need the target.
+#ifdef ARDUINO
+
+// Free running cycle count, SysTick counts down from LOAD once per ms
+uint32_t benchCycles() {
+    uint32_t ms, ticks;
+    do {
+        ms = millis();
+        ticks = SysTick->VAL;
+    } while (ms != millis());
+    return ms * (SysTick->LOAD + 1) + (SysTick->LOAD - ticks);
+}
+
+#endif
+
+// Synthetic INA260 bus voltage and power register counts around 12 V / 20 W,
+// the same sequence on every run so the checksums can be compared between builds
+struct BenchInput {
+    uint16_t voltage;
+    uint16_t power;
+};
+
+void benchInputs(BenchInput * in, int n) {
+    uint32_t x = 12345;
+    for (int i = 0; i < n; i++) {
+        x = x * 1103515245 + 12345;
+        in[i].voltage = 9600 + ((x >> 16) % 800);
+        in[i].power = 2000 + ((x >> 8) % 400);
+    }
+}
+
+// The sensor pipeline per sample: register -> scaled -> average -> threshold -> log
+// text, once as the old float code did it and once in fixed point. Both return a
+// checksum of the log text and the number of threshold hits.
+uint32_t benchFloat(const BenchInput * in, int n, float lowVoltage, int * hits) {
+    MovingAverage<float> avg(64);
+    uint32_t sum = 0;
+    char output[32];
+    *hits = 0;
+    for (int i = 0; i < n; i++) {
+        float v = in[i].voltage * 1.25;
+        float p = in[i].power * 10.0;
+        if (avg.update(v) < lowVoltage)
+            (*hits)++;
+        sprintf(output, ",%0.2f,%0.2f", v / 1000, p / 1000);
+        for (char * c = output; *c; c++)
+            sum = sum * 31 + *c;
+    }
+    return sum;
+}
+
+uint32_t benchFixed(const BenchInput * in, int n, MilliVolts lowVoltage, int * hits) {
+    MovingAverage<MilliVolts> avg(64);
+    uint32_t sum = 0;
+    char output[32];
+    *hits = 0;
+    for (int i = 0; i < n; i++) {
+        MilliVolts v((int32_t)in[i].voltage * 5 / 4);
+        MilliWatts p((int32_t)in[i].power * 10);
+        if (avg.update(v) < lowVoltage)
+            (*hits)++;
+        int len = 0;
+        output[len++] = ',';
+        len += v.format(output + len, 2);
+        output[len++] = ',';
+        p.format(output + len, 2);
+        for (char * c = output; *c; c++)
+            sum = sum * 31 + *c;
+    }
+    return sum;
+}
+
+#ifdef ARDUINO
+
+// BENCHMATH command, cycles per sample for both pipelines. The checksums can
+// differ where a float value sits on a rounding boundary of the log text, the
+// threshold hit counts should match.
+void benchMath(Stream * ui, int lowVoltage) {
+    static BenchInput in[BENCH_SAMPLES];
+    benchInputs(in, BENCH_SAMPLES);
+
+    int floatHits, fixedHits;
+
+    uint32_t start = benchCycles();
+    uint32_t floatSum = benchFloat(in, BENCH_SAMPLES, (float)lowVoltage, &floatHits);
+    uint32_t floatCycles = benchCycles() - start;
+
+    start = benchCycles();
+    uint32_t fixedSum = benchFixed(in, BENCH_SAMPLES, MilliVolts(lowVoltage), &fixedHits);
+    uint32_t fixedCycles = benchCycles() - start;
+
+    char output[96];
+    ui->println();
+    sprintf(output, "Samples: %d", BENCH_SAMPLES);
+    ui->println(output);
+    sprintf(output, "Float: %lu cycles/sample, checksum 0x%08lX, %d below threshold",
+        (unsigned long)(floatCycles / BENCH_SAMPLES), (unsigned long)floatSum, floatHits);
+    ui->println(output);
+    sprintf(output, "Fixed: %lu cycles/sample, checksum 0x%08lX, %d below threshold",
+        (unsigned long)(fixedCycles / BENCH_SAMPLES), (unsigned long)fixedSum, fixedHits);
+    ui->println(output);
+    sprintf(output, "Per rail per loop saved: %ld cycles",
+        (long)(floatCycles - fixedCycles) / BENCH_SAMPLES);
+    ui->println(output);
+}
+
+#endif
+
+#endif
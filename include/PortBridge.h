@@ -0,0 +1,110 @@
+#ifndef _PORTBRIDGE
+
+#define _PORTBRIDGE
+
+#include <Arduino.h>
+#include "Config.h"
+#include "Utils.h"
+
+// Max bytes moved per direction on each service() call
+#define BRIDGE_CHUNK 64
+
+// Background pass through between a user port and a hardware port. Each
+// service() call moves whatever is waiting in the UART receive rings across in
+// chunks, so the main loop keeps running while a user talks to an instrument.
+// The user ends the bridge with PORT_BREAK_CHAR.
+class PortBridge {
+
+    private:
+    Stream * user;
+    Stream * port;
+    bool localecho;
+    uint8_t chunk[BRIDGE_CHUNK];
+
+    // Move up to BRIDGE_CHUNK bytes, returns the number moved
+    int pump(Stream * from, Stream * to) {
+        int n = from->available();
+        if (n > BRIDGE_CHUNK)
+            n = BRIDGE_CHUNK;
+        for (int i = 0; i < n; i++)
+            chunk[i] = from->read();
+        if (n > 0)
+            to->write(chunk, n);
+        return n;
+    }
+
+    public:
+    unsigned long toPort;
+    unsigned long toUser;
+
+    PortBridge() {
+        user = NULL;
+        port = NULL;
+        localecho = false;
+        toPort = 0;
+        toUser = 0;
+    }
+
+    void start(Stream * user, Stream * port, bool localecho) {
+        this->user = user;
+        this->port = port;
+        this->localecho = localecho;
+        toPort = 0;
+        toUser = 0;
+    }
+
+    void stop() {
+        if (user != NULL) {
+            user->println();
+            user->println("Port pass through ended");
+        }
+        user = NULL;
+        port = NULL;
+    }
+
+    bool isActive() {
+        return user != NULL;
+    }
+
+    // True if s is either end of an active bridge
+    bool isBridged(Stream * s) {
+        return s != NULL && (s == user || s == port);
+    }
+
+    // Move pending data both ways, call from the main loop as often as possible
+    void service() {
+        if (!isActive())
+            return;
+
+        // User to port, stopping at the break char
+        int n = user->available();
+        if (n > BRIDGE_CHUNK)
+            n = BRIDGE_CHUNK;
+        bool brk = false;
+        for (int i = 0; i < n; i++) {
+            chunk[i] = user->read();
+            if (chunk[i] == PORT_BREAK_CHAR) {
+                n = i;
+                brk = true;
+                break;
+            }
+        }
+        if (n > 0) {
+            port->write(chunk, n);
+            if (localecho)
+                user->write(chunk, n);
+            toPort += n;
+        }
+        if (brk) {
+            stop();
+            return;
+        }
+
+        toUser += pump(port, user);
+    }
+};
+
+// Global port bridge
+PortBridge _bridge;
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef _POWERRAILS
+
+#define _POWERRAILS
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <Adafruit_INA260.h>
+
+#include "Config.h"
+#include "FixedPoint.h"
+
+// INA260 measurement registers and their LSBs
+#define INA260_REG_CURRENT_RAW 0x01 // signed, 1.25 mA
+#define INA260_REG_BUSVOLTAGE_RAW 0x02 // 1.25 mV
+#define INA260_REG_POWER_RAW 0x03 // 10 mW
+
+// System power states, rails change their sampling profile with these
+enum PowerState {
+    POWER_OFF, // camera off
+    POWER_BOOTING, // camera rails just switched on
+    POWER_ON, // camera running
+    POWER_SHUTDOWN // waiting for the Orin to halt
+};
+
+// Which power state a rail is switched with
+enum RailGroup {
+    RAIL_ALWAYS, // always powered
+    RAIL_CAMERA, // on while the camera is on
+    RAIL_STANDBY // on while the camera is off
+};
+
+// INA260 sampling settings
+struct SamplingProfile {
+    INA260_AveragingCount averaging;
+    INA260_ConversionTime conversionTime;
+    INA260_MeasurementMode mode;
+};
+
+// Static settings for one INA260 monitored power rail
+struct RailConfig {
+    uint8_t address;
+    const char * name;
+    RailGroup group;
+    int powerPin; // GPIO switching the rail, NO_PIN if not switched
+    int alertPin; // GPIO wired to the INA260 alert output, NO_PIN if not wired
+    INA260_AveragingCount averaging;
+    INA260_ConversionTime conversionTime;
+    const char * limitParam; // config param with the overcurrent limit, NULL if none
+    int alertLimit; // default overcurrent limit in mA, 0 = no alert
+};
+
+// Rail indices, must match the order of the RAILS table
+enum RailIndex {
+    RAIL_SYS,
+    RAIL_PROBE,
+    RAIL_ORIN,
+    RAIL_DISP,
+    RAIL_CAM
+};
+
+// To add a rail, add a line here and an entry to RailIndex
+constexpr RailConfig RAILS[] = {
+    // addr, name,   group,        power pin,   alert pin,   averaging,        conversion time,    limit param, alert limit
+    { 0x40, "SYS",   RAIL_ALWAYS,  NO_PIN,      SYS_ALERT,   INA260_COUNT_256, INA260_TIME_558_us, NULL,        0 },
+    { 0x41, "PROBE", RAIL_STANDBY, PROBE_POWER, PROBE_ALERT, INA260_COUNT_256, INA260_TIME_558_us, PROBEILIMIT, 5000 },
+    { 0x42, "ORIN",  RAIL_CAMERA,  ORIN_POWER,  ORIN_ALERT,  INA260_COUNT_256, INA260_TIME_558_us, ORINILIMIT,  8000 },
+    { 0x44, "DISP",  RAIL_CAMERA,  DISP_POWER,  DISP_ALERT,  INA260_COUNT_256, INA260_TIME_558_us, DISPILIMIT,  3000 },
+    { 0x45, "CAM",   RAIL_CAMERA,  CAM_POWER,   CAM_ALERT,   INA260_COUNT_256, INA260_TIME_558_us, CAMILIMIT,   5000 },
+};
+
+constexpr int NUM_RAILS = sizeof(RAILS) / sizeof(RAILS[0]);
+
+static_assert(RAIL_CAM == NUM_RAILS - 1, "RailIndex does not match the RAILS table");
+
+// Latest readings of all rails, kept as arrays per quantity so the update loop
+// and the consumers walk contiguous memory
+template <int N>
+struct RailReadings {
+    MilliAmps current[N];
+    MilliVolts voltage[N];
+    MilliWatts power[N];
+};
+
+// Driver for a bank of INA260 rails described by a RailConfig table
+template <int N>
+class RailBank {
+
+    private:
+    const RailConfig * table;
+    Adafruit_INA260 ina[N];
+    bool present[N];
+    SamplingProfile active[N];
+    RailReadings<N> last; // last good reading of each rail
+
+    // Read a 16 bit register, the INA260 sends the MSB first. False on an
+    // I2C error, value is left alone then.
+    bool readRegister(int i, uint8_t reg, uint16_t * value) {
+        Wire.beginTransmission(table[i].address);
+        Wire.write(reg);
+        if (Wire.endTransmission(false) != 0)
+            return false;
+        Wire.requestFrom(table[i].address, (uint8_t)2);
+        if (Wire.available() < 2)
+            return false;
+        uint16_t hi = Wire.read();
+        *value = (hi << 8) | Wire.read();
+        return true;
+    }
+
+    // Register counts to units, 1.25 = 5/4 so no float is needed
+    MilliAmps currentFromRaw(uint16_t raw) {
+        return MilliAmps((int32_t)(int16_t)raw * 5 / 4);
+    }
+
+    MilliVolts voltageFromRaw(uint16_t raw) {
+        return MilliVolts((int32_t)raw * 5 / 4);
+    }
+
+    MilliWatts powerFromRaw(uint16_t raw) {
+        return MilliWatts((int32_t)raw * 10);
+    }
+
+    public:
+    unsigned long readErrors[N]; // reads that failed on the bus
+
+    RailBank(const RailConfig (&table)[N]) {
+        this->table = table;
+        for (int i = 0; i < N; i++) {
+            present[i] = false;
+            readErrors[i] = 0;
+            last.current[i] = MilliAmps(0);
+            last.voltage[i] = MilliVolts(0);
+            last.power[i] = MilliWatts(0);
+        }
+    }
+
+    // Probe and configure every rail, returns false if any rail is missing
+    bool begin() {
+        bool allPresent = true;
+        for (int i = 0; i < N; i++) {
+            present[i] = ina[i].begin(table[i].address);
+            if (!present[i]) {
+                DEBUGPORT.print("Couldn't find ");
+                DEBUGPORT.print(table[i].name);
+                DEBUGPORT.println(" INA260");
+                allPresent = false;
+                continue;
+            }
+            DEBUGPORT.print(table[i].name);
+            DEBUGPORT.println(" INA260 OK");
+
+            // set the number of samples to average
+            ina[i].setAveragingCount(table[i].averaging);
+            // set the time over which to measure the current and bus voltage
+            ina[i].setVoltageConversionTime(table[i].conversionTime);
+            ina[i].setCurrentConversionTime(table[i].conversionTime);
+            ina[i].setMode(INA260_MODE_CONTINUOUS);
+            active[i] = defaultProfile(i);
+        }
+        return allPresent;
+    }
+
+    // The sampling profile from the rail table
+    SamplingProfile defaultProfile(int i) {
+        SamplingProfile p = { table[i].averaging, table[i].conversionTime, INA260_MODE_CONTINUOUS };
+        return p;
+    }
+
+    // Reconfigure a running rail, only registers that change are written
+    void applyProfile(int i, const SamplingProfile & p) {
+        if (!present[i])
+            return;
+        if (p.averaging != active[i].averaging) {
+            ina[i].setAveragingCount(p.averaging);
+        }
+        if (p.conversionTime != active[i].conversionTime) {
+            ina[i].setVoltageConversionTime(p.conversionTime);
+            ina[i].setCurrentConversionTime(p.conversionTime);
+        }
+        if (p.mode != active[i].mode) {
+            ina[i].setMode(p.mode);
+        }
+        active[i] = p;
+    }
+
+    // Pick each rail's profile for the power state. Rails in transition get the
+    // fast profile, rails that are switched off get the idle profile and the
+    // rest run with the settings from the rail table.
+    void applyState(PowerState state, const SamplingProfile & fast, const SamplingProfile & idle) {
+        for (int i = 0; i < N; i++) {
+            bool railOn = table[i].group == RAIL_ALWAYS
+                || (table[i].group == RAIL_CAMERA && state != POWER_OFF)
+                || (table[i].group == RAIL_STANDBY && state == POWER_OFF);
+            bool transition = state == POWER_BOOTING || state == POWER_SHUTDOWN;
+
+            if (transition && table[i].group != RAIL_ALWAYS) {
+                applyProfile(i, fast);
+            }
+            else if (!railOn) {
+                applyProfile(i, idle);
+            }
+            else {
+                applyProfile(i, defaultProfile(i));
+            }
+        }
+    }
+
+    // Read every rail into r, missing rails read as zero. The registers are
+    // read directly and scaled in integer math, the library would go through float.
+    // A rail whose read fails holds its last good reading and its bit is left
+    // out of the returned mask.
+    uint8_t read(RailReadings<N> * r) {
+        uint8_t valid = 0;
+        for (int i = 0; i < N; i++) {
+            // Powered down rails keep their last conversion, report them as off
+            if (!present[i] || active[i].mode == INA260_MODE_SHUTDOWN) {
+                r->current[i] = MilliAmps(0);
+                r->voltage[i] = MilliVolts(0);
+                r->power[i] = MilliWatts(0);
+                valid |= 1 << i;
+                continue;
+            }
+            uint16_t current, voltage, power;
+            if (readRegister(i, INA260_REG_CURRENT_RAW, &current)
+                && readRegister(i, INA260_REG_BUSVOLTAGE_RAW, &voltage)
+                && readRegister(i, INA260_REG_POWER_RAW, &power)) {
+                last.current[i] = currentFromRaw(current);
+                last.voltage[i] = voltageFromRaw(voltage);
+                last.power[i] = powerFromRaw(power);
+                valid |= 1 << i;
+            }
+            else {
+                readErrors[i]++;
+            }
+            r->current[i] = last.current[i];
+            r->voltage[i] = last.voltage[i];
+            r->power[i] = last.power[i];
+        }
+        return valid;
+    }
+
+    // Program the INA260 Mask/Enable and Alert Limit registers. The limit is the
+    // raw register value, the library writes it as is. Alerts are latched until
+    // the flag is read back with alertTriggered().
+    void configureAlert(int i, INA260_AlertType type, int rawLimit) {
+        if (!present[i])
+            return;
+        ina[i].setAlertPolarity(INA260_ALERT_POLARITY_NORMAL);
+        ina[i].setAlertLatch(INA260_ALERT_LATCH_ENABLED);
+        ina[i].setAlertLimit(rawLimit);
+        ina[i].setAlertType(type);
+    }
+
+    // True once a rail has finished a conversion, or if it is missing. Reads
+    // the Mask/Enable register, so call it before the alerts are set up.
+    bool conversionReady(int i) {
+        return !present[i] || ina[i].conversionReady();
+    }
+
+    // Read and clear the latched alert flag
+    bool alertTriggered(int i) {
+        if (!present[i])
+            return false;
+        return ina[i].alertFunctionFlag();
+    }
+
+    // Single reads, a missing rail or a failed read gives the last good value
+    MilliAmps readCurrent(int i) {
+        uint16_t raw;
+        if (!present[i])
+            return MilliAmps(0);
+        if (!readRegister(i, INA260_REG_CURRENT_RAW, &raw)) {
+            readErrors[i]++;
+            return last.current[i];
+        }
+        return currentFromRaw(raw);
+    }
+
+    MilliVolts readBusVoltage(int i) {
+        uint16_t raw;
+        if (!present[i])
+            return MilliVolts(0);
+        if (!readRegister(i, INA260_REG_BUSVOLTAGE_RAW, &raw)) {
+            readErrors[i]++;
+            return last.voltage[i];
+        }
+        return voltageFromRaw(raw);
+    }
+
+    const char * name(int i) {
+        return table[i].name;
+    }
+
+    bool isPresent(int i) {
+        return present[i];
+    }
+};
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef _POWERSEQUENCER
+
+#define _POWERSEQUENCER
+
+#include <Arduino.h>
+#include "Config.h"
+#include "EventJournal.h"
+#include "PowerRails.h"
+#include "Sensors.h"
+#include "SystemConfig.h"
+#include "TaskSupervisor.h"
+
+// mV a switched rail may sit below the SYS rail once it is up
+#define SEQUENCE_VDROP 1000
+
+// Readings in a row within SEQSETTLEMA of each other that count as settled
+#define SEQUENCE_STABLE 3
+
+// One rail switch of a power sequence
+struct SequenceStep {
+    RailIndex rail;
+    bool on;
+    const char * delayParam; // config param with the ms to wait first, NULL for none
+};
+
+// The Orin goes first so it starts booting while the other rails come up one
+// at a time, the probe rail is only dropped once the camera rails are up
+constexpr SequenceStep CAMERA_ON_SEQUENCE[] = {
+    // rail,      on,    delay param
+    { RAIL_ORIN,  true,  SEQORINDELAY },
+    { RAIL_DISP,  true,  SEQDISPDELAY },
+    { RAIL_CAM,   true,  SEQCAMDELAY },
+    { RAIL_PROBE, false, NULL },
+};
+
+constexpr SequenceStep CAMERA_OFF_SEQUENCE[] = {
+    // rail,      on,    delay param
+    { RAIL_CAM,   false, NULL },
+    { RAIL_DISP,  false, SEQOFFDELAY },
+    { RAIL_ORIN,  false, SEQOFFDELAY },
+    { RAIL_PROBE, true,  SEQOFFDELAY },
+};
+
+// What the sequencer saw when it last switched a rail
+struct RailTransition {
+    bool on;
+    uint32_t changedAt; // millis()
+    MilliAmps peak; // highest current after the last switch on
+    MilliAmps maxPeak;
+    uint16_t settleMs; // time to settle after the last switch on
+    bool settled; // false if the last switch on ran into SEQSETTLE
+    uint16_t ons;
+    uint16_t timeouts;
+};
+
+// Switches the rails one at a time. After a rail is switched on its INA260 is
+// put on the fastest conversion and polled until the rail voltage is up and
+// the current has stopped moving, which is the settle check and also catches
+// the inrush peak. The next rail only starts after its delay, so the inrush
+// currents never add up on the battery bus. The caller sets the sampling
+// profiles for the new power state afterwards.
+class PowerSequencer {
+
+    private:
+
+    void pause(uint32_t ms) {
+        uint32_t start = millis();
+        while (millis() - start < ms)
+            _supervisor.kick();
+    }
+
+    void switchOn(int i, uint32_t settleLimit, int32_t settleMa) {
+        RailTransition * r = &rails[i];
+        SamplingProfile inrush = { INA260_COUNT_1, INA260_TIME_140_us, INA260_MODE_CONTINUOUS };
+        _rails.applyProfile(i, inrush);
+        MilliVolts sys = _rails.readBusVoltage(RAIL_SYS);
+
+        digitalWrite(RAILS[i].powerPin, HIGH);
+        uint32_t t0 = micros();
+        r->on = true;
+        r->changedAt = millis();
+        r->ons++;
+        r->peak = MilliAmps(0);
+        r->settled = false;
+
+        int32_t last = -1;
+        int stable = 0;
+        while (micros() - t0 < settleLimit * 1000UL) {
+            _supervisor.kick();
+            if (!_rails.isPresent(i))
+                continue;
+            MilliAmps c = _rails.readCurrent(i);
+            if (c > r->peak)
+                r->peak = c;
+            MilliVolts v = _rails.readBusVoltage(i);
+            if (v.raw >= sys.raw - SEQUENCE_VDROP && last >= 0 && abs(c.raw - last) <= settleMa) {
+                if (++stable >= SEQUENCE_STABLE) {
+                    r->settled = true;
+                    break;
+                }
+            }
+            else {
+                stable = 0;
+            }
+            last = c.raw;
+        }
+
+        r->settleMs = (micros() - t0) / 1000;
+        if (r->peak > r->maxPeak)
+            r->maxPeak = r->peak;
+        if (!r->settled && _rails.isPresent(i))
+            r->timeouts++;
+        _journal.add(EVENT_RAIL_ON, i, r->peak.raw);
+    }
+
+    void switchOff(int i) {
+        digitalWrite(RAILS[i].powerPin, LOW);
+        markOff(i);
+        _journal.add(EVENT_RAIL_OFF, i, 0);
+    }
+
+    public:
+    RailTransition rails[NUM_RAILS];
+
+    PowerSequencer() {
+        for (int i = 0; i < NUM_RAILS; i++) {
+            // setup() starts with the standby rails on
+            rails[i].on = RAILS[i].group != RAIL_CAMERA;
+            rails[i].changedAt = 0;
+            rails[i].peak = MilliAmps(0);
+            rails[i].maxPeak = MilliAmps(0);
+            rails[i].settleMs = 0;
+            rails[i].settled = true;
+            rails[i].ons = 0;
+            rails[i].timeouts = 0;
+        }
+    }
+
+    // Run a sequence, immediate skips the delays to cut power in a fault.
+    // Main loop only: the delays and the settle polling need millis() and
+    // micros() to advance, which they don't inside an interrupt handler.
+    // A camera-on sequence can take about 20 s with the longest delays, so
+    // it holds the loop for TASK_SAFETY like a prompt does, unless a CLI
+    // prompt already holds it.
+    template <int N>
+    void run(const SequenceStep (&steps)[N], SystemConfig & cfg, bool immediate = false) {
+        bool held = _supervisor.isHeld();
+        if (!held)
+            _supervisor.hold(TASK_SAFETY);
+        for (int s = 0; s < N; s++) {
+            if (steps[s].delayParam != NULL && !immediate)
+                pause(cfg.getInt(steps[s].delayParam));
+            setRail(steps[s].rail, steps[s].on, cfg);
+        }
+        if (!held)
+            _supervisor.release();
+    }
+
+    // Switch one rail, measuring the inrush if it goes on. Rails without a
+    // power pin and rails already in that state are left alone.
+    void setRail(int i, bool on, SystemConfig & cfg) {
+        if (RAILS[i].powerPin == NO_PIN || rails[i].on == on)
+            return;
+        if (on)
+            switchOn(i, cfg.getInt(SEQSETTLE), cfg.getInt(SEQSETTLEMA));
+        else
+            switchOff(i);
+    }
+
+    // A rail was cut outside the sequencer, by the alert ISR
+    void markOff(int i) {
+        rails[i].on = false;
+        rails[i].changedAt = millis();
+    }
+
+    bool isOn(int i) {
+        return rails[i].on;
+    }
+
+    // Rail index by name, -1 if there is no switched rail by that name
+    static int railByName(const char * name) {
+        for (int i = 0; i < NUM_RAILS; i++) {
+            if (RAILS[i].powerPin != NO_PIN && strlen(name) == strlen(RAILS[i].name)
+                && strncmp_ci(RAILS[i].name, name, strlen(name)) == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    void print(Stream * ui) {
+        char output[96];
+        uint32_t now = millis();
+        ui->println();
+        ui->println("Rail   State  For (s)  Ons  Peak (mA)  Max (mA)  Settle (ms)  Timeouts");
+        for (int i = 0; i < NUM_RAILS; i++) {
+            if (RAILS[i].powerPin == NO_PIN)
+                continue;
+            const RailTransition * r = &rails[i];
+            sprintf(output, "%-5s  %-5s  %7lu  %3u  %9ld  %8ld  %11u%s  %8u", RAILS[i].name,
+                r->on ? "on" : "off", (unsigned long)((now - r->changedAt) / 1000), r->ons,
+                (long)r->peak.raw, (long)r->maxPeak.raw, r->settleMs, r->settled ? " " : "!", r->timeouts);
+            ui->println(output);
+        }
+        int len = sprintf(output, "Read errors:");
+        for (int i = 0; i < NUM_RAILS; i++)
+            len += sprintf(output + len, " %s %lu", RAILS[i].name, _rails.readErrors[i]);
+        ui->println(output);
+    }
+};
+
+// Global power sequencer
+PowerSequencer _sequencer;
+
+#endif
@@ -4,6 +4,8 @@
 
 #include <Arduino.h>
 #include "Config.h"
+#include "DataBus.h"
+#include "TxQueue.h"
 
 #define MAX_BUFFER_LENGTH 256
 
@@ -65,9 +67,22 @@ class RBRInstrument {
             newData = true;
         }
 
+        if (newData)
+            publishSample();
+
         return newData;
     }
 
+    // Publish the last parsed values on the data bus
+    void publishSample() {
+        CtdSample * s = _bus.ctd.claim();
+        s->timestamp = millis();
+        s->pressure = dBar;
+        s->temperature = temp;
+        s->conductivity = cond;
+        _bus.ctd.publish();
+    }
+
     void readData(Stream * port) {
         
         if (port != NULL && port->available()) {
@@ -83,8 +98,7 @@ class RBRInstrument {
                             parseData(buffer);
                             bufferIndex = 0;
                             if (echoData) {
-                                UI1.println(buffer);
-                                UI2.println(buffer);
+                                _tx.printAll(buffer, TX_TELEMETRY, TX_UI1 | TX_UI2);
                             }
                             
                         }
@@ -0,0 +1,124 @@
+#ifndef _RAILALERTS
+
+#define _RAILALERTS
+
+#include <Arduino.h>
+#include "Config.h"
+#include "EventJournal.h"
+#include "PowerRails.h"
+
+#define MAX_ALERT_EVENTS 16
+#define MAX_ALERT_RAILS 8
+
+// INA260 register LSBs in uA/uV, used to convert limits to raw register values
+#define INA260_CURRENT_LSB 1250
+#define INA260_VOLTAGE_LSB 1250
+
+struct RailAlertEvent {
+    uint32_t timestamp; // millis() when the alert line fired
+    uint8_t rail;
+    bool powerCut; // the ISR switched the rail off
+};
+
+// Queue from the alert ISRs to the main loop, single producer and single consumer
+// so only the head is written from interrupt context
+class RailAlertQueue {
+
+    private:
+    RailAlertEvent events[MAX_ALERT_EVENTS];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+
+    public:
+    volatile uint32_t overflows;
+
+    RailAlertQueue() {
+        head = 0;
+        tail = 0;
+        overflows = 0;
+    }
+
+    // Called from interrupt context, drops the event if the queue is full
+    void push(uint8_t rail, bool powerCut) {
+        uint8_t next = (head + 1) % MAX_ALERT_EVENTS;
+        if (next == tail) {
+            overflows++;
+            return;
+        }
+        events[head].timestamp = millis();
+        events[head].rail = rail;
+        events[head].powerCut = powerCut;
+        head = next;
+    }
+
+    bool pending() {
+        return tail != head;
+    }
+
+    bool pop(RailAlertEvent * e) {
+        if (tail == head)
+            return false;
+        *e = events[tail];
+        tail = (tail + 1) % MAX_ALERT_EVENTS;
+        return true;
+    }
+};
+
+// Global alert queue
+RailAlertQueue _railAlerts;
+
+// Fast path, runs in the EIC interrupt. Cut the rail first, everything that
+// needs the I2C bus is left to the main loop.
+void onRailAlert(int rail) {
+    bool cut = false;
+    if (RAILS[rail].powerPin != NO_PIN) {
+        digitalWrite(RAILS[rail].powerPin, LOW);
+        cut = true;
+    }
+    _railAlerts.push(rail, cut);
+    _journal.add(EVENT_RAIL_ALERT, rail, cut);
+}
+
+template <int RAIL>
+void railAlertISR() {
+    onRailAlert(RAIL);
+}
+
+// attachInterrupt() takes no arguments, so each rail gets its own handler
+typedef void (*AlertHandler)(void);
+const AlertHandler railAlertHandlers[MAX_ALERT_RAILS] = {
+    railAlertISR<0>, railAlertISR<1>, railAlertISR<2>, railAlertISR<3>,
+    railAlertISR<4>, railAlertISR<5>, railAlertISR<6>, railAlertISR<7>
+};
+
+static_assert(NUM_RAILS <= MAX_ALERT_RAILS, "Add alert handlers for the extra rails");
+
+// Wire the alert lines of all rails to EIC interrupts. The EIC has one
+// handler per EXTINT line and attachInterrupt() replaces it silently, so a
+// pin on a line the power button or another rail already uses is skipped.
+// Without enabled the pins are left alone and the rails are only protected
+// by the loop's checks.
+void attachRailAlerts(bool enabled) {
+    if (!enabled) {
+        DEBUGPORT.println("Rail alert pins not armed, RAILALERTPINS = 0");
+        return;
+    }
+    uint32_t used = 1UL << g_APinDescription[POWER_SWITCH].ulExtInt;
+    for (int i = 0; i < NUM_RAILS; i++) {
+        int pin = RAILS[i].alertPin;
+        if (pin == NO_PIN)
+            continue;
+        int line = g_APinDescription[pin].ulExtInt;
+        if (line == NOT_AN_INTERRUPT || (used & (1UL << line))) {
+            DEBUGPORT.print("Alert pin of rail ");
+            DEBUGPORT.print(RAILS[i].name);
+            DEBUGPORT.println(" has no free EXTINT line, not attached");
+            continue;
+        }
+        used |= 1UL << line;
+        pinMode(pin, INPUT_PULLUP);
+        attachInterrupt(digitalPinToInterrupt(pin), railAlertHandlers[i], FALLING);
+    }
+}
+
+#endif
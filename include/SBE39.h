@@ -36,6 +36,7 @@ class SBE39 : public CTD {
             lastMonth = toDecimalMonth(mon);
             lastDay = day;
             newData = true;
+            publishSample();
         }
 
         return newData;
@@ -6,6 +6,7 @@
 #include <SPIflash.h>
 #include <RTCZero.h>
 #include "Config.h"
+#include "StrobeBudget.h"
 #include "SystemConfig.h"
 #include "Utils.h"
 
@@ -180,6 +181,13 @@ class Scheduler {
     public:
 
     int flashType, lowMagDuration, highMagDuration, frameRate;
+
+    // Frame rate of an event within the strobe budget, the same limit the
+    // CFG params get in SystemControl::applyStrobeBudget()
+    static int limitFrameRate(SystemConfig * cfg, int frameRate, int lowMag, int highMag) {
+        return StrobeBudget::limitFrameRate(frameRate, lowMag, highMag, CentiPercent(cfg->getInt(STROBEMAXDUTY)),
+            cfg->getInt(STROBEPOWER), cfg->getInt(STROBEBUDGET));
+    }
     
     Scheduler(int uid, SPIFlash * _f) {
         this->baseUid = uid;
@@ -286,6 +294,13 @@ class Scheduler {
         if (!result)
             return false;
 
+        int limit = limitFrameRate(cfg, frameRate, lowMagDuration, highMagDuration);
+        if (limit < frameRate) {
+            ui->print("Frame rate is over the strobe budget, clamped to ");
+            ui->println(limit);
+            frameRate = limit;
+        }
+
         // If we got here we have a valid set of event params so we should create one.
         ui->println("Creating Event:");
         addTimeEvent(ui, hour, minute, second, duration, flashType, lowMagDuration, highMagDuration, frameRate);
@@ -341,14 +356,34 @@ class Scheduler {
         nTimeEvents = 0;
     }
 
-    int checkEvents(RTCZero * rtc) {
+    // Seconds until the next enabled event starts, -1 if none is waiting
+    long nextEventStart(RTCZero * rtc) {
+        long now = rtc->getHours() * 3600L + rtc->getMinutes() * 60L + rtc->getSeconds();
+        long next = -1;
+        for (int i = 0; i < nTimeEvents; i++) {
+            if (!timeEvents[i]->isEnabled() || timeEvents[i]->running)
+                continue;
+            long start = timeEvents[i]->hour * 3600L + timeEvents[i]->min * 60L + timeEvents[i]->sec;
+            long in = (start - now + 86400L) % 86400L;
+            if (next < 0 || in < next)
+                next = in;
+        }
+        return next;
+    }
+
+    // availableMinutes is the estimated runtime left on the batteries, events
+    // that would outlast it are not started. Pass -1 if unknown. The frame
+    // rate of a started event is held to the strobe budget in cfg, which may
+    // have changed since the event was made.
+    int checkEvents(RTCZero * rtc, SystemConfig * cfg, long availableMinutes = -1) {
         for (int i = 0; i < nTimeEvents; i++) {
-            if (timeEvents[i]->checkStart(rtc)) {
+            bool fits = availableMinutes < 0 || timeEvents[i]->duration <= availableMinutes;
+            if (fits && timeEvents[i]->checkStart(rtc)) {
                 // store current camera config and set from event
                 flashType = timeEvents[i]->flashType;
                 lowMagDuration = timeEvents[i]->lowMag;
                 highMagDuration = timeEvents[i]->highMag;
-                frameRate = timeEvents[i]->frameRate;
+                frameRate = limitFrameRate(cfg, timeEvents[i]->frameRate, lowMagDuration, highMagDuration);
                 return 1;
             }
             if (timeEvents[i]->checkEnd(rtc)) {
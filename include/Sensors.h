@@ -2,117 +2,72 @@
 
 #define _SENSORS
 
-#define INA260_SYS_ADDR 0x40
-#define INA260_PROBE_ADDR 0x41
-#define INA260_ORIN_ADDR 0x42
-#define INA260_DISP_ADDR 0x44
-#define INA260_CAM_ADDR 0x45
-
-
 #include <Arduino.h>
 #include <Adafruit_Sensor.h>
 #include <Adafruit_BME280.h>
 #include <Adafruit_INA260.h>
 
 #include "Config.h"
+#include "DataBus.h"
+#include "PowerRails.h"
+#include "Stats.h"
+
+// Reinitialize the BME280 after this many glitched reads in a row
+#define MAX_ENV_ERRORS 10
 
 Adafruit_BME280 _bme; // I2C
-Adafruit_INA260 _ina260_sys = Adafruit_INA260();
-Adafruit_INA260 _ina260_probe = Adafruit_INA260();
-Adafruit_INA260 _ina260_orin = Adafruit_INA260();
-Adafruit_INA260 _ina260_disp = Adafruit_INA260();
-Adafruit_INA260 _ina260_cam = Adafruit_INA260();
+RailBank<NUM_RAILS> _rails(RAILS);
 
 class Sensors {
 
     private:
         bool sensorsValid;
+
+        // Per channel glitch rejection for the BME280
+        HampelFilter<CentiDegrees, 7> tempFilter;
+        HampelFilter<Pascals, 7> presFilter;
+        HampelFilter<CentiPercent, 7> humFilter;
+        CentiDegrees lastTemp;
+        Pascals lastPres;
+        CentiPercent lastHum;
+        int envErrors;
+
+        // Accept a reading if it is in the sensor range and not an outlier,
+        // otherwise hold the last good value. The library reads in float, this
+        // is where it gets converted to fixed point.
+        template <class T>
+        bool checkChannel(HampelFilter<T, 7> & filter, T minVal, T maxVal, float reading, T * last) {
+            if (isnan(reading))
+                return false;
+            T x = T::fromFloat(reading);
+            if (x >= minVal && x <= maxVal && filter.accept(x)) {
+                *last = x;
+                return true;
+            }
+            return false;
+        }
    
     public:
 
-        float voltage[5];
-        float current[5];
-        float power[5];
-        float temperature;
-        float pressure;
-        float humidity;
-
-        Sensors() {
+        Sensors() : tempFilter(3.0, CentiDegrees(50)), presFilter(3.0, Pascals(50)), humFilter(3.0, CentiPercent(100)) {
             sensorsValid = false;
+            envErrors = 0;
 
         }
 
-        bool begin() {
+        // Probe and configure the rail monitors, they start converting
+        bool beginRails() {
+            sensorsValid = _rails.begin();
+            return sensorsValid;
+        }
 
-            sensorsValid = true;
-            
-            if (!_ina260_sys.begin(INA260_SYS_ADDR)) {
-                DEBUGPORT.println("Couldn't find INA260 A chip");
-                sensorsValid = false;
-            }
-            else {
-                DEBUGPORT.println("System INA260 OK");
-            }
-            // set the number of samples to average
-            _ina260_sys.setAveragingCount(INA260_COUNT_256);
-            // set the time over which to measure the current and bus voltage
-            _ina260_sys.setVoltageConversionTime(INA260_TIME_558_us);
-            _ina260_sys.setCurrentConversionTime(INA260_TIME_558_us);
-
-            if (!_ina260_probe.begin(INA260_PROBE_ADDR)) {
-                DEBUGPORT.println("Couldn't find INA260 B chip");
-                sensorsValid = false;
-            }
-            else {
-                DEBUGPORT.println("Strobe INA260 OK");
-            }
-            // set the number of samples to average
-            _ina260_probe.setAveragingCount(INA260_COUNT_256);
-            // set the time over which to measure the current and bus voltage
-            _ina260_probe.setVoltageConversionTime(INA260_TIME_558_us);
-            _ina260_probe.setCurrentConversionTime(INA260_TIME_558_us);
-
-            if (!_ina260_orin.begin(INA260_ORIN_ADDR)) {
-                DEBUGPORT.println("Couldn't find INA260 B chip");
-                sensorsValid = false;
-            }
-            else {
-                DEBUGPORT.println("Strobe INA260 OK");
-            }
-            // set the number of samples to average
-            _ina260_orin.setAveragingCount(INA260_COUNT_256);
-            // set the time over which to measure the current and bus voltage
-            _ina260_orin.setVoltageConversionTime(INA260_TIME_558_us);
-            _ina260_orin.setCurrentConversionTime(INA260_TIME_558_us);
-            
+        // True once the system rail has its first averaged conversion
+        bool powerReady() {
+            return _rails.conversionReady(RAIL_SYS);
+        }
+
+        bool beginEnv() {
 
-            if (!_ina260_disp.begin(INA260_DISP_ADDR)) {
-                DEBUGPORT.println("Couldn't find INA260 B chip");
-                sensorsValid = false;
-            }
-            else {
-                DEBUGPORT.println("Strobe INA260 OK");
-            }
-            // set the number of samples to average
-            _ina260_disp.setAveragingCount(INA260_COUNT_256);
-            // set the time over which to measure the current and bus voltage
-            _ina260_disp.setVoltageConversionTime(INA260_TIME_558_us);
-            _ina260_disp.setCurrentConversionTime(INA260_TIME_558_us);
-
-            if (!_ina260_cam.begin(INA260_CAM_ADDR)) {
-                DEBUGPORT.println("Couldn't find INA260 B chip");
-                sensorsValid = false;
-            }
-            else {
-                DEBUGPORT.println("Strobe INA260 OK");
-            }
-            // set the number of samples to average
-            _ina260_cam.setAveragingCount(INA260_COUNT_256);
-            // set the time over which to measure the current and bus voltage
-            _ina260_cam.setVoltageConversionTime(INA260_TIME_558_us);
-            _ina260_cam.setCurrentConversionTime(INA260_TIME_558_us);
-            
-            
             // default settings
             int status = _bme.begin();  
             // You can also pass in a Wire library object like &Wire2
@@ -131,87 +86,99 @@ class Sensors {
                 DEBUGPORT.println("BME280 Init OK");
             }
 
-            return sensorsValid;
+            return status;
 
         }
 
+        // Read all sensors and publish the samples on the data bus
         void update() {
-            if (!sensorsValid)
-                return;
-            temperature = _bme.readTemperature();
-            pressure = _bme.readPressure();
-            humidity = _bme.readHumidity();
-            current[0] = _ina260_sys.readCurrent();
-            voltage[0] = _ina260_sys.readBusVoltage();
-            power[0] = _ina260_sys.readPower();
-            current[1] = _ina260_probe.readCurrent();
-            voltage[1] = _ina260_probe.readBusVoltage();
-            power[1] = _ina260_probe.readPower();
-            current[2] = _ina260_orin.readCurrent();
-            voltage[2] = _ina260_orin.readBusVoltage();
-            power[2] = _ina260_orin.readPower();
-            current[3] = _ina260_disp.readCurrent();
-            voltage[3] = _ina260_disp.readBusVoltage();
-            power[3] = _ina260_disp.readPower();
-            current[4] = _ina260_cam.readCurrent();
-            voltage[4] = _ina260_cam.readBusVoltage();
-            power[4] = _ina260_cam.readPower();
-            
+            updateEnv();
+            updatePower();
         }
 
-        void printEnv() {
+        // Read the BME280 only
+        void updateEnv() {
             if (!sensorsValid)
                 return;
-            temperature = _bme.readTemperature();
-            pressure = _bme.readPressure();
-            humidity = _bme.readHumidity();
-            String output = "$BME280," + String(temperature) + "," + String(pressure) + "," + String(humidity);
-            UI1.println(output);
-            UI2.println(output);
+
+            EnvSample * env = _bus.env.claim();
+            env->timestamp = millis();
+            env->valid = 0;
+            if (checkChannel(tempFilter, CentiDegrees::fromUnits(-40), CentiDegrees::fromUnits(85), _bme.readTemperature(), &lastTemp))
+                env->valid |= ENV_TEMP_VALID;
+            if (checkChannel(presFilter, Pascals(30000), Pascals(110000), _bme.readPressure(), &lastPres))
+                env->valid |= ENV_PRES_VALID;
+            if (checkChannel(humFilter, CentiPercent(0), CentiPercent::fromUnits(100), _bme.readHumidity(), &lastHum))
+                env->valid |= ENV_HUM_VALID;
+            env->temperature = lastTemp;
+            env->pressure = lastPres;
+            env->humidity = lastHum;
+            _bus.env.publish();
+
+            // A BME280 that keeps glitching on every channel gets reinitialized
+            if (env->valid == 0) {
+                envErrors++;
+                if (envErrors >= MAX_ENV_ERRORS) {
+                    DEBUGPORT.println("BME280 readings keep failing, reinitializing sensor");
+                    _bme.begin();
+                    envErrors = 0;
+                }
+            }
+            else {
+                envErrors = 0;
+            }
         }
 
-        void printPower() {
+        // Read the rail monitors only
+        void updatePower() {
             if (!sensorsValid)
                 return;
-            current[0] = _ina260_sys.readCurrent();
-            voltage[0] = _ina260_sys.readBusVoltage();
-            power[0] = _ina260_sys.readPower();
-
-            String output = "$PWR_SYS," + String(current[0]) + "," + String(voltage[0]) + "," + String(power[0]);
-            UI1.println(output);
-            UI2.println(output);
-
-            current[1] = _ina260_probe.readCurrent();
-            voltage[1] = _ina260_probe.readBusVoltage();
-            power[1] = _ina260_probe.readPower();
 
-            output = "$PWR_PROBE," + String(current[1]) + "," + String(voltage[1]) + "," + String(power[1]);
-            UI1.println(output);
-            UI2.println(output);
+            PowerSample * pwr = _bus.power.claim();
+            pwr->timestamp = millis();
+            pwr->valid = _rails.read(pwr);
+            _bus.power.publish();
+        }
 
-            current[2] = _ina260_orin.readCurrent();
-            voltage[2] = _ina260_orin.readBusVoltage();
-            power[2] = _ina260_orin.readPower();
+        // Number of readings rejected on each BME280 channel
+        unsigned long rejectedTemp() {
+            return tempFilter.rejected;
+        }
 
-            output = "$PWR_ORIN," + String(current[1]) + "," + String(voltage[1]) + "," + String(power[1]);
-            UI1.println(output);
-            UI2.println(output);
+        unsigned long rejectedPres() {
+            return presFilter.rejected;
+        }
 
-            current[3] = _ina260_disp.readCurrent();
-            voltage[3] = _ina260_disp.readBusVoltage();
-            power[3] = _ina260_disp.readPower();
+        unsigned long rejectedHum() {
+            return humFilter.rejected;
+        }
 
-            output = "$PWR_DISP," + String(current[1]) + "," + String(voltage[1]) + "," + String(power[1]);
+        void printEnv() {
+            const EnvSample * env = _bus.env.latest();
+            if (env == NULL)
+                return;
+            char output[64];
+            int len = sprintf(output, "$BME280,");
+            len += env->temperature.format(output + len, 2);
+            output[len++] = ',';
+            len += sprintf(output + len, "%ld,", (long)env->pressure.raw);
+            env->humidity.format(output + len, 2);
             UI1.println(output);
             UI2.println(output);
+        }
 
-            current[4] = _ina260_cam.readCurrent();
-            voltage[4] = _ina260_cam.readBusVoltage();
-            power[4] = _ina260_cam.readPower();
+        void printPower() {
+            const PowerSample * pwr = _bus.power.latest();
+            if (pwr == NULL)
+                return;
 
-            output = "$PWR_CAM," + String(current[1]) + "," + String(voltage[1]) + "," + String(power[1]);
-            UI1.println(output);
-            UI2.println(output);
+            for (int i = 0; i < NUM_RAILS; i++) {
+                char output[64];
+                sprintf(output, "$PWR_%s,%ld,%ld,%ld", _rails.name(i),
+                    (long)pwr->current[i].raw, (long)pwr->voltage[i].raw, (long)pwr->power[i].raw);
+                UI1.println(output);
+                UI2.println(output);
+            }
             
         }
 };
@@ -0,0 +1,328 @@
+#ifndef _SERIALRX
+
+#define _SERIALRX
+
+#include <Arduino.h>
+
+// One DMA channel per hardware serial port, channel n serves HWPORTn
+#define DMA_RX_CHANNELS 4
+
+// Total RAM shared by the DMA receive buffers of all ports
+#define RX_POOL_SIZE 6144
+
+// Transmit ring of a port in DMA mode
+#define RX_TX_SIZE 128
+
+__attribute__((aligned(16))) DmacDescriptor _dmaDescriptors[DMA_RX_CHANNELS];
+__attribute__((aligned(16))) DmacDescriptor _dmaWriteback[DMA_RX_CHANNELS];
+
+// Completed passes through each channel's buffer, counted in DMAC_Handler
+volatile uint32_t _dmaRxLaps[DMA_RX_CHANNELS];
+
+uint8_t _rxPool[RX_POOL_SIZE];
+int _rxPoolUsed = 0;
+bool _dmacStarted = false;
+
+void DMAC_Handler() {
+    while (DMAC->INTSTATUS.reg) {
+        uint8_t ch = DMAC->INTPEND.bit.ID;
+        DMAC->CHID.reg = DMAC_CHID_ID(ch);
+        uint8_t flags = DMAC->CHINTFLAG.reg;
+        DMAC->CHINTFLAG.reg = flags;
+        if ((flags & DMAC_CHINTFLAG_TCMPL) && ch < DMA_RX_CHANNELS)
+            _dmaRxLaps[ch]++;
+    }
+}
+
+void dmacBegin() {
+    if (_dmacStarted)
+        return;
+    PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+    PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+    DMAC->CTRL.bit.DMAENABLE = 0;
+    DMAC->CTRL.bit.SWRST = 1;
+    DMAC->BASEADDR.reg = (uint32_t)_dmaDescriptors;
+    DMAC->WRBADDR.reg = (uint32_t)_dmaWriteback;
+    DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xf);
+    NVIC_EnableIRQ(DMAC_IRQn);
+    _dmacStarted = true;
+}
+
+// Hardware serial port with an optional DMA receive ring. With DMA enabled the
+// DMAC copies every received byte from the SERCOM into a circular buffer of any
+// size, so a long stall in the main loop no longer overflows the small receive
+// ring of the Arduino Uart.
+//
+// Uart::IrqHandler() reads DATA whenever RXC is set and eats framing errors,
+// so in DMA mode it must not run at all: the SERCOM handler calls irqHandler()
+// instead, and writes go through a transmit ring of our own served from
+// there. Ports whose SERCOM handler is in the variant keep the Uart ring.
+class RxPort : public Stream {
+
+    private:
+    Uart * uart;
+    Sercom * sercom;
+    uint8_t trigger; // DMAC trigger source of the SERCOM RX
+    int channel;
+    bool ownHandler; // the SERCOM handler calls irqHandler()
+    uint8_t txBuf[RX_TX_SIZE];
+    volatile uint16_t txHead; // written by write() only
+    volatile uint16_t txTail; // written by serviceTx() only
+    volatile bool txStarted; // a byte was written since TXC was last seen
+    uint8_t * buf;
+    uint16_t size;
+    uint32_t readCount; // bytes consumed from the ring
+    uint32_t lastWritten;
+    unsigned long baud;
+
+    // Total bytes the DMAC has written to the ring
+    uint32_t written() {
+        noInterrupts();
+        uint32_t laps = _dmaRxLaps[channel];
+        uint32_t remaining;
+        if (DMAC->ACTIVE.bit.ABUSY && DMAC->ACTIVE.bit.ID == channel)
+            remaining = DMAC->ACTIVE.reg >> DMAC_ACTIVE_BTCNT_Pos;
+        else
+            remaining = _dmaWriteback[channel].BTCNT.reg;
+        interrupts();
+        uint32_t w = laps * size + (size - remaining);
+        // The block wrapped but the lap interrupt has not run yet
+        if (w < lastWritten)
+            w += size;
+        lastWritten = w;
+        return w;
+    }
+
+    // Bytes waiting in the ring, skipping what was overwritten
+    int pending() {
+        uint32_t w = written();
+        uint32_t n = w - readCount;
+        if (n > size) {
+            overruns += n - size;
+            readCount = w - size;
+            n = size;
+        }
+        return n;
+    }
+
+    // Move one byte from the transmit ring to the SERCOM
+    void serviceTx() {
+        if (!(sercom->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_DRE))
+            return;
+        if (txTail != txHead) {
+            sercom->USART.DATA.reg = txBuf[txTail];
+            txTail = (txTail + 1) % RX_TX_SIZE;
+        }
+        else {
+            sercom->USART.INTENCLR.reg = SERCOM_USART_INTENCLR_DRE;
+        }
+    }
+
+    public:
+    unsigned long bytes; // bytes read by the firmware
+    unsigned long overruns; // bytes lost because the ring was full
+    unsigned long bufferOverflows; // SERCOM receive FIFO overflows seen
+    unsigned long framingErrors; // SERCOM framing errors seen
+
+    RxPort(Uart * uart, Sercom * sercom, uint8_t trigger, int channel, bool ownHandler) {
+        this->uart = uart;
+        this->sercom = sercom;
+        this->trigger = trigger;
+        this->channel = channel;
+        this->ownHandler = ownHandler;
+        txHead = 0;
+        txTail = 0;
+        txStarted = false;
+        buf = NULL;
+        size = 0;
+        readCount = 0;
+        lastWritten = 0;
+        baud = 0;
+        bytes = 0;
+        overruns = 0;
+        bufferOverflows = 0;
+        framingErrors = 0;
+    }
+
+    void begin(unsigned long baud) {
+        this->baud = baud;
+        txHead = 0;
+        txTail = 0;
+        uart->begin(baud);
+        // Uart::begin() turns the receive interrupt back on
+        if (isDma())
+            sercom->USART.INTENCLR.reg = SERCOM_USART_INTENCLR_RXC | SERCOM_USART_INTENCLR_ERROR;
+    }
+
+    // Move receive over to a DMA ring of n bytes. The buffer comes from a fixed
+    // pool and can't be given back, so this is done once at startup.
+    bool enableDma(int n) {
+        if (isDma() || n <= 0 || !ownHandler)
+            return isDma();
+        if (_rxPoolUsed + n > RX_POOL_SIZE)
+            return false;
+        buf = &_rxPool[_rxPoolUsed];
+        _rxPoolUsed += n;
+        size = n;
+
+        dmacBegin();
+
+        // Let the Uart send what it has, it gets no more interrupts after this
+        uart->flush();
+
+        // Bytes already in the Uart ring are dropped
+        sercom->USART.INTENCLR.reg = SERCOM_USART_INTENCLR_RXC | SERCOM_USART_INTENCLR_ERROR;
+
+        DMAC->CHID.reg = DMAC_CHID_ID(channel);
+        DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+        DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+        DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(trigger) | DMAC_CHCTRLB_TRIGACT_BEAT;
+        DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL;
+
+        // A single descriptor linked to itself runs forever
+        DmacDescriptor * d = &_dmaDescriptors[channel];
+        d->BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_BLOCKACT_INT;
+        d->BTCNT.reg = size;
+        d->SRCADDR.reg = (uint32_t)&sercom->USART.DATA.reg;
+        d->DSTADDR.reg = (uint32_t)(buf + size); // end address when incrementing
+        d->DESCADDR.reg = (uint32_t)d;
+        _dmaWriteback[channel].BTCNT.reg = size;
+
+        DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+        return true;
+    }
+
+    bool isDma() {
+        return buf != NULL;
+    }
+
+    // False if the SERCOM handler is not ours, DMA receive needs it
+    bool canDma() {
+        return ownHandler;
+    }
+
+    // Called by the SERCOM handler. In DMA mode the DMAC takes the received
+    // bytes and checkErrors() the error flags, only the transmit side is left.
+    void irqHandler() {
+        if (isDma())
+            serviceTx();
+        else
+            uart->IrqHandler();
+    }
+
+    int bufferSize() {
+        return size;
+    }
+
+    Sercom * getSercom() {
+        return sercom;
+    }
+
+    unsigned long getBaud() {
+        return baud;
+    }
+
+    // Collect the SERCOM error flags, with DMA nothing else clears them
+    void checkErrors() {
+        if (!isDma())
+            return;
+        uint16_t status = sercom->USART.STATUS.reg;
+        if (status & SERCOM_USART_STATUS_BUFOVF)
+            bufferOverflows++;
+        if (status & SERCOM_USART_STATUS_FERR)
+            framingErrors++;
+        sercom->USART.STATUS.reg = status & (SERCOM_USART_STATUS_BUFOVF | SERCOM_USART_STATUS_FERR | SERCOM_USART_STATUS_PERR);
+    }
+
+    int available() {
+        return isDma() ? pending() : uart->available();
+    }
+
+    int peek() {
+        if (!isDma())
+            return uart->peek();
+        if (pending() == 0)
+            return -1;
+        return buf[readCount % size];
+    }
+
+    int read() {
+        if (!isDma()) {
+            int c = uart->read();
+            if (c >= 0)
+                bytes++;
+            return c;
+        }
+        if (pending() == 0)
+            return -1;
+        bytes++;
+        return buf[readCount++ % size];
+    }
+
+    size_t write(uint8_t c) {
+        txStarted = true;
+        if (!isDma())
+            return uart->write(c);
+        uint16_t next = (txHead + 1) % RX_TX_SIZE;
+        while (next == txTail) {
+            // Ring full, send from here if the interrupt can't run
+            if (__get_PRIMASK() || __get_IPSR() != 0)
+                serviceTx();
+        }
+        txBuf[txHead] = c;
+        txHead = next;
+        sercom->USART.INTENSET.reg = SERCOM_USART_INTENSET_DRE;
+        return 1;
+    }
+
+    size_t write(const uint8_t * data, size_t n) {
+        txStarted = true;
+        if (!isDma())
+            return uart->write(data, n);
+        for (size_t i = 0; i < n; i++)
+            write(data[i]);
+        return n;
+    }
+
+    using Print::write;
+
+    int availableForWrite() {
+        if (!isDma())
+            return uart->availableForWrite();
+        return RX_TX_SIZE - 1 - (txHead - txTail + RX_TX_SIZE) % RX_TX_SIZE;
+    }
+
+    void flush() {
+        if (!isDma()) {
+            uart->flush();
+            txStarted = false;
+            return;
+        }
+        while (txTail != txHead) {
+            if (__get_PRIMASK() || __get_IPSR() != 0)
+                serviceTx();
+        }
+        // Wait for the last byte to leave the shift register
+        if (txStarted) {
+            while (!(sercom->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_TXC));
+            txStarted = false;
+        }
+    }
+
+    // True once everything written has left the shift register. The Uart and
+    // our own ring both keep the DRE interrupt on while they hold bytes.
+    bool txIdle() {
+        if (sercom->USART.INTENSET.reg & SERCOM_USART_INTENSET_DRE)
+            return false;
+        if (txStarted && !(sercom->USART.INTFLAG.reg & SERCOM_USART_INTFLAG_TXC))
+            return false;
+        txStarted = false;
+        return true;
+    }
+
+    operator bool() {
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef _SLEEPPLANNER
+
+#define _SLEEPPLANNER
+
+#include <Arduino.h>
+#include "IdleManager.h"
+
+// Longest single sleep in s, the RTC alarm matches the time of day only
+#define SLEEP_MAX_TIME 86399
+
+// Why a sleep ended. The first three are deadlines the planner set the
+// alarm for, the rest came from outside.
+enum SleepWake {
+    SLEEP_WAKE_CHECK, // voltage check
+    SLEEP_WAKE_BATTERY, // battery poll and charge blend, the flash stays asleep
+    SLEEP_WAKE_SCHEDULE, // a scheduled event starts
+    SLEEP_WAKE_UART, // a command on a UI port
+    SLEEP_WAKE_OTHER, // the power button or a rail alert
+    SLEEP_WAKES
+};
+
+// Plans the wakes of a long sleep with the camera off. Each deadline is kept
+// as an RTC epoch and the alarm is set for the earliest, so the console only
+// wakes for work that is due and does only that work before sleeping again.
+// Times are RTC epoch seconds, millis() is held while asleep.
+class SleepPlanner {
+
+    private:
+    uint32_t nextCheck;
+    uint32_t nextBattery;
+    uint32_t checkPeriod;
+    uint32_t batteryPeriod;
+
+    public:
+    bool lowVoltage; // sleeping until the battery recovers
+    uint32_t wakeAt; // epoch the alarm is set for
+    SleepWake planned; // deadline the alarm is set for
+    uint32_t enteredAt;
+    unsigned long sleeps;
+    unsigned long wakes[SLEEP_WAKES];
+    uint32_t wakeUsLast; // time awake for the last planned wake
+    uint32_t wakeUsMax;
+    SleepWake lastWake;
+
+    SleepPlanner() {
+        lowVoltage = false;
+        wakeAt = 0;
+        planned = SLEEP_WAKE_CHECK;
+        enteredAt = 0;
+        sleeps = 0;
+        for (int i = 0; i < SLEEP_WAKES; i++)
+            wakes[i] = 0;
+        wakeUsLast = 0;
+        wakeUsMax = 0;
+        lastWake = SLEEP_WAKE_CHECK;
+    }
+
+    // Start a sleep, periods are in s
+    void enter(uint32_t now, uint32_t checkPeriod, uint32_t batteryPeriod, bool lowVoltage) {
+        this->checkPeriod = checkPeriod;
+        this->batteryPeriod = batteryPeriod;
+        this->lowVoltage = lowVoltage;
+        nextCheck = now + checkPeriod;
+        nextBattery = now + batteryPeriod;
+        enteredAt = now;
+        sleeps++;
+    }
+
+    // Set wakeAt to the earliest deadline. scheduleIn is the time to the next
+    // scheduled event in s, -1 if there is none.
+    uint32_t plan(uint32_t now, long scheduleIn) {
+        wakeAt = nextCheck;
+        planned = SLEEP_WAKE_CHECK;
+        if ((int32_t)(nextBattery - wakeAt) < 0) {
+            wakeAt = nextBattery;
+            planned = SLEEP_WAKE_BATTERY;
+        }
+        if (scheduleIn >= 0 && (int32_t)(now + scheduleIn - wakeAt) <= 0) {
+            wakeAt = now + scheduleIn;
+            planned = SLEEP_WAKE_SCHEDULE;
+        }
+        if ((int32_t)(wakeAt - now) > SLEEP_MAX_TIME)
+            wakeAt = now + SLEEP_MAX_TIME;
+        return wakeAt;
+    }
+
+    // Map the end of a standby to a wake reason
+    SleepWake woke(WakeReason reason) {
+        if (reason == WAKE_UART)
+            lastWake = SLEEP_WAKE_UART;
+        else if (reason == WAKE_OTHER)
+            lastWake = SLEEP_WAKE_OTHER;
+        else
+            lastWake = planned;
+        wakes[lastWake]++;
+        return lastWake;
+    }
+
+    // Move a deadline that has come on by its period. An alarm cut short by
+    // SLEEP_MAX_TIME serves nothing.
+    void served(SleepWake wake, uint32_t now) {
+        if (wake == SLEEP_WAKE_CHECK && (int32_t)(now - nextCheck) >= 0)
+            nextCheck = now + checkPeriod;
+        else if (wake == SLEEP_WAKE_BATTERY && (int32_t)(now - nextBattery) >= 0)
+            nextBattery = now + batteryPeriod;
+    }
+
+    void wakeCost(uint32_t us) {
+        wakeUsLast = us;
+        if (us > wakeUsMax)
+            wakeUsMax = us;
+    }
+
+    static const char * wakeName(SleepWake wake) {
+        static const char * names[SLEEP_WAKES] = { "check", "battery", "schedule", "UART", "other" };
+        return names[wake];
+    }
+
+    void print(Stream * ui) {
+        char output[96];
+        sprintf(output, "Sleeps: %lu, last woken by %s", sleeps, wakeName(lastWake));
+        ui->println(output);
+        sprintf(output, "Wakes: check %lu, battery %lu, schedule %lu, UART %lu, other %lu",
+            wakes[SLEEP_WAKE_CHECK], wakes[SLEEP_WAKE_BATTERY], wakes[SLEEP_WAKE_SCHEDULE],
+            wakes[SLEEP_WAKE_UART], wakes[SLEEP_WAKE_OTHER]);
+        ui->println(output);
+        sprintf(output, "Planned wake time (us): last %lu, max %lu", (unsigned long)wakeUsLast,
+            (unsigned long)wakeUsMax);
+        ui->println(output);
+    }
+};
+
+#endif
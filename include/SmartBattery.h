@@ -0,0 +1,276 @@
+#ifndef _SMARTBATTERY
+
+#define _SMARTBATTERY
+
+#include <Arduino.h>
+#include <Wire.h>
+#include "Config.h"
+#include "DataBus.h"
+
+#define NUM_BATTERY_PACKS 4
+
+// Smart Battery Data registers
+#define SBS_TEMPERATURE 0x08
+#define SBS_VOLTAGE 0x09
+#define SBS_CURRENT 0x0A
+#define SBS_RELATIVE_SOC 0x0D
+#define SBS_BATTERY_STATUS 0x16
+#define SBS_CYCLE_COUNT 0x17
+
+// BatteryStatus alarm bits
+#define SBS_ALARM_MASK 0xFF00
+
+// Give up on a pack's cached values after this many failed transactions in a row
+#define BATTERY_MAX_ERRORS 8
+
+// Where a pack sits on the bus
+struct BatteryPackAddress {
+    uint8_t controller; // battery controller, selects the pack
+    uint8_t battery; // smart battery address behind the controller
+    uint8_t select; // pack select value written to the controller
+};
+
+const BatteryPackAddress BATTERY_PACKS[NUM_BATTERY_PACKS] = {
+    { 0x0A, 0x0B, 0x10 },
+    { 0x0A, 0x0B, 0x20 },
+    { 0x0E, 0x0F, 0x10 },
+    { 0x0E, 0x0F, 0x20 },
+};
+
+// Cached values of one pack, only the poller touches the bus
+struct BatteryPack {
+    int soc; // in %
+    int voltage; // in mV
+    int current; // in mA, negative when discharging
+    int temperature; // in 0.1 C
+    int cycleCount;
+    uint16_t status; // BatteryStatus register
+    uint32_t updated; // millis() of the last complete read
+    uint8_t errors; // failed transactions in a row
+    bool valid;
+};
+
+// Registers read from every pack, in order, after selecting it
+const uint8_t BATTERY_REGS[] = {
+    SBS_RELATIVE_SOC,
+    SBS_VOLTAGE,
+    SBS_CURRENT,
+    SBS_TEMPERATURE,
+    SBS_CYCLE_COUNT,
+    SBS_BATTERY_STATUS
+};
+
+#define NUM_BATTERY_REGS (sizeof(BATTERY_REGS) / sizeof(BATTERY_REGS[0]))
+
+// Background poller that round-robins over all packs doing a single SMBus
+// transaction per call, so the main loop never waits on more than one.
+class SmartBattery {
+
+    private:
+    BatteryPack packs[NUM_BATTERY_PACKS];
+    int packIndex;
+    int step; // 0 = select pack, then one step per register
+    unsigned long rounds; // full rounds over all packs
+    unsigned long lastPoll;
+    bool usePec;
+
+    // SMBus packet error code, CRC-8 with polynomial x^8 + x^2 + x + 1
+    uint8_t crc8(uint8_t crc, uint8_t data) {
+        crc ^= data;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+        }
+        return crc;
+    }
+
+    bool selectPack(const BatteryPackAddress & a) {
+        Wire.beginTransmission(a.controller);
+        Wire.write(byte(0x01));
+        Wire.write(byte(0));
+        Wire.write(a.select);
+        if (usePec) {
+            uint8_t pec = crc8(0, a.controller << 1);
+            pec = crc8(pec, 0x01);
+            pec = crc8(pec, 0);
+            pec = crc8(pec, a.select);
+            Wire.write(pec);
+        }
+        return Wire.endTransmission(true) == 0;
+    }
+
+    bool readWord(uint8_t address, uint8_t reg, uint16_t * value) {
+        Wire.beginTransmission(address);
+        Wire.write(reg);
+        if (Wire.endTransmission(false) != 0)
+            return false;
+
+        uint8_t numBytes = usePec ? 3 : 2;
+        Wire.requestFrom(address, numBytes);
+        if (Wire.available() < numBytes)
+            return false;
+
+        uint8_t lo = Wire.read();
+        uint8_t hi = Wire.read();
+        if (usePec) {
+            uint8_t pec = crc8(0, address << 1);
+            pec = crc8(pec, reg);
+            pec = crc8(pec, (address << 1) | 1);
+            pec = crc8(pec, lo);
+            pec = crc8(pec, hi);
+            if (pec != Wire.read())
+                return false;
+        }
+        *value = lo | (hi << 8);
+        return true;
+    }
+
+    void store(BatteryPack * p, uint8_t reg, uint16_t value) {
+        switch (reg) {
+            case SBS_RELATIVE_SOC:
+                p->soc = value;
+                break;
+            case SBS_VOLTAGE:
+                p->voltage = value;
+                break;
+            case SBS_CURRENT:
+                p->current = (int16_t)value;
+                break;
+            case SBS_TEMPERATURE:
+                p->temperature = (int)value - 2732; // 0.1 K to 0.1 C
+                break;
+            case SBS_CYCLE_COUNT:
+                p->cycleCount = value;
+                break;
+            case SBS_BATTERY_STATUS:
+                p->status = value;
+                break;
+        }
+    }
+
+    // Move on to the next pack, publishing a sample after a full round
+    void nextPack() {
+        step = 0;
+        packIndex++;
+        if (packIndex >= NUM_BATTERY_PACKS) {
+            packIndex = 0;
+            rounds++;
+            publish();
+        }
+    }
+
+    void publish() {
+        int32_t total = 0;
+        int n = 0;
+        BatterySample * s = _bus.battery.claim();
+        s->timestamp = millis();
+        for (int i = 0; i < NUM_BATTERY_PACKS; i++) {
+            s->soc[i] = packs[i].valid ? packs[i].soc : -1;
+            if (packs[i].valid) {
+                total += packs[i].soc;
+                n++;
+            }
+        }
+        if (n == 0)
+            return;
+        s->charge = CentiPercent::fromUnits(total) / n;
+        _bus.battery.publish();
+    }
+
+    public:
+
+    SmartBattery() {
+        packIndex = 0;
+        step = 0;
+        rounds = 0;
+        lastPoll = 0;
+        usePec = false;
+        memset(packs, 0, sizeof(packs));
+    }
+
+    // Do at most one transaction if interval ms have passed since the last one
+    void update(unsigned long interval, bool pec) {
+        if (millis() - lastPoll < interval)
+            return;
+        lastPoll = millis();
+        usePec = pec;
+
+        const BatteryPackAddress & a = BATTERY_PACKS[packIndex];
+        BatteryPack * p = &packs[packIndex];
+
+        bool ok;
+        if (step == 0) {
+            ok = selectPack(a);
+        }
+        else {
+            uint16_t value;
+            ok = readWord(a.battery, BATTERY_REGS[step - 1], &value);
+            if (ok) {
+                store(p, BATTERY_REGS[step - 1], value);
+            }
+        }
+
+        if (!ok) {
+            // Skip the rest of this pack, it will be retried next round
+            if (p->errors < 255)
+                p->errors++;
+            if (p->errors >= BATTERY_MAX_ERRORS)
+                p->valid = false;
+            nextPack();
+            return;
+        }
+
+        step++;
+        if (step > (int)NUM_BATTERY_REGS) {
+            p->errors = 0;
+            p->valid = true;
+            p->updated = millis();
+            nextPack();
+        }
+    }
+
+    // Read every pack back to back and publish, for a wake from sleep where
+    // spreading the transactions out would keep the console awake. A round
+    // already under way is finished first.
+    void pollAll(bool pec) {
+        unsigned long target = rounds + ((packIndex != 0 || step != 0) ? 2 : 1);
+        while (rounds < target)
+            update(0, pec);
+    }
+
+    const BatteryPack * pack(int i) {
+        return &packs[i];
+    }
+
+    // Alarm bits of all valid packs or'd together
+    uint16_t alarms() {
+        uint16_t a = 0;
+        for (int i = 0; i < NUM_BATTERY_PACKS; i++) {
+            if (packs[i].valid)
+                a |= packs[i].status & SBS_ALARM_MASK;
+        }
+        return a;
+    }
+
+    void print(Stream * ui) {
+        char output[128];
+        ui->println();
+        ui->println("Pack  SOC%  Voltage  Current   Temp  Cycles  Status  Age(s)");
+        for (int i = 0; i < NUM_BATTERY_PACKS; i++) {
+            const BatteryPack * p = &packs[i];
+            if (!p->valid) {
+                sprintf(output, "%4d  no data (%d errors)", i, p->errors);
+            }
+            else {
+                sprintf(output, "%4d  %4d  %7d  %7d  %5d  %6d  0x%04X  %6lu",
+                    i, p->soc, p->voltage, p->current, p->temperature / 10,
+                    p->cycleCount, p->status, (millis() - p->updated) / 1000);
+            }
+            ui->println(output);
+        }
+    }
+};
+
+// Global smart battery poller
+SmartBattery _battery;
+
+#endif
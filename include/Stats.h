@@ -7,13 +7,17 @@
 
 #define MAX_BUFFER_SIZE 128
 
+// Boxcar average over the last samples values, O(1) per sample using a running
+// sum. The sum has the sample type, so fixed point samples never touch float.
 template <class T>
 class MovingAverage {
 
     private:
     T buffer[MAX_BUFFER_SIZE];
     int index;
+    int count;
     int samples;
+    T sum;
 
     public:
 
@@ -23,36 +27,334 @@ class MovingAverage {
             DEBUGPORT.println("Samples exceed max buffer size, setting to max buffer size.");
             this->samples = MAX_BUFFER_SIZE;
         }
-        this->index = 0;
+        clear();
     }
 
-    float update(T newSample) {
-        if (index < samples) {
-            buffer[index++] = newSample;
+    T update(T newSample) {
+        if (count < samples) {
+            count++;
         }
         else {
-            for (int i = 1; i < index; i++) {
-                buffer[i-1] = buffer[i];
-            }
-            buffer[samples-1] = newSample;
+            sum -= buffer[index];
         }
-        if (index == 0) {
-            return newSample;
+        buffer[index] = newSample;
+        sum += newSample;
+        index = (index + 1) % samples;
+        return sum / count;
+    }
+
+    T average() {
+        return count > 0 ? sum / count : T();
+    }
+
+    int size() {
+        return count;
+    }
+
+    void clear() {
+        index = 0;
+        count = 0;
+        sum = T();
+    }
+
+};
+
+// Exponentially weighted moving average with a weight of 1/2^shift for each new
+// sample, so integer types need no multiply or divide
+template <class T>
+class Ewma {
+
+    private:
+    T value;
+    int shift;
+    bool primed;
+
+    public:
+
+    Ewma(int shift=4) {
+        this->shift = shift;
+        clear();
+    }
+
+    T update(T newSample) {
+        if (!primed) {
+            value = newSample;
+            primed = true;
         }
         else {
-            float avg = 0.0;
-            for (int i = 0; i < index; i++) {
-                avg += buffer[i];
+            value += (newSample - value) / (1 << shift);
+        }
+        return value;
+    }
+
+    T get() {
+        return value;
+    }
+
+    bool isPrimed() {
+        return primed;
+    }
+
+    void clear() {
+        value = T();
+        primed = false;
+    }
+};
+
+// Running mean and variance using Welford's algorithm, numerically stable and
+// without keeping any samples
+class Welford {
+
+    private:
+    unsigned long n;
+    float m;
+    float m2;
+    float minVal;
+    float maxVal;
+
+    public:
+
+    Welford() {
+        clear();
+    }
+
+    void update(float x) {
+        n++;
+        float delta = x - m;
+        m += delta / n;
+        m2 += delta * (x - m);
+        if (n == 1 || x < minVal)
+            minVal = x;
+        if (n == 1 || x > maxVal)
+            maxVal = x;
+    }
+
+    unsigned long count() {
+        return n;
+    }
+
+    float mean() {
+        return m;
+    }
+
+    // Sample variance, 0 until there are two samples
+    float variance() {
+        return n > 1 ? m2 / (n - 1) : 0.0;
+    }
+
+    float stddev() {
+        return sqrt(variance());
+    }
+
+    float min() {
+        return minVal;
+    }
+
+    float max() {
+        return maxVal;
+    }
+
+    void clear() {
+        n = 0;
+        m = 0.0;
+        m2 = 0.0;
+        minVal = 0.0;
+        maxVal = 0.0;
+    }
+};
+
+// Min and max over a sliding window of the last N samples. Each of the two
+// monotonic deques holds the candidates in sample order, every sample is pushed
+// and popped at most once so the update is O(1) amortized.
+template <class T, int N>
+class WindowMinMax {
+
+    private:
+    struct Entry {
+        uint32_t index;
+        T value;
+    };
+
+    Entry minQ[N];
+    Entry maxQ[N];
+    int minHead, minCount;
+    int maxHead, maxCount;
+    uint32_t index;
+
+    Entry & at(Entry * q, int head, int i) {
+        return q[(head + i) % N];
+    }
+
+    public:
+
+    WindowMinMax() {
+        clear();
+    }
+
+    void update(T x) {
+        // Drop entries that fell out of the window
+        if (minCount > 0 && index - minQ[minHead].index >= (uint32_t)N) {
+            minHead = (minHead + 1) % N;
+            minCount--;
+        }
+        if (maxCount > 0 && index - maxQ[maxHead].index >= (uint32_t)N) {
+            maxHead = (maxHead + 1) % N;
+            maxCount--;
+        }
+
+        // Entries that can never be the min/max again are dropped from the back
+        while (minCount > 0 && at(minQ, minHead, minCount - 1).value >= x)
+            minCount--;
+        while (maxCount > 0 && at(maxQ, maxHead, maxCount - 1).value <= x)
+            maxCount--;
+
+        Entry e = { index, x };
+        at(minQ, minHead, minCount++) = e;
+        at(maxQ, maxHead, maxCount++) = e;
+        index++;
+    }
+
+    T min() {
+        return minQ[minHead].value;
+    }
+
+    T max() {
+        return maxQ[maxHead].value;
+    }
+
+    bool isEmpty() {
+        return index == 0;
+    }
+
+    void clear() {
+        minHead = 0;
+        minCount = 0;
+        maxHead = 0;
+        maxCount = 0;
+        index = 0;
+    }
+};
+
+// Median of the last N samples, N should be small and odd. The window is kept
+// sorted, so an update is one removal and one insertion into N entries.
+template <class T, int N>
+class MedianFilter {
+
+    private:
+    T ring[N];
+    T sorted[N];
+    int index;
+    int count;
+
+    public:
+
+    MedianFilter() {
+        clear();
+    }
+
+    T update(T x) {
+        int n = count;
+        if (count == N) {
+            // Remove the oldest sample from the sorted window
+            T old = ring[index];
+            int i = 0;
+            while (i < n - 1 && sorted[i] != old)
+                i++;
+            for (; i < n - 1; i++)
+                sorted[i] = sorted[i + 1];
+            n--;
+        }
+        else {
+            count++;
+        }
+        ring[index] = x;
+        index = (index + 1) % N;
+
+        int i = n;
+        while (i > 0 && sorted[i - 1] > x) {
+            sorted[i] = sorted[i - 1];
+            i--;
+        }
+        sorted[i] = x;
+
+        return median();
+    }
+
+    T median() {
+        return sorted[count / 2];
+    }
+
+    // Median absolute deviation of the window around m
+    T mad(T m) {
+        T dev[N];
+        for (int i = 0; i < count; i++) {
+            dev[i] = sorted[i] > m ? sorted[i] - m : m - sorted[i];
+        }
+        // Small N, an insertion sort is fine
+        for (int i = 1; i < count; i++) {
+            T d = dev[i];
+            int j = i;
+            while (j > 0 && dev[j - 1] > d) {
+                dev[j] = dev[j - 1];
+                j--;
             }
-            avg /= index;
-            return avg;
-        } 
+            dev[j] = d;
+        }
+        return dev[count / 2];
+    }
+
+    int size() {
+        return count;
     }
 
     void clear() {
-        index -= 0;
+        index = 0;
+        count = 0;
+    }
+};
+
+// Hampel outlier test against the median of the previous N samples. A sample is
+// an outlier if it is further than k scaled MADs from the median, minDev keeps a
+// flat signal (MAD of 0) from rejecting the normal sensor noise. Every sample
+// goes into the window, so a real step change is accepted after N/2 samples.
+// k is turned into a x256 integer factor up front so the test itself works on
+// fixed point samples without float.
+template <class T, int N>
+class HampelFilter {
+
+    private:
+    MedianFilter<T, N> window;
+    int32_t kScaled; // k * 1.4826 * 256
+    T minDev;
+
+    public:
+    unsigned long rejected;
+
+    HampelFilter(float k=3.0, T minDev=T()) {
+        this->kScaled = (int32_t)(k * 1.4826 * 256 + 0.5);
+        this->minDev = minDev;
+        rejected = 0;
     }
 
+    // Returns false if x is an outlier
+    bool accept(T x) {
+        bool ok = true;
+        if (window.size() >= N / 2 + 1) {
+            T m = window.median();
+            T limit = window.mad(m) * kScaled / 256;
+            if (limit < minDev)
+                limit = minDev;
+            ok = (x > m ? x - m : m - x) <= limit;
+        }
+        window.update(x);
+        if (!ok)
+            rejected++;
+        return ok;
+    }
+
+    void clear() {
+        window.clear();
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
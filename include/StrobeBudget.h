@@ -0,0 +1,46 @@
+#ifndef _STROBEBUDGET
+
+#define _STROBEBUDGET
+
+#include <Arduino.h>
+#include "FixedPoint.h"
+
+// Duty cycle and energy limits of the two strobes, both fire once per frame.
+// limitFrameRate() is the config time check: the highest frame rate whose
+// duty on the longer flash and estimated average power both fit. None of
+// the monitored rails feeds the strobes, so the power is the estimate from
+// STROBEPOWER and not a measurement.
+class StrobeBudget {
+
+    public:
+
+    // Duty of one strobe, durations are in us
+    static CentiPercent duty(int durationUs, int frameRate) {
+        return CentiPercent((int32_t)durationUs * frameRate / 100);
+    }
+
+    // Average power of both strobes from their flash power while firing
+    static MilliWatts estimate(int lowUs, int highUs, int frameRate, int firingMw) {
+        return MilliWatts((int32_t)((int64_t)firingMw * (lowUs + highUs) * frameRate / 1000000));
+    }
+
+    // Highest frame rate up to frameRate that keeps within the duty and
+    // power limits, at least 1
+    static int limitFrameRate(int frameRate, int lowUs, int highUs, CentiPercent maxDuty, int firingMw, int budgetMw) {
+        int longest = lowUs > highUs ? lowUs : highUs;
+        int limit = frameRate;
+        if (longest > 0) {
+            int dutyLimit = maxDuty.raw * 100 / longest;
+            if (dutyLimit < limit)
+                limit = dutyLimit;
+        }
+        if (firingMw > 0 && lowUs + highUs > 0) {
+            int powerLimit = (int)((int64_t)budgetMw * 1000000 / ((int64_t)firingMw * (lowUs + highUs)));
+            if (powerLimit < limit)
+                limit = powerLimit;
+        }
+        return limit < 1 ? 1 : limit;
+    }
+};
+
+#endif
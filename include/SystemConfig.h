@@ -3,12 +3,24 @@
 #define _SYSTEMCONFIG
 
 #include <Arduino.h>
+#include "SPIFlash.h"
 #include "Config.h"
 #include "Utils.h"
 
 #define MAX_PARAMS 256
 
-#define SCHEDULER_UID 256
+// SPI flash layout, config and scheduler share the first 4K block. The params
+// take the flash addresses from 0 up in the order they are added, the
+// scheduler record starts after the most they can ever take.
+#define CONFIG_FLASH_SIZE (MAX_PARAMS * (sizeof(int) + sizeof(float)))
+#define SCHEDULER_UID 2048
+#define FLASH_SECTOR_SIZE 4096
+#define ENERGY_LOG_ADDR 0x10000 // 2 sectors of energy checkpoints
+#define CRASH_LOG_ADDR 0x12000 // 2 sectors of crash records
+#define EVENT_LOG_ADDR 0x14000 // 4 sectors of event records
+
+static_assert(CONFIG_FLASH_SIZE <= SCHEDULER_UID, "Config params run into the scheduler record");
+static_assert(SCHEDULER_UID < FLASH_SECTOR_SIZE, "The scheduler record is erased with the config block");
 
 //////////////////////////////////////////
 // flash(SPI_CS, MANUFACTURER_ID)
@@ -79,6 +91,7 @@ class ConfigParam {
             int bufferIndex = 0;
 
             while (startTimer <= millis() && millis() - startTimer < cmdTimeout) {
+                _supervisor.kick();
 
                 // Wait on user input
                 if (in->available()) {
@@ -226,6 +239,12 @@ class SystemConfig {
 
         template <class T>
         bool addParam(const char * name, const char * desc, const char * units, T minVal, T maxVal, T defaultVal, bool isFloat = false, void (*callback)() = NULL) {
+            // Never let a param overwrite the scheduler record
+            if (uid + sizeof(T) > SCHEDULER_UID) {
+                DEBUGPORT.print("No flash room for config param ");
+                DEBUGPORT.println(name);
+                return false;
+            }
             if (!isFloat && nIntParams < MAX_PARAMS) {
                 intParams[nIntParams] = new ConfigParam <int> (name, desc, units, uid, minVal, maxVal, defaultVal, isFloat, callback);
                 nIntParams += 1;
@@ -5,24 +5,53 @@
 #include <Arduino.h>
 #include <RTCZero.h>
 #include <RTCLib.h>
-#include <WDTZero.h>
+#include "BootSequencer.h"
 #include "Config.h"
-#include "DeepSleep.h"
+#include "ControlProtocol.h"
+#include "CrashLog.h"
+#include "DataBus.h"
+#include "EnergyMeter.h"
+#include "EventJournal.h"
+#include "IdleManager.h"
+#include "JetsonLink.h"
+#include "PortBridge.h"
+#include "PowerSequencer.h"
+#include "MathBench.h"
+#include "RailAlerts.h"
 #include "SPIFlash.h"
 #include "Sensors.h"
 #include "Stats.h"
 #include "Scheduler.h"
 #include "SystemConfig.h"
 #include "SystemTrigger.h"
+#include "TxQueue.h"
+#include "TrendMonitor.h"
 #include "RBRInstrument.h"
 #include "SBE39.h"
+#include "SleepPlanner.h"
+#include "SmartBattery.h"
+#include "StrobeBudget.h"
+#include "TelemetryPolicy.h"
 #include "Utils.h"
 
 #define CMD_CHAR '!'
 #define PROMPT "BUMCTRL > "
 #define LOG_PROMPT "$BUMCTRL"
+#define LOG_HEADER "$BUMHDR"
+
+// Log lines between repeats of the $BUMHDR column names
+#define LOG_HEADER_INTERVAL 100
+
+// mV above LOWVOLTAGE the battery has to recover to before the camera may
+// run again or a low voltage sleep ends
+#define LOWVOLTAGE_HYSTERESIS 250
 #define CMD_BUFFER_SIZE 128
 
+#define NUM_HWPORTS 4
+
+// Max age in ms of a power sample used for power state decisions
+#define SAMPLE_MAX_AGE 5000
+
 // Global Sensors
 Sensors _sensors;
 
@@ -32,9 +61,6 @@ RTCZero _zerortc;
 //Global RTCLib
 RTC_DS3231 _ds3231;
 
-// Global watchdog timer with 8 second hardware timeout
-WDTZero _watchdog;
-
 // RBR instrument
 RBRInstrument _rbr;
 
@@ -55,11 +81,15 @@ class SystemControl
     bool cameraOn;
     bool pendingPowerOff;
     bool pendingPowerOn;
+    bool powerCyclePending;
     bool lowVoltage;
+    bool sysAlertMasked; // SYS undervoltage alert off until the battery recovers
     bool badEnv;
     char cmdBuffer[CMD_BUFFER_SIZE];
     bool rbrData;
-    int state;
+    PowerState powerState;
+    volatile bool powerStatePending; // rail profiles and event not applied yet
+    volatile bool wakeLoop; // set by the power button ISR, ends wait()
     unsigned long timestamp;
     unsigned long lastDepthCheck;
     unsigned long startupTimer;
@@ -70,13 +100,45 @@ class SystemControl
     unsigned long clockSyncTimer;
     unsigned long envTimer;
     unsigned long voltageTimer;
+    unsigned long powerStateTimer;
+
+    uint16_t lastBatteryAlarms;
+    unsigned long logLines;
 
     int lastFlashType, lastLowMagDuration, lastHighMagDuration, lastFrameRate;
 
-    MovingAverage<float> avgVoltage;
-    MovingAverage<float> avgTemp;
-    MovingAverage<float> avgHum;
+    MovingAverage<MilliVolts> avgVoltage;
+    MovingAverage<CentiDegrees> avgTemp;
+    MovingAverage<CentiPercent> avgHum;
     MovingAverage<float> avgDepth;
+
+    // Regression of the BME280 stream for early leak and overheat warnings,
+    // fed with the raw fixed point counts of the samples
+    TrendMonitor tempTrend;
+    TrendMonitor humTrend;
+    TrendLevel tempTrendLevel;
+    TrendLevel humTrendLevel;
+
+    // Bus cursors for the safety checks, every sample is fed to the averages
+    Subscriber<PowerSample> voltageSub;
+    Subscriber<EnvSample> envSub;
+
+    // Orin rail samples for the boot power signature
+    Subscriber<PowerSample> orinSub;
+
+    // Which passes send a log line
+    TelemetryPolicy telemetry;
+
+    // Control protocol state per TxPorts port
+    FrameDecoder decoders[NUM_TX_PORTS];
+    uint32_t subscriptions[NUM_TX_PORTS];
+
+    // Heartbeat and shutdown handshake with the Orin
+    JetsonLink jetson;
+
+    // Wakes of the low power sleep, scheduler is NULL until one is loaded
+    SleepPlanner planner;
+    Scheduler * scheduler;
     
     void readInput(Stream *in) {
       
@@ -95,6 +157,7 @@ class SystemControl
                 unsigned long startTimer = millis();
                 int index = 0;
                 while (startTimer <= millis() && millis() - startTimer < (unsigned int)(cfg.getInt("CMDTIMEOUT"))) {
+                    _supervisor.kick();
 
                     // Break if we have exceed the buffer size
                     if (index >= CMD_BUFFER_SIZE)
@@ -129,7 +192,9 @@ class SystemControl
                         // CFG (configuration commands)
                         if (cmd != NULL && strncmp_ci(cmd,CFG, 3) == 0) {
                             if (rest != NULL) {
-                                cfg.parseConfigCommand(rest, in);
+                                // parseConfigCommand leaves the param name in rest
+                                if (cfg.parseConfigCommand(rest, in))
+                                    journalConfig(rest);
                             }
                             else {
                                 char timeString[64];
@@ -140,9 +205,12 @@ class SystemControl
                             
                         }
 
-                        // PORTPASS (pass through to other serial ports)
+                        // PORTPASS (pass through to other serial ports), leaves the
+                        // command prompt while the bridge runs in the background
                         if (cmd != NULL && strncmp_ci(cmd,PORTPASS, 8) == 0) {
                             doPortPass(in, rest);
+                            if (_bridge.isActive())
+                                return;
                         }
 
                         // SETTIME (set time from string)
@@ -179,13 +247,74 @@ class SystemControl
                             goToSleep();
                         }
 
-                        else if (cmd != NULL && strncmp_ci(cmd,"TESTBATT",8) == 0) {
-                            batteryTest(0x0A);
-                            batteryTest(0x0E);
+                        else if (cmd != NULL && strncmp_ci(cmd,BATTERY,7) == 0) {
+                            _battery.print(in);
+                        }
+
+                        // ENERGY (print counters) or ENERGY,RESET
+                        else if (cmd != NULL && strncmp_ci(cmd,ENERGY,6) == 0) {
+                            if (rest != NULL && strncmp_ci(rest,"RESET",5) == 0) {
+                                if (confirm(in, "Are you sure you want to reset the energy counters ? [y/N]: ", cfg.getInt(CMDTIMEOUT)))
+                                    _energy.reset();
+                            }
+                            _energy.print(in);
+                        }
+
+                        // SERIALSTATS (per port output queue counters)
+                        else if (cmd != NULL && strncmp_ci(cmd,SERIALSTATS,11) == 0) {
+                            printSerialStats(in);
+                        }
+
+                        // BENCHMATH (float vs fixed point sensor math cycle counts)
+                        else if (cmd != NULL && strncmp_ci(cmd,BENCHMATH,9) == 0) {
+                            benchMath(in, cfg.getInt(LOWVOLTAGE));
+                        }
+
+                        // TASKS (task supervisor deadlines and overruns)
+                        else if (cmd != NULL && strncmp_ci(cmd,TASKSTATS,5) == 0) {
+                            _supervisor.print(in);
                         }
 
-                        else if (cmd != NULL && strncmp_ci(cmd,"BATTCHARGE",10) == 0) {
-                            estimateBatteryCharge();
+                        // RAIL (rail states and inrush) or RAIL,name,ON|OFF
+                        else if (cmd != NULL && strncmp_ci(cmd,RAILCTRL,4) == 0) {
+                            railCommand(in, rest);
+                        }
+
+                        // TELEMETRY (log line policy state and counts)
+                        else if (cmd != NULL && strncmp_ci(cmd,TELEMCMD,9) == 0) {
+                            telemetry.print(in, cfg);
+                        }
+
+                        // STROBE (strobe duty, power and frame rate budget)
+                        else if (cmd != NULL && strncmp_ci(cmd,STROBEBUDGETCMD,6) == 0) {
+                            printStrobes(in);
+                        }
+
+                        // EVENTS[,type[,from[,to]]] (event journal, times are
+                        // epoch seconds, a negative from is seconds before now)
+                        else if (cmd != NULL && strncmp_ci(cmd,EVENTLOG,6) == 0) {
+                            printEvents(in, rest);
+                        }
+
+                        // CRASHLOG (post-mortem records of past resets)
+                        else if (cmd != NULL && strncmp_ci(cmd,CRASHLOG,8) == 0) {
+                            _crash.print(in);
+                        }
+
+                        // BOOTLOG (boot step timing)
+                        else if (cmd != NULL && strncmp_ci(cmd,BOOTLOG,7) == 0) {
+                            _boot.print(in);
+                        }
+
+                        // POWERSTATS (time spent active, in WFI and in standby)
+                        else if (cmd != NULL && strncmp_ci(cmd,POWERSTATS,10) == 0) {
+                            _idle.print(in);
+                            planner.print(in);
+                        }
+
+                        // JETSON (heartbeat and shutdown handshake status)
+                        else if (cmd != NULL && strncmp_ci(cmd,JETSON,6) == 0) {
+                            printJetson(in);
                         }
 
                         // Reset the buffer and print out the prompt
@@ -224,25 +353,248 @@ class SystemControl
     void doPortPass(Stream * in, char * cmd) {
         char * rest;
         char * num = strtok_r(cmd,",",&rest);
+        if (num == NULL)
+            return;
+        Stream * port = NULL;
+        switch (*num) {
+            case '0':
+                port = &HWPORT0;
+                break;
+            case '1':
+                port = &HWPORT1;
+                break;
+            case '2':
+                port = &HWPORT2;
+                break;
+            case '3':
+                port = &HWPORT3;
+                break;
+        }
+        if (port == NULL || port == in)
+            return;
         in->print("Passing through to hardware port ");
         in->println(num);
+        in->println("Press Ctrl-E to exit");
         in->println();
-        if (num != NULL) {
-            char portNum = *num;
-            switch (portNum) {
-                case '0':
-                    portpass(in, &HWPORT0, cfg.getInt(LOCALECHO) == 1);
-                    break;
-                case '1':
-                    portpass(in, &HWPORT1, cfg.getInt(LOCALECHO) == 1);
-                    break;
-                case '2':
-                    portpass(in, &HWPORT2, cfg.getInt(LOCALECHO) == 1);
-                    break;
-                case '3':
-                    portpass(in, &HWPORT3, cfg.getInt(LOCALECHO) == 1);
-                    break;
+        _bridge.start(in, port, cfg.getInt(LOCALECHO) == 1);
+    }
+
+    // Read a port, bytes go to the CLI on a '!' outside a frame and to the
+    // protocol decoder otherwise
+    void pollPort(int port, bool cli) {
+        Stream * s = _tx.port(port);
+        if (_bridge.isBridged(s))
+            return;
+        int n = s->available();
+        while (n-- > 0) {
+            if (cli && !decoders[port].inFrame() && s->peek() == CMD_CHAR) {
+                // The CLI writes to the port directly, not through the queue
+                _tx.finish(port);
+                _supervisor.hold(TASK_CLI);
+                readInput(s);
+                _supervisor.release();
+                return;
             }
+            uint8_t c = s->read();
+            // Text between frames on the Jetson port may be its ready banner
+            if (!cli && jetson.bootState == JETSON_BOOTING && !decoders[port].inFrame())
+                jetson.text(c, _zerortc.getEpoch());
+            int len = decoders[port].feed(c);
+            if (len > 0)
+                handleFrame(port, decoders[port].data(), len);
+        }
+    }
+
+    void handleFrame(int port, const uint8_t * frame, int len) {
+        uint8_t op = frame[0];
+        uint8_t id = frame[1];
+        const uint8_t * body = frame + 2;
+        int bodyLen = len - 2;
+        FrameWriter reply(op | PROTO_REPLY, id);
+
+        // A user port must not be able to fake the Orin alive or halted
+        if ((op == OP_HEARTBEAT || op == OP_HALTING || op == OP_HALTED) && port != TX_JETSON_PORT) {
+            sendError(port, id, ERR_UNKNOWN_OP);
+            return;
+        }
+
+        switch (op) {
+            case OP_PING:
+                reply.putBytes(body, bodyLen);
+                break;
+
+            case OP_GET:
+                if (bodyLen % 2 != 0) {
+                    sendError(port, id, ERR_BAD_LENGTH);
+                    return;
+                }
+                for (int i = 0; i < bodyLen; i += 2) {
+                    uint16_t index = get16(body + i);
+                    reply.put16(index);
+                    if (index < cfg.nIntParams) {
+                        reply.put8(STATUS_OK);
+                        reply.put32(cfg.intParams[index]->val);
+                    }
+                    else {
+                        reply.put8(STATUS_UNKNOWN);
+                        reply.put32(0);
+                    }
+                }
+                break;
+
+            case OP_SET:
+                if (bodyLen % 6 != 0) {
+                    sendError(port, id, ERR_BAD_LENGTH);
+                    return;
+                }
+                for (int i = 0; i < bodyLen; i += 6) {
+                    uint16_t index = get16(body + i);
+                    int32_t value = get32(body + i + 2);
+                    reply.put16(index);
+                    if (index < cfg.nIntParams) {
+                        bool ok = cfg.intParams[index]->setVal(value);
+                        if (ok)
+                            journal(EVENT_CONFIG, cfg.intParams[index]->uid, value);
+                        reply.put8(ok ? STATUS_OK : STATUS_RANGE);
+                        reply.put32(cfg.intParams[index]->val);
+                    }
+                    else {
+                        reply.put8(STATUS_UNKNOWN);
+                        reply.put32(0);
+                    }
+                }
+                break;
+
+            case OP_SNAPSHOT:
+                writeSnapshot(reply);
+                break;
+
+            case OP_PARAMINFO: {
+                if (bodyLen != 2) {
+                    sendError(port, id, ERR_BAD_LENGTH);
+                    return;
+                }
+                uint16_t index = get16(body);
+                reply.put16(index);
+                if (index < cfg.nIntParams) {
+                    ConfigParam<int> * p = cfg.intParams[index];
+                    reply.put32(p->minVal);
+                    reply.put32(p->maxVal);
+                    reply.put32(p->val);
+                    reply.putString(p->name);
+                    reply.putString(p->units);
+                }
+                break;
+            }
+
+            case OP_SUBSCRIBE:
+                if (bodyLen != 4) {
+                    sendError(port, id, ERR_BAD_LENGTH);
+                    return;
+                }
+                subscriptions[port] = get32(body);
+                reply.put32(subscriptions[port]);
+                break;
+
+            case OP_SHUTDOWN:
+                if (cameraOn) {
+                    sendShutdown();
+                    reply.put8(STATUS_OK);
+                }
+                else {
+                    reply.put8(STATUS_REFUSED);
+                }
+                break;
+
+            case OP_SAVECONFIG:
+                writeConfig();
+                reply.put8(systemOkay ? STATUS_OK : STATUS_REFUSED);
+                break;
+
+            case OP_HEARTBEAT:
+                if (bodyLen != 0 && bodyLen != 4) {
+                    sendError(port, id, ERR_BAD_LENGTH);
+                    return;
+                }
+                jetson.heartbeat(_zerortc.getEpoch(), bodyLen == 4 ? get32(body) : 0);
+                reply.put8(powerState);
+                reply.put8(pendingPowerOff ? 0x01 : 0);
+                break;
+
+            case OP_HALTING:
+            case OP_HALTED:
+                if (!cameraOn) {
+                    reply.put8(STATUS_REFUSED);
+                    break;
+                }
+                if (op == OP_HALTING) {
+                    jetson.halting();
+                    printAllPorts("Jetson acknowledged shutdown");
+                }
+                else {
+                    jetson.halted(_zerortc.getEpoch());
+                    printAllPorts("Jetson halted");
+                }
+                // The Orin may also shut down on its own
+                if (!pendingPowerOff)
+                    beginPowerOff();
+                reply.put8(STATUS_OK);
+                break;
+
+            default:
+                sendError(port, id, ERR_UNKNOWN_OP);
+                return;
+        }
+        reply.send(port, TX_ALERT);
+    }
+
+    void sendError(int port, uint8_t id, uint8_t code) {
+        FrameWriter reply(OP_ERROR | PROTO_REPLY, id);
+        reply.put8(code);
+        reply.send(port, TX_ALERT);
+    }
+
+    // Fixed layout state record used by OP_SNAPSHOT and EVT_SNAPSHOT:
+    // u32 millis, u32 unixtime, u8 power state, u8 flags (camera on, low voltage,
+    // bad env, shutdown pending), i32 temperature in 0.01 C, i32 pressure in Pa,
+    // i32 humidity in 0.01 %, u8 rail count, per rail i32 mV, i32 mA, i32 mW,
+    // i32 battery charge in 0.01 % (-1 unknown), i32 runtime in min (-1 unknown)
+    void writeSnapshot(FrameWriter & w) {
+        w.put32(millis());
+        w.put32(_zerortc.getEpoch());
+        w.put8(powerState);
+        w.put8((cameraOn ? 0x01 : 0) | (lowVoltage ? 0x02 : 0) | (badEnv ? 0x04 : 0) | (pendingPowerOff ? 0x08 : 0));
+
+        const EnvSample * env = _bus.env.latest();
+        w.put32(env != NULL ? env->temperature.raw : 0);
+        w.put32(env != NULL ? env->pressure.raw : 0);
+        w.put32(env != NULL ? env->humidity.raw : 0);
+
+        const PowerSample * pwr = _bus.power.latest();
+        w.put8(NUM_RAILS);
+        for (int i = 0; i < NUM_RAILS; i++) {
+            w.put32(pwr != NULL ? pwr->voltage[i].raw : 0);
+            w.put32(pwr != NULL ? pwr->current[i].raw : 0);
+            w.put32(pwr != NULL ? pwr->power[i].raw : 0);
+        }
+
+        const BatterySample * batt = _bus.battery.latest();
+        w.put32(batt != NULL ? batt->charge.raw : -1);
+        w.put32(_energy.runtimeMinutes());
+    }
+
+    // Queue an event frame on every port subscribed to it
+    void sendEvent(uint8_t type, const uint8_t * data, int len) {
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            if (!(subscriptions[i] & type) || _bridge.isBridged(_tx.port(i)))
+                continue;
+            FrameWriter w(OP_EVENT, 0);
+            w.put8(type);
+            if (type == EVT_SNAPSHOT)
+                writeSnapshot(w);
+            else
+                w.putBytes(data, len);
+            w.send(i, type == EVT_ALERT ? TX_ALERT : TX_TELEMETRY);
         }
     }
 
@@ -268,27 +620,34 @@ class SystemControl
     int lowMagStrobeDuration;
     int highMagStrobeDuration;
     int flashType;
-    int frameRate;
-    int serialReadErrorCount;
-
-    float batteryCharge;
+    int frameRate; // trigger rate after the strobe budget
   
-    SystemControl() {
+    SystemControl() : voltageSub(&_bus.power), envSub(&_bus.env), orinSub(&_bus.power) {
         systemOkay = false;
         rbrData = false;
-        state = 0;
+        powerState = POWER_OFF;
+        powerStatePending = false;
+        wakeLoop = false;
+        sysAlertMasked = false;
+        lastBatteryAlarms = 0;
+        logLines = 0;
+        for (int i = 0; i < NUM_TX_PORTS; i++)
+            subscriptions[i] = 0;
         timestamp = 0;
+        scheduler = NULL;
         ds3231Okay = false;
         pendingPowerOff = false;
+        powerCyclePending = false;
         cameraOn = false;
         lowVoltage = false;
         badEnv = false;
-        batteryCharge = 0.0;
-        serialReadErrorCount = 0;
+        tempTrendLevel = TREND_OK;
+        humTrendLevel = TREND_OK;
     }
 
-    bool begin() {
-
+    // Start the RTC, sync it to the DS3231 and start the check timers from
+    // there. Returns false without the DS3231, the RTC runs from reset time.
+    bool beginClock() {
 
         // Start RTC
         _zerortc.begin();
@@ -312,26 +671,47 @@ class SystemControl
         voltageTimer = _zerortc.getEpoch();
         envTimer = _zerortc.getEpoch();
         clockSyncTimer = _zerortc.getEpoch();
+        powerStateTimer = _zerortc.getEpoch();
 
         lastDepth = -10.0;
 
+        return ds3231Okay;
+    }
+
+    // Start the SPI flash that holds the config and the energy counters
+    bool beginFlash() {
         systemOkay = true;
         if (_flash.initialize()) {
             DEBUGPORT.println("Flash Init OK.");
+            return true;
         }
-            
-        else {
-            DEBUGPORT.print("Init FAIL, expectedDeviceID(0x");
-            DEBUGPORT.print(_expectedDeviceID, HEX);
-            DEBUGPORT.print(") mismatched the read value: 0x");
-            DEBUGPORT.println(_flash.readDeviceId(), HEX);
-        }
+        DEBUGPORT.print("Init FAIL, expectedDeviceID(0x");
+        DEBUGPORT.print(_expectedDeviceID, HEX);
+        DEBUGPORT.print(") mismatched the read value: 0x");
+        DEBUGPORT.println(_flash.readDeviceId(), HEX);
+        return false;
+    }
 
-        // Start sensors
-        _sensors.begin();
-        
-        return true;
+    // Restore the energy counters
+    void beginEnergy() {
+        _energy.begin();
+    }
 
+    bool beginRails() {
+        return _sensors.beginRails();
+    }
+
+    bool beginEnv() {
+        return _sensors.beginEnv();
+    }
+
+    bool powerReady() {
+        return _sensors.powerReady();
+    }
+
+    // Publish a rail sample so the voltage checks have data from the start
+    void readPower() {
+        _sensors.updatePower();
     }
 
     void storeLastFlashConfig() {
@@ -349,8 +729,8 @@ class SystemControl
     }
 
     void restoreLastFlashConfig() {
+        // The durations go first, the strobe budget checks FRAMERATE against them
         cfg.set(FLASHTYPE, lastFlashType);
-        cfg.set(FRAMERATE, lastFrameRate);
         if (lastFlashType == 1) {        
             cfg.set(LOWMAGREDFLASH, lastLowMagDuration);
             cfg.set(HIGHMAGREDFLASH, lastHighMagDuration);
@@ -359,24 +739,109 @@ class SystemControl
             cfg.set(LOWMAGCOLORFLASH, lastLowMagDuration);
             cfg.set(HIGHMAGCOLORFLASH, lastHighMagDuration);
         }
+        cfg.set(FRAMERATE, lastFrameRate);
     }
 
-    void configWatchdog() {
-        // enable hardware watchdog if requested
-        if (cfg.getInt(WATCHDOG) > 0) {
-            _watchdog.setup(WDT_HARDCYCLE8S);
+    // Store the last run's crash record, needs the flash
+    void beginCrashLog() {
+        _crash.begin(&_zerortc);
+    }
+
+    // Find the end of the event journal in flash
+    void beginJournal() {
+        _journal.begin(systemOkay);
+    }
+
+    // Add a journal record stamped with the RTC time
+    void journal(EventCode code, uint16_t arg1, int32_t arg2) {
+        _journal.setClock(_zerortc.getEpoch());
+        _journal.add(code, arg1, arg2);
+    }
+
+    // Journal a param set from the CLI by the name it was set with
+    void journalConfig(const char * name) {
+        for (int i = 0; i < cfg.nIntParams; i++) {
+            if (strncmp_ci(cfg.intParams[i]->name, name, strlen(name)) == 0) {
+                journal(EVENT_CONFIG, cfg.intParams[i]->uid, cfg.intParams[i]->val);
+                return;
+            }
+        }
+    }
+
+    // Switch a single rail by hand, the camera state is not changed
+    void railCommand(Stream * ui, char * args) {
+        char * rest;
+        char * name = args != NULL ? strtok_r(args, ",", &rest) : NULL;
+        char * state = name != NULL ? strtok_r(NULL, ",", &rest) : NULL;
+        if (name != NULL) {
+            int i = PowerSequencer::railByName(name);
+            if (i < 0 || state == NULL || (strncmp_ci(state, "ON", 2) != 0 && strncmp_ci(state, "OFF", 3) != 0)) {
+                ui->println("\r\nUse RAIL,<PROBE|ORIN|DISP|CAM>,<ON|OFF>");
+                return;
+            }
+            bool on = strncmp_ci(state, "ON", 2) == 0;
+            char prompt[64];
+            sprintf(prompt, "Are you sure you want to switch %s %s ? [y/N]: ", RAILS[i].name, on ? "ON" : "OFF");
+            if (confirm(ui, prompt, cfg.getInt(CMDTIMEOUT))) {
+                _sequencer.setRail(i, on, cfg);
+                applyRailProfiles();
+            }
+        }
+        _sequencer.print(ui);
+    }
+
+    void printEvents(Stream * ui, char * args) {
+        EventFilter f = { -1, 0, 0xFFFFFFFF };
+        char * rest;
+        char * type = args != NULL ? strtok_r(args, ",", &rest) : NULL;
+        if (type != NULL && strncmp_ci(type, "ALL", 3) != 0) {
+            f.code = EventJournal::codeByName(type);
+            if (f.code < 0) {
+                ui->print("\r\nUnknown event type, one of ALL");
+                for (int i = 0; i < EVENT_CODES; i++) {
+                    ui->print(",");
+                    ui->print(EVENT_TYPES[i].name);
+                }
+                ui->println();
+                return;
+            }
+        }
+        char * from = type != NULL ? strtok_r(NULL, ",", &rest) : NULL;
+        if (from != NULL) {
+            long t = atol(from);
+            f.from = t < 0 ? _zerortc.getEpoch() + t : t;
         }
+        char * to = from != NULL ? strtok_r(NULL, ",", &rest) : NULL;
+        if (to != NULL)
+            f.to = atol(to);
+        _journal.print(ui, &f);
+    }
+
+    void reportLastRun() {
+        journal(EVENT_BOOT, PM->RCAUSE.reg, 0);
+        if (!noinitBelowHeap())
+            printAllPorts("Crash and task records overlap the heap, check noinit.ld");
+        char output[128];
+        if (_crash.describeSaved(output))
+            printAllPorts(output);
+        if (_supervisor.describePrevious(output))
+            printAllPorts(output);
+    }
+
+    void configWatchdog() {
+        // enable hardware watchdog if requested, fed by the task supervisor
+        _supervisor.begin(cfg.getInt(WATCHDOG) > 0, watchdogCapture);
     }
 
     bool turnOnCamera() {
         if (_zerortc.getEpoch() - lastPowerOffTime > (unsigned int)cfg.getInt(CAMGUARD) && !cameraOn) {
             DEBUGPORT.println("Turning ON camera power...");
             cameraOn = true;
-            digitalWrite(CAM_POWER, HIGH);
-            digitalWrite(DISP_POWER, HIGH);
-            digitalWrite(ORIN_POWER, HIGH);
-            digitalWrite(PROBE_POWER, LOW);
+            journal(EVENT_CAMERA_ON, 0, 0);
+            jetson.powerOn(_zerortc.getEpoch());
+            _sequencer.run(CAMERA_ON_SEQUENCE, cfg);
             lastPowerOnTime = _zerortc.getEpoch();
+            setPowerState(POWER_BOOTING);
             return true;
         }
         else {
@@ -385,14 +850,10 @@ class SystemControl
     }
 
     bool turnOffCamera() {
+        powerCyclePending = false;
         if (_zerortc.getEpoch() - lastPowerOnTime > (unsigned int)cfg.getInt(CAMGUARD) && cameraOn) {
             DEBUGPORT.println("Turning OFF camera power...");
-            cameraOn = false;
-            digitalWrite(CAM_POWER, LOW);
-            digitalWrite(DISP_POWER, LOW);
-            digitalWrite(ORIN_POWER, LOW);
-            digitalWrite(PROBE_POWER, HIGH);
-            lastPowerOffTime = _zerortc.getEpoch();
+            cutCameraPower();
             return true;
         }
         else {
@@ -400,6 +861,135 @@ class SystemControl
         }
     }
 
+    // Switch the camera rails off now, ignoring CAMGUARD. A fault skips the
+    // delays between the rails.
+    void cutCameraPower(bool fault = false) {
+        journal(EVENT_CAMERA_OFF, 0, 0);
+        cameraOn = false;
+        pendingPowerOff = false;
+        jetson.powerOff();
+        _sequencer.run(CAMERA_OFF_SEQUENCE, cfg, fault);
+        lastPowerOffTime = _zerortc.getEpoch();
+        setPowerState(POWER_OFF);
+    }
+
+    // Program the INA260 alert of every rail. The always-on rail alerts on
+    // LOWVOLTAGE, switched rails on their overcurrent limit param.
+    void configureRailAlerts() {
+        for (int i = 0; i < NUM_RAILS; i++) {
+            if (RAILS[i].group == RAIL_ALWAYS && sysAlertMasked) {
+                _rails.configureAlert(i, INA260_ALERT_NONE, 0);
+            }
+            else if (RAILS[i].group == RAIL_ALWAYS) {
+                int limit = cfg.getInt(LOWVOLTAGE);
+                _rails.configureAlert(i, INA260_ALERT_UNDERVOLTAGE, (int)((long)limit * 1000 / INA260_VOLTAGE_LSB));
+            }
+            else if (RAILS[i].limitParam != NULL && cfg.getInt(RAILS[i].limitParam) > 0) {
+                int limit = cfg.getInt(RAILS[i].limitParam);
+                _rails.configureAlert(i, INA260_ALERT_OVERCURRENT, (int)((long)limit * 1000 / INA260_CURRENT_LSB));
+            }
+            else {
+                _rails.configureAlert(i, INA260_ALERT_NONE, 0);
+            }
+        }
+    }
+
+    // Handle alerts queued by the alert ISRs
+    void checkAlerts() {
+        RailAlertEvent e;
+        while (_railAlerts.pop(&e)) {
+
+            // Reading the flag clears the latched alert line
+            _rails.alertTriggered(e.rail);
+
+            char output[128];
+            if (RAILS[e.rail].group == RAIL_ALWAYS) {
+                // The alert latches on a single conversion and would fire on
+                // every one while the battery stays low, so it is masked until
+                // checkVoltage() sees the average recover
+                sysAlertMasked = true;
+                _rails.configureAlert(e.rail, INA260_ALERT_NONE, 0);
+                MilliVolts v = _rails.readBusVoltage(e.rail);
+                if (v < MilliVolts(6000)) {
+                    // likely on USB power
+                    continue;
+                }
+                // A camera inrush sags the bus for a conversion or two, only
+                // the averaged voltage shuts the camera down
+                MilliVolts avg = avgVoltage.average();
+                bool sustained = avgVoltage.size() > 0 && avg < MilliVolts(cfg.getInt(LOWVOLTAGE));
+                sprintf(output, "Rail %s undervoltage alert at %lu ms: %ld mV, average %ld mV, limit %d mV%s",
+                    RAILS[e.rail].name, (unsigned long)e.timestamp, (long)v.raw, (long)avg.raw,
+                    cfg.getInt(LOWVOLTAGE), sustained ? "" : ", transient");
+                printAllPorts(output);
+                if (sustained && cameraOn && !pendingPowerOff) {
+                    sendShutdown();
+                }
+            }
+            else {
+                sprintf(output, "Rail %s overcurrent alert at %lu ms: %ld mA above %d mA%s",
+                    RAILS[e.rail].name, (unsigned long)e.timestamp, (long)_rails.readCurrent(e.rail).raw,
+                    cfg.getInt(RAILS[e.rail].limitParam), e.powerCut ? ", power cut" : "");
+                printAllPorts(output);
+
+                if (e.powerCut)
+                    _sequencer.markOff(e.rail);
+
+                // The camera can't run with one of its rails cut, turn off the rest
+                if (RAILS[e.rail].group == RAIL_CAMERA && cameraOn) {
+                    cutCameraPower(true);
+                }
+            }
+        }
+
+        if (_railAlerts.overflows > 0) {
+            char output[64];
+            sprintf(output, "Rail alert queue overflowed %lu times", (unsigned long)_railAlerts.overflows);
+            printAllPorts(output);
+            _railAlerts.overflows = 0;
+        }
+    }
+
+    // Called from an interrupt handler this only records the state, the
+    // rail profiles (I2C) and the protocol event are left to update()
+    void setPowerState(PowerState newState) {
+        powerState = newState;
+        powerStateTimer = _zerortc.getEpoch();
+        powerStatePending = true;
+        if (__get_IPSR() == 0)
+            applyPowerState();
+    }
+
+    // Apply the rail profiles of a new power state and announce it
+    void applyPowerState() {
+        if (!powerStatePending)
+            return;
+        powerStatePending = false;
+        applyRailProfiles();
+        uint8_t state = powerState;
+        sendEvent(EVT_POWER, &state, 1);
+    }
+
+    PowerState getPowerState() {
+        return powerState;
+    }
+
+    // Set the INA260 sampling of every rail from the power state and the
+    // RAILFAST/RAILIDLE config, safe to call at any time after begin()
+    void applyRailProfiles() {
+        SamplingProfile fast = {
+            (INA260_AveragingCount)cfg.getInt(RAILFASTAVG),
+            (INA260_ConversionTime)cfg.getInt(RAILFASTCONV),
+            INA260_MODE_CONTINUOUS
+        };
+        SamplingProfile idle = {
+            (INA260_AveragingCount)cfg.getInt(RAILIDLEAVG),
+            (INA260_ConversionTime)cfg.getInt(RAILIDLECONV),
+            cfg.getInt(RAILIDLEOFF) == 1 ? INA260_MODE_SHUTDOWN : INA260_MODE_CONTINUOUS
+        };
+        _rails.applyState(powerState, fast, idle);
+    }
+
     void getTimeString(char * timeString) {
         
         sprintf(timeString,"%s","YYYY-MM-DD hh:mm:ss");
@@ -425,8 +1015,68 @@ class SystemControl
     bool update() {
 
         // Run updates and check for new data
+        _supervisor.start(TASK_SENSORS);
         _sensors.update();
 
+        // Account energy and checkpoint it to flash
+        _energy.update();
+        _energy.blendBattery(cfg.getInt(BATTCAPACITY), cfg.getInt(ENERGYBLEND));
+        _energy.checkpoint((unsigned long)cfg.getInt(ENERGYSAVEINT) * 60000);
+
+        // Power state changes made from an interrupt handler
+        applyPowerState();
+
+        // Write new journal records and keep the ISR timestamps on the RTC
+        _journal.flush();
+        _journal.setClock(_zerortc.getEpoch());
+        _supervisor.checkIn(TASK_SENSORS);
+
+        _supervisor.start(TASK_TELEMETRY);
+        bool logged = logLine();
+        _supervisor.checkIn(TASK_TELEMETRY);
+        return logged;
+    }
+
+    // State that picks the log line interval, faults first
+    TelemetryState telemetryState() {
+        if (lowVoltage || badEnv || tempTrendLevel != TREND_OK || humTrendLevel != TREND_OK)
+            return TELEM_FAULT;
+        if (pendingPowerOff)
+            return TELEM_SHUTDOWN;
+        if (cameraOn)
+            return jetson.bootState == JETSON_BOOTING ? TELEM_BOOTING : TELEM_IMAGING;
+        return TELEM_IDLE;
+    }
+
+    // Send the $BUMCTRL line and the snapshot event, false if there is no data
+    // yet or the telemetry policy holds this pass back
+    bool logLine() {
+        const PowerSample * pwr = _bus.power.latest();
+        const EnvSample * env = _bus.env.latest();
+        const BatterySample * batt = _bus.battery.latest();
+        if (pwr == NULL || env == NULL) {
+            return false;
+        }
+
+        TelemetryState state = telemetryState();
+        TelemetryDeadbands bands = {
+            CentiDegrees(cfg.getInt(LOGDBTEMP)),
+            Pascals(cfg.getInt(LOGDBPRES)),
+            CentiPercent(cfg.getInt(LOGDBHUM)),
+            MilliVolts(cfg.getInt(LOGDBVOLT)),
+            MilliWatts(cfg.getInt(LOGDBPOWER))
+        };
+        uint32_t now = millis();
+        if (!telemetry.due(state, now, cfg.getInt(TELEMETRY_STATES[state].intervalParam),
+                (uint32_t)cfg.getInt(LOGHEARTBEAT) * 1000, env, pwr, bands))
+            return false;
+        telemetry.markSent(now, env, pwr);
+
+        // Name the columns now and then so a capture started at any point can be
+        // decoded, see tools/bumlog
+        if (logLines++ % LOG_HEADER_INTERVAL == 0)
+            printLogHeader();
+
         // Build log string and send to UIs
         char output[512];
 
@@ -440,55 +1090,62 @@ class SystemControl
         char timeString[64];
         getTimeString(timeString);
 
-        // @TODO: figure out why BME280 data is sometime corrupted
-        if (_sensors.temperature < 5.0 || _sensors.temperature > 100.0) {
-            printAllPorts("Error with sensor reading, skipping conversion and logging.");
-            //DEBUGPORT.println("Resetting bus...");
-            //_sensors.begin();
-            serialReadErrorCount++;
-            if (serialReadErrorCount > 10) {
-                printAllPorts("Resetting microcontroller due to persistent serial errors");
-                resetFunc();
-            }
-            return false;
-        }
-
-        // Serial data okay if we got here so reset the counter
-        serialReadErrorCount = 0;
-
-        // The system log string, note this requires enabling printf_float build
-        // option work show any output for floating point values
-        sprintf(output, "%s,%s.%03u,%0.3f,%0.3f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f,%0.2f",
-
+        // The system log string, all values are fixed point and printed with
+        // integer formatting so no soft-float is involved
+        int len = sprintf(output, "%s,%s.%03u,",
             LOG_PROMPT,
             timeString,
-            (unsigned int) ((unsigned int) millis()) % 1000,
-            _sensors.temperature, // In C
-            _sensors.pressure / 1000, // in kPa
-            _sensors.humidity, // in %
-            _sensors.voltage[0] / 1000, // In Volts
-            _sensors.power[0] / 1000, // in W
-            _sensors.voltage[1] / 1000, // In Volts
-            _sensors.power[1] / 1000, // in W
-            _sensors.voltage[2] / 1000, // In Volts
-            _sensors.power[2] / 1000, // in W
-            _sensors.voltage[3] / 1000, // In Volts
-            _sensors.power[3] / 1000, // in W
-            _sensors.voltage[4] / 1000, // In Volts
-            _sensors.power[4] / 1000, // in W
-            batteryCharge // in %
-            
+            (unsigned int) ((unsigned int) millis()) % 1000
         );
+        len += env->temperature.format(output + len, 2); // in C
+        output[len++] = ',';
+        len += env->pressure.format(output + len, 3); // in kPa
+        output[len++] = ',';
+        len += env->humidity.format(output + len, 2); // in %
+
+        // Voltage and power of each rail in table order
+        for (int i = 0; i < NUM_RAILS; i++) {
+            output[len++] = ',';
+            len += pwr->voltage[i].format(output + len, 2); // in V
+            output[len++] = ',';
+            len += pwr->power[i].format(output + len, 2); // in W
+        }
+
+        long runtime = _energy.runtimeMinutes();
+        output[len++] = ',';
+        len += (batt != NULL ? batt->charge : CentiPercent(0)).format(output + len, 2); // in %
+        output[len++] = ',';
+        len += _energy.energyMilliWh(RAIL_SYS).format(output + len, 3); // in Wh
+        output[len++] = ',';
+        // in hours, -1.0 if unknown
+        if (runtime >= 0)
+            len += sprintf(output + len, "%ld.%ld", runtime / 60, (runtime % 60) / 6);
+        else
+            len += sprintf(output + len, "-1.0");
+        appendChecksum(output, len);
 
         // Send output
-        printAllPorts(output);
+        printAllPorts(output, TX_TELEMETRY);
+        sendEvent(EVT_SNAPSHOT, NULL, 0);
 
         return true;
     }
 
+    // Column names of the $BUMCTRL line, keep in step with update()
+    void printLogHeader() {
+        char output[256];
+        int len = sprintf(output, "%s,time,temp_c,pressure_kpa,humidity_pct", LOG_HEADER);
+        for (int i = 0; i < NUM_RAILS; i++)
+            len += sprintf(output + len, ",%s_v,%s_w", RAILS[i].name, RAILS[i].name);
+        len += sprintf(output + len, ",charge_pct,energy_wh,runtime_h");
+        appendChecksum(output, len);
+        printAllPorts(output, TX_TELEMETRY);
+    }
+
     void writeConfig() {
         if (systemOkay) {
             cfg.writeConfig();
+            journal(EVENT_CONFIG_SAVE, 0, 0);
         }
     }
 
@@ -498,33 +1155,243 @@ class SystemControl
     }
 
     void checkInput() {
-        if (DEBUGPORT.available() > 0) {
-            readInput(&DEBUGPORT);
+        // Ports in a PORTPASS bridge belong to the bridge
+        _bridge.service();
+        _tx.service();
+        for (int i = 0; i < NUM_HWPORTS; i++)
+            hwPort(i)->checkErrors();
+        // User ports take CLI commands and protocol frames, the Jetson port
+        // protocol frames only
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            pollPort(i, _tx.port(i) != &JETSONPORT);
+        }
+
+    }
+
+    // Queue a line for all UI ports, routine log lines should be sent as
+    // TX_TELEMETRY so they can't hold up safety messages. Alerts also go out
+    // as protocol events.
+    void printAllPorts(const char output[], TxPriority priority = TX_ALERT) {
+        _tx.printAll(output, priority);
+        if (priority == TX_ALERT) {
+            sendEvent(EVT_ALERT, (const uint8_t *)output, strlen(output));
+            _crash.note(output);
+        }
+    }
+
+    // Service the ports for ms, sleeping whenever there is nothing to do.
+    // Input, a rail alert or the power button end the wait early so the loop
+    // handles them without waiting out a long idle pass.
+    void wait(unsigned long ms) {
+        unsigned long start = millis();
+        while (true) {
+            _bridge.service();
+            _tx.service();
+            _supervisor.feed();
+            unsigned long elapsed = millis() - start;
+            if (elapsed >= ms || wakeLoop || _railAlerts.pending() || inputWaiting()) {
+                wakeLoop = false;
+                break;
+            }
+            _idle.sleep(_supervisor.maxSleep(ms - elapsed), canStandby());
+        }
+    }
+
+    // Cut the current wait() short, safe from an interrupt handler
+    void endWait() {
+        wakeLoop = true;
+    }
+
+    // Time in ms between sensor passes. While idle the passes are LOGINTIDLE
+    // apart, long enough to sleep in standby between them.
+    int loopPeriod() {
+        return idle() ? cfg.getInt(LOGINTIDLE) : cfg.getInt(LOGINT);
+    }
+
+    // Camera off, no bridge and no USB host
+    bool idle() {
+        return cfg.getInt(IDLESTANDBY) == 1 && powerState == POWER_OFF && !_bridge.isActive() && !USBDevice.connected();
+    }
+
+    bool inputWaiting() {
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            if (!_bridge.isBridged(_tx.port(i)) && _tx.port(i)->available() > 0)
+                return true;
         }
-        if (UI1.available() > 0) {
-            readInput(&UI1);
+        return false;
+    }
+
+    // True if nothing needs the fast clocks: idle, all output sent and no
+    // input waiting. Standby stops the SERCOM clocks and the wake ports are
+    // disabled to move them, so the last byte has to be out of the shift
+    // register, not just out of the queue.
+    bool canStandby() {
+        if (!idle() || inputWaiting())
+            return false;
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            if (_tx.queue(i)->pending() > 0)
+                return false;
         }
-        if (UI2.available() > 0) {
-            readInput(&UI2);
+        for (int i = 0; i < NUM_HWPORTS; i++) {
+            if (!hwPort(i)->txIdle())
+                return false;
         }
+        return true;
+    }
+
+    void configureIdle() {
+        pinMode(LED_BUILTIN, OUTPUT);
+        _idle.begin(&_zerortc, &UI1, &UI2);
+        _idle.clear();
+    }
 
+    RxPort * hwPort(int i) {
+        switch (i) {
+            case 0:
+                return &HWPORT0;
+            case 1:
+                return &HWPORT1;
+            case 2:
+                return &HWPORT2;
+            default:
+                return &HWPORT3;
+        }
     }
 
-    void printAllPorts(const char output[]) {
-        UI1.println(output);
-        UI2.println(output);
-        DEBUGPORT.println(output);
+    // Move the hardware ports with a HWPORTnRXBUF size onto DMA receive rings,
+    // buffers are allocated once so size changes need a restart
+    void configureSerialRx() {
+        const char * params[NUM_HWPORTS] = { HWPORT0RXBUF, HWPORT1RXBUF, HWPORT2RXBUF, HWPORT3RXBUF };
+        for (int i = 0; i < NUM_HWPORTS; i++) {
+            int n = cfg.getInt(params[i]);
+            if (n > 0 && !hwPort(i)->canDma()) {
+                char output[64];
+                sprintf(output, "HWPORT%d has no DMA receive, its SERCOM handler is in the variant", i);
+                printAllPorts(output);
+            }
+            else if (n > 0 && !hwPort(i)->enableDma(n)) {
+                char output[64];
+                sprintf(output, "No room for a %d byte receive buffer on HWPORT%d", n, i);
+                printAllPorts(output);
+            }
+        }
+    }
+
+    void printSerialStats(Stream * ui) {
+        char output[96];
+        ui->println();
+        ui->println("Port     Receive      Bytes  Overruns  FIFO ovf  Framing");
+        for (int i = 0; i < NUM_HWPORTS; i++) {
+            RxPort * p = hwPort(i);
+            if (p->isDma()) {
+                sprintf(output, "HWPORT%d  DMA %5d  %9lu  %8lu  %8lu  %7lu", i, p->bufferSize(),
+                    p->bytes, p->overruns, p->bufferOverflows, p->framingErrors);
+            }
+            else {
+                sprintf(output, "HWPORT%d  UART       %9lu         -         -        -", i, p->bytes);
+            }
+            ui->println(output);
+        }
+        ui->println();
+        ui->println("Port    Pending  Dropped lines  Dropped alerts  Frames  Bad frames");
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            TxQueue * q = _tx.queue(i);
+            sprintf(output, "%-6s  %7d  %13lu  %14lu  %6lu  %10lu", _tx.name(i), q->pending(), q->droppedLines,
+                q->droppedAlerts, decoders[i].frames, decoders[i].errors);
+            ui->println(output);
+        }
+    }
+
+    void printJetson(Stream * ui) {
+        static const char * states[] = { "running", "halting", "halted" };
+        char output[96];
+        uint32_t now = _zerortc.getEpoch();
+        ui->println();
+        sprintf(output, "Protocol agent: %s", jetson.isAlive(now) ? "alive" : "not seen");
+        ui->println(output);
+        sprintf(output, "State: %s", states[jetson.state]);
+        ui->println(output);
+        long age = jetson.heartbeatAge(now);
+        if (age >= 0)
+            sprintf(output, "Last heartbeat: %ld s ago, Orin uptime %lu s", age, (unsigned long)jetson.uptime);
+        else
+            sprintf(output, "Last heartbeat: none since power on");
+        ui->println(output);
+        sprintf(output, "Heartbeats: %lu, watchdog power cycles: %lu", jetson.heartbeats, jetson.powerCycles);
+        ui->println(output);
+        static const char * boot[] = { "off", "booting", "ready" };
+        sprintf(output, "Boot: %s, ready by %s, strobes %s", boot[jetson.bootState],
+            JetsonLink::sourceName(jetson.readySource), strobesAllowed() ? "allowed" : "held");
+        ui->println(output);
+        if (jetson.bootTimes.count() > 0) {
+            sprintf(output, "Boot time (s): last %lu, mean %ld, min %ld, max %ld over %lu boots",
+                (unsigned long)jetson.bootTime, (long)jetson.bootTimes.mean(), (long)jetson.bootTimes.min(),
+                (long)jetson.bootTimes.max(), jetson.bootTimes.count());
+            ui->println(output);
+        }
     }
 
     void checkCameraPower() {
 
+        uint32_t now = _zerortc.getEpoch();
+
+        // Follow the Orin boot on its rail power, heartbeats and banners are
+        // fed from the port
+        const PowerSample * pwr;
+        while ((pwr = orinSub.poll()) != NULL) {
+            if (pwr->valid & RAIL_VALID(RAIL_ORIN))
+                jetson.power(pwr->timestamp, pwr->power[RAIL_ORIN], cfg.getInt(JETSONSETTLE), now);
+        }
+
+        // The camera has booted, back to normal sampling and strobes allowed
+        if (jetson.takeReady()) {
+            char output[64];
+            sprintf(output, "Jetson ready %lu s after power on (%s)", (unsigned long)jetson.bootTime,
+                JetsonLink::sourceName(jetson.readySource));
+            printAllPorts(output);
+            journal(EVENT_JETSON_READY, jetson.readySource, jetson.bootTime);
+            if (powerState == POWER_BOOTING)
+                setPowerState(POWER_ON);
+        }
+
+        // Without a sign of readiness drop the rails back to normal sampling
+        // after RAILFASTTIME anyway
+        if (powerState == POWER_BOOTING && now - powerStateTimer > (unsigned int)cfg.getInt(RAILFASTTIME)) {
+            setPowerState(POWER_ON);
+        }
+
+        // The Orin confirmed the halt, no need to wait any longer
+        if (pendingPowerOff && jetson.readyToCut(now, cfg.getInt(HALTGRACE))) {
+            printAllPorts("Cutting camera power after Jetson halt");
+            journal(EVENT_HALTED, 0, 0);
+            cutCameraPower();
+            return;
+        }
+
+        // Without the protocol agent guess the halt from the Orin power, only
+        // trusting a recent reading
+        bool orinHalted = false;
+        if (!jetson.isAlive(now) && _bus.power.fresh(SAMPLE_MAX_AGE)) {
+            orinHalted = _bus.power.latest()->power[RAIL_ORIN] < MilliWatts(9500);
+        }
+
         // Check for power off flag
-        if (pendingPowerOff && ((_sensors.power[2] < 9500) || (_zerortc.getEpoch() - pendingPowerOffTimer > (unsigned int)cfg.getInt(MAXSHUTDOWNTIME)))) {
+        if (pendingPowerOff && (orinHalted || (_zerortc.getEpoch() - pendingPowerOffTimer > (unsigned int)cfg.getInt(MAXSHUTDOWNTIME)))) {
             turnOffCamera();
             pendingPowerOff = false;
             return;
         }
 
+        // Power cycle a hung Orin
+        if (cameraOn && !pendingPowerOff && jetson.heartbeatLost(now, cfg.getInt(HBTIMEOUT), cfg.getInt(HBBOOTGRACE))) {
+            printAllPorts("Jetson heartbeat lost, power cycling camera");
+            jetson.powerCycles++;
+            journal(EVENT_HEARTBEAT_LOST, jetson.powerCycles, 0);
+            cutCameraPower();
+            powerCyclePending = true;
+            return;
+        }
+
         // Check depth range
 
         // Never turn on camera if voltage is too low or env sensors are bad
@@ -532,6 +1399,11 @@ class SystemControl
             return;
         }
 
+        // Second half of a watchdog power cycle, turnOnCamera() waits out CAMGUARD
+        if (powerCyclePending && turnOnCamera()) {
+            powerCyclePending = false;
+        }
+
     }
 
     void checkEnv() {
@@ -539,10 +1411,30 @@ class SystemControl
             return;
 
 
-        // Update moving average of temperature
-        float latestTemp = avgTemp.update(_sensors.temperature);
-        float latestHum = avgHum.update(_sensors.humidity);
-        //float latestVoltage = _sensors.voltage[0];
+        // Update moving average and trend of temperature and humidity with every
+        // new sample, glitched channels are left out
+        tempTrend.setWindow(cfg.getInt(TRENDWINDOW));
+        humTrend.setWindow(cfg.getInt(TRENDWINDOW));
+        bool newData = false;
+        const EnvSample * env;
+        while ((env = envSub.poll()) != NULL) {
+            if (env->valid & ENV_TEMP_VALID) {
+                avgTemp.update(env->temperature);
+                tempTrend.update(env->timestamp, env->temperature.raw);
+                newData = true;
+            }
+            if (env->valid & ENV_HUM_VALID) {
+                avgHum.update(env->humidity);
+                humTrend.update(env->timestamp, env->humidity.raw);
+                newData = true;
+            }
+        }
+
+        if (!newData)
+            return;
+
+        CentiDegrees latestTemp = avgTemp.average();
+        CentiPercent latestHum = avgHum.average();
 
         // Make sure this check happens AFTER updating the average measurement, otherwise
         // the average will not be calculated properly
@@ -552,40 +1444,113 @@ class SystemControl
         // Reset check timer
         envTimer = _zerortc.getEpoch();
 
-        if (latestTemp > cfg.getInt(TEMPLIMIT)) {
+        // badEnv holds until a check finds everything back in range
+        bool bad = false;
+
+        if (latestTemp > CentiDegrees::fromUnits(cfg.getInt(TEMPLIMIT))) {
             char output[64];
-            sprintf(output,"Temperature %0.2f C exceeds limit of %0.2f C", latestTemp, (float)cfg.getInt(TEMPLIMIT));
+            char value[16];
+            latestTemp.format(value, 2);
+            sprintf(output,"Temperature %s C exceeds limit of %d C", value, cfg.getInt(TEMPLIMIT));
             printAllPorts(output);
-            badEnv = true;
+            if (!badEnv)
+                journal(EVENT_ENV_LIMIT, 0, latestTemp.raw);
+            bad = true;
             if (cameraOn) {
                 printAllPorts("Shuting down camera...");
                 sendShutdown();
             }
         }
 
-        if (latestHum > cfg.getInt(HUMLIMIT)) {
+        if (latestHum > CentiPercent::fromUnits(cfg.getInt(HUMLIMIT))) {
             char output[64];
-            sprintf(output,"Humidity %0.2f %% exceeds limit of %0.2f %%", latestHum, (float)cfg.getInt(HUMLIMIT));
+            char value[16];
+            latestHum.format(value, 2);
+            sprintf(output,"Humidity %s %% exceeds limit of %d %%", value, cfg.getInt(HUMLIMIT));
             printAllPorts(output);
-            badEnv = true;
+            if (!badEnv)
+                journal(EVENT_ENV_LIMIT, 1, latestHum.raw);
+            bad = true;
             if (cameraOn) {
                 printAllPorts("Shuting down camera...");
                 sendShutdown();
             }
         }
 
-        badEnv = false;
+        // Shut down early if a trend will hit a limit before we could finish
+        // a clean shutdown, warn well before that
+        TrendLevel t = checkTrend<CentiDegrees>(tempTrend, "Temperature", "C", cfg.getInt(TEMPLIMIT), &tempTrendLevel);
+        TrendLevel h = checkTrend<CentiPercent>(humTrend, "Humidity", "%", cfg.getInt(HUMLIMIT), &humTrendLevel);
+        if (t >= TREND_SHUTDOWN || h >= TREND_SHUTDOWN) {
+            bad = true;
+            if (cameraOn && !pendingPowerOff) {
+                printAllPorts("Shuting down camera...");
+                sendShutdown();
+            }
+        }
+
+        if (badEnv && !bad)
+            journal(EVENT_ENV_OK, 0, 0);
+        badEnv = bad;
         
     }
 
+    // Grade one trend against its limit in whole units, reports level changes.
+    // T is the fixed point type the trend was fed with.
+    template <class T>
+    TrendLevel checkTrend(TrendMonitor & trend, const char * name, const char * unit, int limit, TrendLevel * last) {
+        float limitCounts = T::fromUnits(limit).raw;
+        TrendLevel level = trend.check(limitCounts,
+            cfg.getInt(TRENDWARNTIME) * 60.0, cfg.getInt(TRENDSHUTDOWNTIME) * 60.0);
+        if (level != *last) {
+            char output[128];
+            // slope in counts per s to units per hour
+            T rate((int32_t)(trend.slope() * 3600));
+            char rateString[16];
+            rate.format(rateString, 2);
+            if (level == TREND_WARN || level == TREND_SHUTDOWN) {
+                sprintf(output, "%s rising %s %s/h, %ld min to limit of %d %s%s", name, rateString, unit,
+                    (long)(trend.timeToLimit(limitCounts) / 60), limit, unit,
+                    level == TREND_SHUTDOWN ? ", shutting down early" : "");
+            }
+            else if (level == TREND_OK) {
+                sprintf(output, "%s trend back to normal", name);
+            }
+            else {
+                sprintf(output, "%s trend at limit of %d %s", name, limit, unit);
+            }
+            printAllPorts(output);
+            journal(EVENT_TREND, &trend == &humTrend, level);
+            *last = level;
+        }
+        return level;
+    }
+
     void checkVoltage() {
 
         if (_zerortc.getEpoch() - startupTimer <= (unsigned int)cfg.getInt(STARTUPTIME))
             return;
 
-        // Update moving average of voltage
-        float latestVoltage = avgVoltage.update(_sensors.voltage[0]);
-        //float latestVoltage = _sensors.voltage[0];
+        // Update moving average of voltage with every new sample
+        MilliVolts latestVoltage;
+        bool newData = false;
+        const PowerSample * pwr;
+        while ((pwr = voltageSub.poll()) != NULL) {
+            // A failed read holds the last value, it is not a new reading
+            if (!(pwr->valid & RAIL_VALID(RAIL_SYS)))
+                continue;
+            latestVoltage = avgVoltage.update(pwr->voltage[RAIL_SYS]);
+            newData = true;
+        }
+
+        if (!newData)
+            return;
+
+        // Re-arm the SYS undervoltage alert once the battery is back up
+        if (sysAlertMasked && latestVoltage >= MilliVolts(cfg.getInt(LOWVOLTAGE) + LOWVOLTAGE_HYSTERESIS)) {
+            sysAlertMasked = false;
+            configureRailAlerts();
+        }
 
         // Make sure this check happens AFTER updating the average measurement, otherwise
         // the average will not be calculated properly
@@ -595,18 +1560,27 @@ class SystemControl
         // Reset check timer
         voltageTimer = _zerortc.getEpoch();
 
-        if (latestVoltage < 6000.0) {
+        if (latestVoltage < MilliVolts(6000)) {
             // likely on USB power, note voltage is in mV
             return;
         }
 
+        // Clear low voltage only once the battery is clearly back up
+        if (latestVoltage >= MilliVolts(cfg.getInt(LOWVOLTAGE) + LOWVOLTAGE_HYSTERESIS) && lowVoltage) {
+            journal(EVENT_VOLTAGE_OK, 0, latestVoltage.raw);
+            lowVoltage = false;
+        }
+
         // If battery voltage is too low, notify and sleep
         // If the camera is running at this point, shut it down first
-        if (latestVoltage < cfg.getInt(LOWVOLTAGE)) {
+        if (latestVoltage < MilliVolts(cfg.getInt(LOWVOLTAGE))) {
+            if (!lowVoltage)
+                journal(EVENT_LOW_VOLTAGE, 0, latestVoltage.raw);
+            lowVoltage = true;
             char output[256];
-            sprintf(output,"Voltage %f below threshold %d", latestVoltage, cfg.getInt(LOWVOLTAGE));
+            sprintf(output,"Voltage %ld below threshold %d", (long)latestVoltage.raw, cfg.getInt(LOWVOLTAGE));
             printAllPorts(output);
-            if (cameraOn) {
+            if (cameraOn && !pendingPowerOff) {
                 sendShutdown();
             }
             if (cfg.getInt(STANDBY) == 1 && !cameraOn) {
@@ -615,39 +1589,166 @@ class SystemControl
         }
     }
 
+    // Sleep in standby with the camera off until the full loop is needed
+    // again: a command or the power button, a scheduled event, or the battery
+    // recovering if we went to sleep on low voltage. In between the console
+    // only wakes for the deadlines SleepPlanner sets and reads just what each
+    // one needs, everything else keeps its state for a warm resume.
     void goToSleep() {
-        
-        printAllPorts("Going to sleep...");
-        _zerortc.setAlarmTime(0, 0, 0);
-        if (cfg.getInt(CHECKHOURLY) == 1) {
-            printAllPorts("Alarm Set for 1 Hour");
-            _zerortc.enableAlarm(RTCZero::MATCH_MMSS);
+        if (cfg.getInt(STANDBY) != 1) {
+            printAllPorts("STANDBY is off, not going to sleep");
+            return;
         }
-        else {
-            printAllPorts("Alarm Set for 1 Minute");
-            _zerortc.enableAlarm(RTCZero::MATCH_SS);
+        if (cameraOn) {
+            printAllPorts("Camera is on, not going to sleep");
+            return;
         }
-        if (cfg.getInt(STANDBY) == 1) {
-            _zerortc.standbyMode();
+
+        uint32_t now = _zerortc.getEpoch();
+        uint32_t checkPeriod = cfg.getInt(CHECKHOURLY) == 1 ? 3600 : cfg.getInt(CHECKINTERVAL);
+        planner.enter(now, checkPeriod, (uint32_t)cfg.getInt(ENERGYSAVEINT) * 60, lowVoltage);
+        planner.plan(now, nextScheduled());
+        char output[64];
+        sprintf(output, "Going to sleep, first wake in %lu s for %s",
+            (unsigned long)(planner.wakeAt - now), SleepPlanner::wakeName(planner.planned));
+        printAllPorts(output);
+        journal(EVENT_SLEEP, planner.planned, planner.wakeAt - now);
+        _journal.flush();
+        _tx.flush(1000);
+
+        // The WDT would not be served, the flash has a deep power down
+        _supervisor.suspend();
+        _flash.sleep();
+
+        while (true) {
+            // Standby from a second edge so the alarm lands on the deadline
+            uint32_t t0 = _idle.secondEdge();
+            uint32_t wakeAt = planner.plan(t0, nextScheduled());
+            WakeReason reason = WAKE_ALARM;
+            if ((int32_t)(wakeAt - t0) > 0)
+                reason = _idle.standby(t0, wakeAt - t0, false);
+            uint32_t t = micros();
+
+            SleepWake wake = planner.woke(reason);
+            now = _zerortc.getEpoch();
+            bool resume = true;
+            if (wake == SLEEP_WAKE_CHECK) {
+                resume = sleepCheck();
+            }
+            else if (wake == SLEEP_WAKE_BATTERY) {
+                sleepBattery();
+                resume = false;
+            }
+            planner.served(wake, now);
+            if (resume)
+                break;
+            _tx.flush(1000);
+            planner.wakeCost(micros() - t);
         }
+
+        warmResume(now);
+    }
+
+    // Seconds to the next scheduled event, -1 if none
+    long nextScheduled() {
+        return scheduler != NULL ? scheduler->nextEventStart(&_zerortc) : -1;
+    }
+
+    // Planned check while asleep. Only the rail monitors are read, nothing
+    // acts on the environment with the camera off. Returns true to wake up.
+    bool sleepCheck() {
+        _sensors.updatePower();
+        const PowerSample * pwr = _bus.power.latest();
+        if (pwr == NULL || !planner.lowVoltage)
+            return false;
+
+        // Back on USB power or the battery recovered
+        MilliVolts v = pwr->voltage[RAIL_SYS];
+        return v < MilliVolts(6000) || v >= MilliVolts(cfg.getInt(LOWVOLTAGE) + LOWVOLTAGE_HYSTERESIS);
+    }
+
+    // Planned battery refresh while asleep, all packs in one go
+    void sleepBattery() {
+        _battery.pollAll(cfg.getInt(BATTPEC) == 1);
+        checkBatteryAlarms();
+        _energy.blendBattery(cfg.getInt(BATTCAPACITY), cfg.getInt(ENERGYBLEND));
+    }
+
+    // Pick up after a sleep without a full begin(). Only the flash and the
+    // watchdog were shut down. The averages and trends still hold readings
+    // from before the sleep and the bus holds the sleep samples, stamped with
+    // the held millis(), so both are dropped and the checks run as soon as
+    // fresh samples come in.
+    void warmResume(uint32_t now) {
+        _flash.wakeup();
+        configWatchdog();
+
+        voltageSub.skip();
+        envSub.skip();
+        avgVoltage.clear();
+        avgTemp.clear();
+        avgHum.clear();
+        tempTrend.clear();
+        humTrend.clear();
+        voltageTimer = now - cfg.getInt(CHECKINTERVAL) - 1;
+        envTimer = now - cfg.getInt(CHECKINTERVAL) - 1;
+
+        char output[64];
+        sprintf(output, "Awake after %lu s, woken by %s", (unsigned long)(now - planner.enteredAt),
+            SleepPlanner::wakeName(planner.lastWake));
+        printAllPorts(output);
+        journal(EVENT_WAKE, planner.lastWake, now - planner.enteredAt);
     }
 
     bool cameraIsOn() {
         return cameraOn;
     }
 
+    // Strobe triggers are held until the Orin is ready to capture the frames
+    bool strobesAllowed() {
+        return cameraOn && jetson.isReady();
+    }
+
     void sendShutdown() {
-        if (cameraOn) {
-            DEBUGPORT.println("Sending to Jetson: sudo shutdown -h now");
-            JETSONPORT.println("./shutdown_system.sh\n");
-            pendingPowerOff = true;
-            pendingPowerOffTimer = _zerortc.getEpoch();
+        powerCyclePending = false;
+        if (pendingPowerOff) {
+            // Already waiting on the halt, restarting would hold off the
+            // MAXSHUTDOWNTIME fallback
+            DEBUGPORT.println("Shutdown already sent, waiting on the Jetson");
+        }
+        else if (cameraOn) {
+            // Ask the protocol agent if it is running, the shell otherwise
+            bool agent = jetson.isAlive(_zerortc.getEpoch());
+            journal(EVENT_SHUTDOWN, agent, 0);
+            if (agent) {
+                DEBUGPORT.println("Sending shutdown request to Jetson");
+                FrameWriter w(OP_EVENT, 0);
+                w.put8(EVT_SHUTDOWN);
+                w.send(TX_JETSON_PORT, TX_ALERT);
+            }
+            else {
+                DEBUGPORT.println("Sending to Jetson: sudo shutdown -h now");
+                _tx.printAll("./shutdown_system.sh\n", TX_ALERT, TX_JETSON);
+            }
+            beginPowerOff();
         }
         else {
             DEBUGPORT.println("Camera not powered on, not sending shutdown command");
         }
     }
 
+    // Wait for the Orin to halt, the rails are cut by checkCameraPower()
+    void beginPowerOff() {
+        pendingPowerOff = true;
+        pendingPowerOffTimer = _zerortc.getEpoch();
+        setPowerState(POWER_SHUTDOWN);
+    }
+
+    // Estimated minutes of battery runtime left, -1 if unknown
+    long runtimeRemaining() {
+        return _energy.runtimeMinutes();
+    }
+
     void configureFlashDurations() {
         // Set global delays for ISRs
         trigWidth = cfg.getInt(TRIGWIDTH);
@@ -664,89 +1765,58 @@ class SystemControl
         }
     }
 
-    void batteryTest(uint8_t address) 
-    {
-
-        //uint8_t address = 0x0A; // 0x14, but Wire i2c adressing uses the high 7 bits so shift right
-        uint8_t reg = 0x01; // BatterySystemInfo() register
-        uint8_t numBtyes = 2;
-
-        DEBUGPORT.println("Getting status from Batt1...");
-
-        Wire.beginTransmission(address);
-        Wire.write(byte(reg)); // sets register pointer
-        Wire.endTransmission(false); // repeated start
-
-        Wire.requestFrom(address, numBtyes); // request 2 bytes from slave device #112
-
-        int reading = 0;
-        if (Wire.available() >= numBtyes)
-        {
-            reading = Wire.read(); // receive low byte
-            reading |= Wire.read() << 8; // receive high byte
-            printHex(reading, 4);
-        }
-        else // nothing was received
-        {
-            DEBUGPORT.println("Nothing Received");
+    // Config time check of the strobe settings, called whenever one of them
+    // changes. FRAMERATE is clamped to what the duty and power limits allow.
+    void applyStrobeBudget() {
+        configureFlashDurations();
+        int rate = cfg.getInt(FRAMERATE);
+        int limit = StrobeBudget::limitFrameRate(rate, lowMagStrobeDuration, highMagStrobeDuration,
+            CentiPercent(cfg.getInt(STROBEMAXDUTY)), cfg.getInt(STROBEPOWER), cfg.getInt(STROBEBUDGET));
+        if (limit < rate) {
+            char output[80];
+            sprintf(output, "FRAMERATE %d Hz is over the strobe budget, clamped to %d Hz", rate, limit);
+            printAllPorts(output);
+            // Comes back here through the FRAMERATE callback, now within budget
+            cfg.set(FRAMERATE, limit);
         }
+        frameRate = limit;
     }
 
-    int readBatterySOC(uint8_t bat, uint8_t cont_address, uint8_t batt_address) {
-
-        uint8_t reg = 0x0d; // BatterySystemInfo() register
-        uint8_t numBytes = 2;
-
-        // Select battery from controller
-        Wire.beginTransmission(cont_address);
-        Wire.write(byte(0x01)); // sets register pointer
-        Wire.write(byte(0)); // sets register pointer
-        Wire.write(bat); // sets register pointer
-        Wire.endTransmission(true); // repeated start
-
-        // Start a new transmission
-        Wire.beginTransmission(batt_address);
-        Wire.write(byte(reg)); // sets register pointer
-        Wire.endTransmission(false); // repeated start
-
-        Wire.requestFrom(batt_address, numBytes); // request 2 bytes from slave device #112
-
-        int reading = 0;
-        if (Wire.available() >= numBytes)
-        {
-            reading = Wire.read(); // receive low byte
-            reading |= Wire.read() << 8; // receive high byte
-            //printHex(reading, 4);
-        }
-        else // nothing was received
-        {
-            DEBUGPORT.println("Nothing Received when querying battery");
-            reading = -1;
-        }
-    
-        return reading;
-
+    void printStrobes(Stream * ui) {
+        char output[96];
+        char lowDuty[16];
+        char highDuty[16];
+        StrobeBudget::duty(lowMagStrobeDuration, frameRate).format(lowDuty, 2);
+        StrobeBudget::duty(highMagStrobeDuration, frameRate).format(highDuty, 2);
+        ui->println();
+        sprintf(output, "Frame rate: %d Hz, strobes %s", frameRate, strobesAllowed() ? "allowed" : "held");
+        ui->println(output);
+        sprintf(output, "Flash (us): low mag %d, high mag %d, duty %s %% / %s %%, limit %d.%02d %%",
+            lowMagStrobeDuration, highMagStrobeDuration, lowDuty, highDuty,
+            cfg.getInt(STROBEMAXDUTY) / 100, cfg.getInt(STROBEMAXDUTY) % 100);
+        ui->println(output);
+        sprintf(output, "Strobe power (mW): estimated %ld, budget %d",
+            (long)StrobeBudget::estimate(lowMagStrobeDuration, highMagStrobeDuration, frameRate, cfg.getInt(STROBEPOWER)).raw,
+            cfg.getInt(STROBEBUDGET));
+        ui->println(output);
     }
 
-    void estimateBatteryCharge() {
-        float tempBatteryCharge = 0.0;
-        float readResult[4];
-        
-        readResult[0] = readBatterySOC(0x10, 0x0A, 0x0B);
-        readResult[1] = readBatterySOC(0x20, 0x0A, 0x0B);
-        readResult[2] = readBatterySOC(0x10, 0x0E, 0x0F);
-        readResult[3] = readBatterySOC(0x20, 0x0E, 0x0F);
+    // Run one step of the battery poller and report new alarms
+    void checkBattery() {
+        _battery.update(cfg.getInt(BATTPOLLINT), cfg.getInt(BATTPEC) == 1);
+        checkBatteryAlarms();
+    }
 
-        for (int i = 0; i < 4; i ++) {
-            if (readResult[i] >= 0) {
-                tempBatteryCharge += readResult[i];
-            }
-            else {
-                return;
+    void checkBatteryAlarms() {
+        uint16_t alarms = _battery.alarms();
+        if (alarms != lastBatteryAlarms) {
+            if (alarms != 0) {
+                char output[64];
+                sprintf(output, "Battery alarm bits changed to 0x%04X", alarms);
+                printAllPorts(output);
             }
+            lastBatteryAlarms = alarms;
         }
-
-        batteryCharge = tempBatteryCharge / 4.0;
     }
 
     void printHex(int num, int precision)
@@ -0,0 +1,225 @@
+#ifndef _TASKSUPERVISOR
+
+#define _TASKSUPERVISOR
+
+#include <Arduino.h>
+#include <WDTZero.h>
+
+#define SUPERVISOR_MAGIC 0x54534B31 // "TSK1"
+
+// Hardware watchdog period in ms, WDT_HARDCYCLE8S or WDT_SOFTCYCLE8S
+#define SUPERVISOR_WDT_PERIOD 8000
+
+// Longest sleep between feeds while the watchdog runs, well inside its 8 s
+#define SUPERVISOR_MAX_SLEEP 2000
+
+// Global watchdog timer with 8 second hardware timeout
+WDTZero _watchdog;
+
+// Periodic tasks of the main loop, must match the order of the TASKS table
+enum TaskId {
+    TASK_SENSORS,
+    TASK_TELEMETRY,
+    TASK_CLI,
+    TASK_SAFETY,
+    TASK_BATTERY,
+    NUM_TASKS
+};
+
+struct TaskConfig {
+    const char * name;
+    uint16_t deadline; // ms between check ins on top of the loop period
+};
+
+constexpr TaskConfig TASKS[] = {
+    // name,       deadline
+    { "sensors",   2000 },
+    { "telemetry", 2000 },
+    { "cli",       5000 },
+    { "safety",    2000 },
+    { "battery",   2000 },
+};
+
+static_assert(sizeof(TASKS) / sizeof(TASKS[0]) == NUM_TASKS, "TaskId does not match the TASKS table");
+
+// Task state kept in RAM that the startup code does not clear, so it tells
+// after a watchdog reset which task was running and for how long
+struct SupervisorRecord {
+    uint32_t magic;
+    int32_t current; // task running, -1 between tasks
+    uint32_t since; // millis() the current task started
+    uint32_t lastFeed; // millis() of the last watchdog feed
+    uint16_t overruns[NUM_TASKS];
+    uint32_t worst[NUM_TASKS]; // longest ms between check ins
+};
+
+SupervisorRecord _supervisorRecord __attribute__((section(".noinit")));
+
+// Feeds the hardware watchdog only while every task checks in on time. Each
+// task is bracketed with start() and checkIn(). A prompt that holds the loop
+// waiting on the user holds the other tasks' deadlines and keeps checking in
+// with kick() while it waits.
+class TaskSupervisor {
+
+    private:
+    uint32_t lastCheckIn[NUM_TASKS];
+    bool late[NUM_TASKS]; // overrun already counted
+    uint32_t loopPeriod;
+    int holder; // task holding the loop in a prompt, -1 if none
+    bool enabled;
+
+    public:
+    SupervisorRecord previous; // record left by the last run
+    bool havePrevious;
+
+    TaskSupervisor() {
+        havePrevious = _supervisorRecord.magic == SUPERVISOR_MAGIC;
+        if (havePrevious)
+            previous = _supervisorRecord;
+        memset(&_supervisorRecord, 0, sizeof(_supervisorRecord));
+        _supervisorRecord.magic = SUPERVISOR_MAGIC;
+        _supervisorRecord.current = -1;
+        for (int i = 0; i < NUM_TASKS; i++) {
+            lastCheckIn[i] = 0;
+            late[i] = false;
+        }
+        loopPeriod = 0;
+        holder = -1;
+        enabled = false;
+    }
+
+    // Start the hardware watchdog if enable is set, the deadlines count from
+    // here. onTimeout runs from the early warning interrupt just before the
+    // watchdog resets the chip.
+    void begin(bool enable, void (*onTimeout)(void) = NULL) {
+        release();
+        enabled = enable;
+        if (!enabled)
+            return;
+        if (onTimeout != NULL) {
+            _watchdog.attachShutdown(onTimeout);
+            _watchdog.setup(WDT_SOFTCYCLE8S);
+        }
+        else {
+            _watchdog.setup(WDT_HARDCYCLE8S);
+        }
+    }
+
+    // Stop the hardware watchdog for a sleep, begin() starts it again
+    void suspend() {
+        if (enabled)
+            _watchdog.setup(WDT_OFF);
+    }
+
+    bool isEnabled() {
+        return enabled;
+    }
+
+    // Time the loop waits between passes, added to every deadline
+    void setLoopPeriod(uint32_t ms) {
+        loopPeriod = ms;
+    }
+
+    void start(TaskId t) {
+        _supervisorRecord.current = t;
+        _supervisorRecord.since = millis();
+    }
+
+    void checkIn(TaskId t) {
+        uint32_t now = millis();
+        uint32_t gap = now - lastCheckIn[t];
+        if (gap > _supervisorRecord.worst[t])
+            _supervisorRecord.worst[t] = gap;
+        lastCheckIn[t] = now;
+        late[t] = false;
+        _supervisorRecord.current = -1;
+    }
+
+    // A prompt of task t holds the loop, only t is checked until release()
+    void hold(TaskId t) {
+        holder = t;
+    }
+
+    bool isHeld() {
+        return holder >= 0;
+    }
+
+    // The other tasks were not due while the loop was held
+    void release() {
+        uint32_t now = millis();
+        for (int i = 0; i < NUM_TASKS; i++)
+            lastCheckIn[i] = now;
+        holder = -1;
+    }
+
+    // Called by prompts while they wait on input
+    void kick() {
+        if (holder >= 0)
+            checkIn((TaskId)holder);
+        feed();
+    }
+
+    // True if every task checked in within its deadline, counts overruns
+    bool healthy() {
+        uint32_t now = millis();
+        bool ok = true;
+        for (int i = 0; i < NUM_TASKS; i++) {
+            if (holder >= 0 && i != holder)
+                continue;
+            if (now - lastCheckIn[i] > TASKS[i].deadline + loopPeriod) {
+                if (!late[i]) {
+                    late[i] = true;
+                    _supervisorRecord.overruns[i]++;
+                }
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    void feed() {
+        if (enabled && healthy()) {
+            _watchdog.clear();
+            _supervisorRecord.lastFeed = millis();
+        }
+    }
+
+    // Ms to sleep at most before the next feed
+    uint32_t maxSleep(uint32_t ms) {
+        return enabled && ms > SUPERVISOR_MAX_SLEEP ? SUPERVISOR_MAX_SLEEP : ms;
+    }
+
+    // One line on the task that was running when the last run ended, false
+    // if it ended between tasks or there is no record
+    bool describePrevious(char * output) {
+        if (!havePrevious || previous.current < 0 || previous.current >= NUM_TASKS)
+            return false;
+        // The watchdog fires its period after the last feed
+        long stalled = (long)(previous.lastFeed - previous.since) + SUPERVISOR_WDT_PERIOD;
+        sprintf(output, "Last run ended in task %s, about %ld ms after it started", TASKS[previous.current].name, stalled);
+        return true;
+    }
+
+    void print(Stream * ui) {
+        char output[128];
+        uint32_t now = millis();
+        ui->println();
+        ui->print("Watchdog: ");
+        ui->println(enabled ? "on" : "off");
+        ui->println("Task        Deadline  Age (ms)  Worst (ms)  Overruns  Last run overruns/worst");
+        for (int i = 0; i < NUM_TASKS; i++) {
+            sprintf(output, "%-10s  %8lu  %8lu  %10lu  %8u  %5u/%lu", TASKS[i].name,
+                (unsigned long)(TASKS[i].deadline + loopPeriod), (unsigned long)(now - lastCheckIn[i]),
+                (unsigned long)_supervisorRecord.worst[i], _supervisorRecord.overruns[i],
+                havePrevious ? previous.overruns[i] : 0, havePrevious ? (unsigned long)previous.worst[i] : 0UL);
+            ui->println(output);
+        }
+        if (describePrevious(output))
+            ui->println(output);
+    }
+};
+
+// Global task supervisor
+TaskSupervisor _supervisor;
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef _TELEMETRYPOLICY
+
+#define _TELEMETRYPOLICY
+
+#include <Arduino.h>
+#include "Config.h"
+#include "DataBus.h"
+#include "FixedPoint.h"
+#include "PowerRails.h"
+#include "SystemConfig.h"
+
+// What the system is doing, picks the log line interval. Must match the
+// order of the TELEMETRY_STATES table.
+enum TelemetryState {
+    TELEM_IDLE, // camera off
+    TELEM_BOOTING, // camera on, Jetson not ready yet
+    TELEM_IMAGING,
+    TELEM_SHUTDOWN, // waiting on the Jetson to halt
+    TELEM_FAULT, // low voltage, environment limit or trend
+    TELEM_STATES
+};
+
+struct TelemetryStateInfo {
+    const char * name;
+    const char * intervalParam; // config param with the ms between lines
+};
+
+constexpr TelemetryStateInfo TELEMETRY_STATES[] = {
+    // name,       interval param
+    { "idle",      LOGIDLE },
+    { "booting",   LOGBOOT },
+    { "imaging",   LOGIMAGING },
+    { "shutdown",  LOGSHUTDOWN },
+    { "fault",     LOGFAULT },
+};
+
+static_assert(sizeof(TELEMETRY_STATES) / sizeof(TELEMETRY_STATES[0]) == TELEM_STATES, "TelemetryState does not match the TELEMETRY_STATES table");
+
+// Change a channel has to make since the last line to send a new one, a
+// deadband of 0 sends every interval
+struct TelemetryDeadbands {
+    CentiDegrees temperature;
+    Pascals pressure;
+    CentiPercent humidity;
+    MilliVolts voltage; // any rail
+    MilliWatts power; // any rail
+};
+
+// Decides which passes of the main loop send a $BUMCTRL line. A line goes
+// out when the state changes, or once the interval of the state has passed
+// and a channel moved past its deadband or the heartbeat is due. The
+// heartbeat keeps a minimum rate while nothing changes. The counts compare
+// the lines sent with one line per pass.
+class TelemetryPolicy {
+
+    private:
+    TelemetryState state;
+    bool started;
+    uint32_t lastSent; // millis()
+    EnvSample lastEnv;
+    RailReadings<NUM_RAILS> lastPower;
+
+    static bool moved(int32_t a, int32_t b, int32_t band) {
+        return band <= 0 || abs(a - b) >= band;
+    }
+
+    bool changed(const EnvSample * env, const PowerSample * pwr, const TelemetryDeadbands & bands) {
+        if (moved(env->temperature.raw, lastEnv.temperature.raw, bands.temperature.raw)
+            || moved(env->pressure.raw, lastEnv.pressure.raw, bands.pressure.raw)
+            || moved(env->humidity.raw, lastEnv.humidity.raw, bands.humidity.raw))
+            return true;
+        for (int i = 0; i < NUM_RAILS; i++) {
+            if (moved(pwr->voltage[i].raw, lastPower.voltage[i].raw, bands.voltage.raw)
+                || moved(pwr->power[i].raw, lastPower.power[i].raw, bands.power.raw))
+                return true;
+        }
+        return false;
+    }
+
+    public:
+    uint32_t sent[TELEM_STATES];
+    uint32_t held[TELEM_STATES]; // passes without a line
+
+    TelemetryPolicy() {
+        state = TELEM_IDLE;
+        started = false;
+        lastSent = 0;
+        clear();
+    }
+
+    // True if this pass should send a line, call markSent() once it is out.
+    // heartbeatMs of 0 leaves the rate to the deadbands alone.
+    bool due(TelemetryState s, uint32_t now, uint32_t intervalMs, uint32_t heartbeatMs,
+        const EnvSample * env, const PowerSample * pwr, const TelemetryDeadbands & bands) {
+        if (!started || s != state) {
+            state = s;
+            return true;
+        }
+        uint32_t age = now - lastSent;
+        if (age >= intervalMs && ((heartbeatMs > 0 && age >= heartbeatMs) || changed(env, pwr, bands)))
+            return true;
+        held[state]++;
+        return false;
+    }
+
+    void markSent(uint32_t now, const EnvSample * env, const PowerSample * pwr) {
+        started = true;
+        lastSent = now;
+        lastEnv = *env;
+        lastPower = *pwr;
+        sent[state]++;
+    }
+
+    void clear() {
+        for (int i = 0; i < TELEM_STATES; i++) {
+            sent[i] = 0;
+            held[i] = 0;
+        }
+    }
+
+    void print(Stream * ui, SystemConfig & cfg) {
+        char output[96];
+        ui->println();
+        sprintf(output, "State: %s, last line %lu ms ago, heartbeat %d s", TELEMETRY_STATES[state].name,
+            started ? (unsigned long)(millis() - lastSent) : 0UL, cfg.getInt(LOGHEARTBEAT));
+        ui->println(output);
+        ui->println("State     Interval (ms)  Lines  Held  Sent (%)");
+        for (int i = 0; i < TELEM_STATES; i++) {
+            uint32_t passes = sent[i] + held[i];
+            sprintf(output, "%-8s  %13d  %5lu  %4lu  %8lu", TELEMETRY_STATES[i].name,
+                cfg.getInt(TELEMETRY_STATES[i].intervalParam), (unsigned long)sent[i], (unsigned long)held[i],
+                passes > 0 ? (unsigned long)(sent[i] * 100 / passes) : 100UL);
+            ui->println(output);
+        }
+    }
+};
+
+#endif
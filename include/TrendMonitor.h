@@ -0,0 +1,153 @@
+#ifndef _TRENDMONITOR
+
+#define _TRENDMONITOR
+
+#include <Arduino.h>
+#include <math.h>
+
+// Don't trust a trend fitted to less than this many effective samples
+#define TREND_MIN_WEIGHT 8.0
+
+// A slope counts as a trend once it is this many standard errors above zero
+#define TREND_MIN_TSTAT 2.0
+
+// Graded state of a monitored value, in increasing severity
+enum TrendLevel {
+    TREND_OK,
+    TREND_WARN, // will reach the limit within the warning time
+    TREND_SHUTDOWN, // will reach the limit within the shutdown time
+    TREND_LIMIT // at or over the limit
+};
+
+// Online linear regression of a value against time with exponential forgetting,
+// so old samples fade out over about window seconds. The weighted sums are kept
+// relative to the newest sample in both time and value and shifted on every
+// update, which keeps them small enough for float and makes the intercept the
+// current level. Constant memory and constant time per sample.
+class TrendMonitor {
+
+    private:
+    float window; // forgetting time constant in s
+    float s0, st, stt, sy, sty, syy;
+    float origin; // value the y sums are relative to
+    uint32_t lastTime;
+    bool primed;
+
+    float slopeValue;
+    float levelValue;
+    float slopeError;
+
+    void fit() {
+        float d = s0 * stt - st * st;
+        if (s0 < TREND_MIN_WEIGHT || d <= 0) {
+            slopeValue = 0;
+            slopeError = 0;
+            levelValue = origin + (s0 > 0 ? sy / s0 : 0);
+            return;
+        }
+        slopeValue = (s0 * sty - st * sy) / d;
+        float intercept = (sy - slopeValue * st) / s0;
+        levelValue = origin + intercept;
+
+        // Weighted residual variance and the standard error of the slope
+        float rss = syy - intercept * sy - slopeValue * sty;
+        if (rss < 0)
+            rss = 0;
+        float sxx = stt - st * st / s0;
+        slopeError = sxx > 0 ? sqrt(rss / s0 / sxx) : 0;
+    }
+
+    public:
+
+    TrendMonitor(float window=1800) {
+        this->window = window;
+        clear();
+    }
+
+    void setWindow(float window) {
+        this->window = window;
+    }
+
+    // Add a sample taken at millis() time ms
+    void update(uint32_t ms, float y) {
+        if (primed) {
+            float dt = (ms - lastTime) / 1000.0;
+
+            // Move the time origin to the new sample
+            stt = stt - 2 * dt * st + dt * dt * s0;
+            st = st - dt * s0;
+            sty = sty - dt * sy;
+
+            // Fade the old samples, tau / (tau + dt) is close to exp(-dt / tau)
+            float w = window / (window + dt);
+            s0 *= w;
+            st *= w;
+            stt *= w;
+            sy *= w;
+            sty *= w;
+            syy *= w;
+
+            // Move the value origin to the new sample
+            float c = y - origin;
+            syy = syy - 2 * c * sy + c * c * s0;
+            sy = sy - c * s0;
+            sty = sty - c * st;
+        }
+        origin = y;
+        s0 += 1;
+        lastTime = ms;
+        primed = true;
+        fit();
+    }
+
+    // Fitted value at the newest sample
+    float level() {
+        return levelValue;
+    }
+
+    // Rate of change in units per s, 0 until there is enough data
+    float slope() {
+        return slopeValue;
+    }
+
+    // True if the value is rising by more than the noise would explain
+    bool rising() {
+        return slopeValue > 0 && slopeValue > TREND_MIN_TSTAT * slopeError;
+    }
+
+    // Seconds until the fitted line reaches limit, 0 if already there and
+    // -1 if the value is not rising towards it
+    float timeToLimit(float limit) {
+        if (levelValue >= limit)
+            return 0;
+        if (!rising())
+            return -1;
+        return (limit - levelValue) / slopeValue;
+    }
+
+    // Grade the trend against a limit with warning and shutdown horizons in s
+    TrendLevel check(float limit, float warnTime, float shutdownTime) {
+        float t = timeToLimit(limit);
+        if (t == 0)
+            return TREND_LIMIT;
+        if (t < 0)
+            return TREND_OK;
+        if (t <= shutdownTime)
+            return TREND_SHUTDOWN;
+        if (t <= warnTime)
+            return TREND_WARN;
+        return TREND_OK;
+    }
+
+    void clear() {
+        s0 = st = stt = sy = sty = syy = 0;
+        origin = 0;
+        lastTime = 0;
+        primed = false;
+        slopeValue = 0;
+        levelValue = 0;
+        slopeError = 0;
+    }
+};
+
+#endif
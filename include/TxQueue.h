@@ -0,0 +1,336 @@
+#ifndef _TXQUEUE
+
+#define _TXQUEUE
+
+#include <Arduino.h>
+#include "Config.h"
+#include "PortBridge.h"
+
+// Queue sizes in bytes per port
+#define TXQ_ALERT_SIZE 256
+#define TXQ_TELEMETRY_SIZE 768
+
+// Longest wait in ms for a port to take the rest of a started record
+#define TXQ_FINISH_TIMEOUT 250
+
+// Ports written by printAll(), text goes to the user ports only
+#define TX_DEBUG 0x01
+#define TX_UI1 0x02
+#define TX_UI2 0x04
+#define TX_JETSON 0x08
+#define TX_ALL (TX_DEBUG | TX_UI1 | TX_UI2)
+
+#define NUM_TX_PORTS 4
+
+// Index of JETSONPORT in TxPorts
+#define TX_JETSON_PORT 3
+
+enum TxPriority {
+    TX_ALERT, // safety and status messages, sent first and never dropped for telemetry
+    TX_TELEMETRY // routine log lines, oldest dropped first when a port falls behind
+};
+
+// Byte ring of records (text lines or protocol frames), each stored behind a
+// 16 bit length so records are sent and dropped whole
+template <int SIZE>
+class TxRing {
+
+    private:
+    char buf[SIZE];
+    uint16_t head; // next byte written
+    uint16_t tail; // next byte sent
+    uint16_t count;
+
+    void putBytes(const void * data, int n) {
+        const char * s = (const char *)data;
+        for (int i = 0; i < n; i++) {
+            buf[head] = s[i];
+            head = (head + 1) % SIZE;
+        }
+        count += n;
+    }
+
+    public:
+
+    TxRing() {
+        clear();
+    }
+
+    int used() {
+        return count;
+    }
+
+    int space() {
+        return SIZE - count;
+    }
+
+    // Add a record made of two parts, returns false if it does not fit
+    bool put(const void * a, int na, const void * b, int nb) {
+        if (2 + na + nb > space())
+            return false;
+        uint16_t len = na + nb;
+        putBytes(&len, 2);
+        putBytes(a, na);
+        putBytes(b, nb);
+        return true;
+    }
+
+    // Start sending the record at the tail, returns its length
+    int begin() {
+        uint16_t len;
+        char * p = (char *)&len;
+        p[0] = buf[tail];
+        consume(1);
+        p[1] = buf[tail];
+        consume(1);
+        return len;
+    }
+
+    // Bytes of the current record that can be sent in one piece
+    int peek(const char ** p, int left) {
+        *p = &buf[tail];
+        int n = SIZE - tail;
+        return n < left ? n : left;
+    }
+
+    void consume(int n) {
+        tail = (tail + n) % SIZE;
+        count -= n;
+    }
+
+    // Remove the next whole record
+    void drop() {
+        consume(begin());
+    }
+
+    void clear() {
+        head = 0;
+        tail = 0;
+        count = 0;
+    }
+};
+
+// Two priority transmit queue for one port. drain() only hands over as much as
+// the port reports room for, the SERCOM DRE interrupt sends it from there. The
+// USB port always reports room and waits in write() for the previous packet,
+// so it can still hold up the loop for a while. Records are never
+// interleaved, one that was started is finished before switching queues.
+// The queues belong to the main loop and are not locked, interrupt handlers
+// report through EventJournal and RailAlertQueue instead. A push from
+// interrupt context is dropped.
+class TxQueue {
+
+    private:
+    enum Current { NONE, ALERTS, TELEMETRY };
+
+    TxRing<TXQ_ALERT_SIZE> alerts;
+    TxRing<TXQ_TELEMETRY_SIZE> telemetry;
+    Current current; // queue of a partly sent record
+    int left; // bytes of the current record still to send
+    bool needLineEnd; // the rest of a partly sent record was dropped
+
+    // Send up to room bytes of the current record, returns the bytes sent
+    template <class R>
+    int send(R & ring, Print * out, int room) {
+        const char * p;
+        int n = ring.peek(&p, left);
+        if (n > room)
+            n = room;
+        out->write((const uint8_t *)p, n);
+        ring.consume(n);
+        left -= n;
+        if (left == 0)
+            current = NONE;
+        return n;
+    }
+
+    bool push(const void * a, int na, const void * b, int nb, TxPriority priority) {
+        if (__get_IPSR() != 0) {
+            if (priority == TX_ALERT)
+                droppedAlerts++;
+            else
+                droppedLines++;
+            return false;
+        }
+
+        if (priority == TX_ALERT) {
+            if (!alerts.put(a, na, b, nb)) {
+                droppedAlerts++;
+                return false;
+            }
+            return true;
+        }
+
+        if (2 + na + nb > TXQ_TELEMETRY_SIZE) {
+            droppedLines++;
+            return false;
+        }
+        while (telemetry.space() < 2 + na + nb) {
+            if (current == TELEMETRY) {
+                // Cut the record being sent short, the host sees a bad line
+                telemetry.consume(left);
+                left = 0;
+                current = NONE;
+                needLineEnd = true;
+            }
+            else {
+                telemetry.drop();
+            }
+            droppedLines++;
+        }
+        return telemetry.put(a, na, b, nb);
+    }
+
+    // One step of drain(), false once the port is full or there is nothing
+    // left to send. At most room bytes are written.
+    bool step(Print * out, int room) {
+        if (room <= 0)
+            return false;
+        if (needLineEnd) {
+            if (room < 2)
+                return false;
+            out->write((const uint8_t *)"\r\n", 2);
+            needLineEnd = false;
+        }
+        else if (current == ALERTS) {
+            send(alerts, out, room);
+        }
+        else if (current == TELEMETRY) {
+            send(telemetry, out, room);
+        }
+        else if (alerts.used() > 0) {
+            current = ALERTS;
+            left = alerts.begin();
+        }
+        else if (telemetry.used() > 0) {
+            current = TELEMETRY;
+            left = telemetry.begin();
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    public:
+    unsigned long droppedLines;
+    unsigned long droppedAlerts;
+
+    TxQueue() {
+        current = NONE;
+        left = 0;
+        needLineEnd = false;
+        droppedLines = 0;
+        droppedAlerts = 0;
+    }
+
+    // Queue a line, the line end is added. Returns false if it was dropped.
+    bool push(const char * line, TxPriority priority) {
+        return push(line, strlen(line), "\r\n", 2, priority);
+    }
+
+    // Queue an encoded protocol frame as is
+    bool pushFrame(const uint8_t * frame, int n, TxPriority priority) {
+        return push(frame, n, NULL, 0, priority);
+    }
+
+    // Hand queued bytes to the port, as many as it has room for
+    void drain(Print * out) {
+        while (step(out, out->availableForWrite()))
+            ;
+    }
+
+    // Send the rest of a partly sent record, waiting on the port, so text
+    // written to the port directly does not land inside it. A port that takes
+    // nothing for TXQ_FINISH_TIMEOUT ms is given up on.
+    void finish(Print * out) {
+        unsigned long start = millis();
+        while ((needLineEnd || current != NONE) && millis() - start < TXQ_FINISH_TIMEOUT) {
+            if (step(out, out->availableForWrite()))
+                start = millis();
+        }
+    }
+
+    // Bytes waiting to be sent
+    int pending() {
+        return alerts.used() + telemetry.used();
+    }
+};
+
+// Queues of all output ports
+class TxPorts {
+
+    private:
+    TxQueue queues[NUM_TX_PORTS];
+
+    public:
+
+    Stream * port(int i) {
+        switch (i) {
+            case 0:
+                return &DEBUGPORT;
+            case 1:
+                return &UI1;
+            case 2:
+                return &UI2;
+            default:
+                return &JETSONPORT;
+        }
+    }
+
+    // Queue a line on every port in mask, ports in a PORTPASS bridge are skipped
+    void printAll(const char * line, TxPriority priority, uint8_t mask = TX_ALL) {
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            if ((mask & (1 << i)) && !_bridge.isBridged(port(i)))
+                queues[i].push(line, priority);
+        }
+    }
+
+    // Drain all ports, call from the main loop as often as possible
+    void service() {
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            if (!_bridge.isBridged(port(i)))
+                queues[i].drain(port(i));
+        }
+    }
+
+    // Finish the record being sent on port i before writing to it directly
+    void finish(int i) {
+        if (!_bridge.isBridged(port(i)))
+            queues[i].finish(port(i));
+    }
+
+    // Drain for up to timeout ms, for output that has to go out before sleeping.
+    // The serial ports are then flushed so the last byte is out of the shift
+    // register before standby stops their clocks.
+    void flush(unsigned long timeout) {
+        unsigned long start = millis();
+        bool pending = true;
+        while (pending && millis() - start < timeout) {
+            service();
+            pending = false;
+            for (int i = 0; i < NUM_TX_PORTS; i++) {
+                if (!_bridge.isBridged(port(i)) && queues[i].pending() > 0)
+                    pending = true;
+            }
+        }
+        for (int i = 0; i < NUM_TX_PORTS; i++) {
+            if (port(i) != &DEBUGPORT && !_bridge.isBridged(port(i)))
+                port(i)->flush();
+        }
+    }
+
+    TxQueue * queue(int i) {
+        return &queues[i];
+    }
+
+    const char * name(int i) {
+        static const char * names[NUM_TX_PORTS] = { "DEBUG", "UI1", "UI2", "JETSON" };
+        return names[i];
+    }
+};
+
+// Global output queues
+TxPorts _tx;
+
+#endif
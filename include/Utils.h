@@ -5,6 +5,7 @@
 #define PORT_BREAK_CHAR 5
 
 #include <Arduino.h>
+#include "TaskSupervisor.h"
 
 void Blink(int DELAY_MS, byte loops)
 {
@@ -18,29 +19,13 @@ void Blink(int DELAY_MS, byte loops)
     }
 }
 
-void portpass(Stream * in, Stream * out, bool localecho = false) {
-    while (true) {
-        if (in->available()) {
-            unsigned char c = in->read();
-            if (c == PORT_BREAK_CHAR) {
-                break;
-            }
-            else{
-                out->write(c);
-            }
-        }
-        if (out->available()) {
-            in->write(out->read());
-        }
-    }
-}
-
 bool confirm(Stream * in, const char * prompt, unsigned int cmdTimeout) {
     unsigned long startTimer = millis();
     in->println();
     in->print(prompt);
 
     while (startTimer <= millis() && millis() - startTimer < cmdTimeout) {
+        _supervisor.kick();
 
         // Wait on user input
         if (in->available()) {
@@ -58,6 +43,27 @@ bool confirm(Stream * in, const char * prompt, unsigned int cmdTimeout) {
     return false;
 }
 
+// CRC-16/CCITT-FALSE over len bytes, pass the previous result as crc to chain blocks
+uint16_t crc16(const void * data, size_t len, uint16_t crc = 0xFFFF) {
+    const uint8_t * p = (const uint8_t *)data;
+    while (len--) {
+        crc ^= (uint16_t)(*p++) << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+// Append the NMEA style "*XX" checksum, the XOR of the characters after the
+// leading '$', to a line of len chars. Returns the new length.
+int appendChecksum(char * line, int len) {
+    uint8_t x = 0;
+    for (int i = 1; i < len; i++)
+        x ^= (uint8_t)line[i];
+    return len + sprintf(line + len, "*%02X", x);
+}
+
 int strncmp_ci(const char * input, const char * command, int n) {
     
     // string and command must match in length
@@ -10,20 +10,52 @@ SystemControl sys;
 
 int powerButtonCounter = 0;
 int powerButtonTimer = 0;
-int batteryCheckTimer = 0;
+
+// Button edges seen by the ISR and not yet handled by loop()
+volatile int powerButtonEdges = 0;
 
 // wrapper for turning system on
 void turnOnCamera() {
     sys.turnOnCamera();
 }
 
-// wrapper for turning system on
+// wrapper for applying rail sampling config changes
+void updateRailProfiles() {
+    sys.applyRailProfiles();
+}
+
+// wrapper for checking strobe config changes against the budget
+void updateStrobes() {
+    sys.applyStrobeBudget();
+}
+
+// wrapper for applying rail alert config changes
+void updateRailAlerts() {
+    sys.configureRailAlerts();
+}
+
+// Power button ISR, only counts the edge. The camera power sequence waits
+// on millis() and talks I2C, neither works at the priority of this interrupt,
+// so checkPowerButton() acts on the press from loop().
 void powerButtonEvent() {
+    powerButtonEdges++;
+    sys.endWait();
+}
+
+// Turn the camera on, or send the shutdown after several presses
+void checkPowerButton() {
+    noInterrupts();
+    int edges = powerButtonEdges;
+    powerButtonEdges = 0;
+    interrupts();
+    if (edges == 0)
+        return;
+
     if (!sys.cameraIsOn()) {
         sys.turnOnCamera();
     }
     else {
-        powerButtonCounter++;
+        powerButtonCounter += edges;
         if (powerButtonCounter > 3) {
             sys.sendShutdown();
             powerButtonCounter = 0;
@@ -33,48 +65,18 @@ void powerButtonEvent() {
 
 
 
-void setup() {
-
-    //Turn off strobe and camera power
-    pinMode(CAM_POWER, OUTPUT);
-    pinMode(DISP_POWER, OUTPUT);
-    pinMode(ORIN_POWER, OUTPUT);
-    pinMode(PROBE_POWER, OUTPUT);
-
-    digitalWrite(CAM_POWER, LOW);
-    digitalWrite(DISP_POWER, LOW);
-    digitalWrite(ORIN_POWER, LOW);
-    digitalWrite(PROBE_POWER, HIGH);
-
-    // Setup Sd Card Pins
-    //pinMode(SDCARD_DETECT, INPUT_PULLUP);
-
-    // Power On Pin
-    pinMode(POWER_SWITCH, INPUT_PULLUP);
-    attachInterrupt(digitalPinToInterrupt(POWER_SWITCH), powerButtonEvent, CHANGE);
-
-    // Start the debug port
-    DEBUGPORT.begin(115200);
+void addParams() {
 
-    delay(4000);
-
-    // Wait until serial port is opened
-    //while (!Serial) { delay(10); }
-    //while (!Serial0) { delay(10); }
-
-    // Startup all system processes
-    sys.begin();
-
-    // Add config parameters for system
+    // Config parameters for the system
     // IMPORTANT: add parameters at t he end of the list, otherwise you'll need to reflash the saved params in EEPROM before reading
-    sys.cfg.addParam(LOGINT, "Time in ms between log events", "ms", 0, 100000, 250);
+    sys.cfg.addParam(LOGINT, "Time in ms between sensor passes, LOGINTIDLE while idle, log lines follow the LOG* state intervals", "ms", 0, 100000, 250);
     sys.cfg.addParam(LOCALECHO, "When > 0, echo serial input", "", 0, 1, 1);
     sys.cfg.addParam(CMDTIMEOUT, "time in ms before timeout waiting for user input", "ms", 1000, 100000, 10000);
     sys.cfg.addParam(HWPORT0BAUD, "Serial Port 0 baud rate", "baud", 9600, 115200, 115200);
     sys.cfg.addParam(HWPORT1BAUD, "Serial Port 1 baud rate", "baud", 9600, 115200, 115200);
     sys.cfg.addParam(HWPORT2BAUD, "Serial Port 2 baud rate", "baud", 9600, 115200, 115200);
     sys.cfg.addParam(HWPORT3BAUD, "Serial Port 3 baud rate", "baud", 9600, 115200, 115200);
-    sys.cfg.addParam(LOWVOLTAGE, "Voltage in mV where we shut down system", "mV", 10000, 14000, 11500);
+    sys.cfg.addParam(LOWVOLTAGE, "Voltage in mV where we shut down system", "mV", 10000, 14000, 11500, false, updateRailAlerts);
     sys.cfg.addParam(STANDBY, "If voltage is low go into standby mode", "", 0, 1, 0);
     sys.cfg.addParam(CHECKHOURLY, "0 = check every minute, 1 = check every hour", "", 0, 1, 0);
     sys.cfg.addParam(STARTUPTIME, "Time in seconds before performing any system checks", "s", 0, 60, 10);
@@ -84,11 +86,115 @@ void setup() {
     sys.cfg.addParam(HUMLIMIT, "Humidity in % where controller will shutdown and power off camera","%", 0, 100, 60);
     sys.cfg.addParam(MAXSHUTDOWNTIME, "Max time in seconds we wait before cutting power to camera", "s", 15, 600, 60);
     sys.cfg.addParam(CHECKINTERVAL, "Time in seconds between check for bad operating evironment", "s", 10, 3600, 30);
+    sys.cfg.addParam(RAILFASTAVG, "INA260 averaging during power transitions, 0-7 = 1,4,16,64,128,256,512,1024", "", 0, 7, 1, false, updateRailProfiles);
+    sys.cfg.addParam(RAILFASTCONV, "INA260 conversion time during power transitions, 0-7 = 140us..8.244ms", "", 0, 7, 1, false, updateRailProfiles);
+    sys.cfg.addParam(RAILIDLEAVG, "INA260 averaging on rails that are switched off", "", 0, 7, 7, false, updateRailProfiles);
+    sys.cfg.addParam(RAILIDLECONV, "INA260 conversion time on rails that are switched off", "", 0, 7, 7, false, updateRailProfiles);
+    sys.cfg.addParam(RAILIDLEOFF, "1 = power down INA260 on rails that are switched off", "", 0, 1, 0, false, updateRailProfiles);
+    sys.cfg.addParam(RAILFASTTIME, "Time in seconds rails stay in fast sampling after power on", "s", 1, 300, 30);
+    sys.cfg.addParam(PROBEILIMIT, "Probe rail current in mA that cuts the rail, 0 = off", "mA", 0, 15000, RAILS[RAIL_PROBE].alertLimit, false, updateRailAlerts);
+    sys.cfg.addParam(ORINILIMIT, "Orin rail current in mA that cuts the rail, 0 = off", "mA", 0, 15000, RAILS[RAIL_ORIN].alertLimit, false, updateRailAlerts);
+    sys.cfg.addParam(DISPILIMIT, "Display rail current in mA that cuts the rail, 0 = off", "mA", 0, 15000, RAILS[RAIL_DISP].alertLimit, false, updateRailAlerts);
+    sys.cfg.addParam(CAMILIMIT, "Camera rail current in mA that cuts the rail, 0 = off", "mA", 0, 15000, RAILS[RAIL_CAM].alertLimit, false, updateRailAlerts);
+    sys.cfg.addParam(BATTPOLLINT, "Time in ms between smart battery SMBus transactions", "ms", 10, 10000, 250);
+    sys.cfg.addParam(BATTPEC, "1 = use SMBus packet error checking with the batteries", "", 0, 1, 0);
+    sys.cfg.addParam(ENERGYSAVEINT, "Time in minutes between energy counter checkpoints to flash", "min", 1, 1440, 15);
+    sys.cfg.addParam(BATTCAPACITY, "Total usable battery capacity in Wh", "Wh", 1, 10000, 400);
+    sys.cfg.addParam(ENERGYBLEND, "Weight in % of coulomb counting vs battery SOC in the runtime estimate", "%", 0, 100, 95);
+    sys.cfg.addParam(TRENDWINDOW, "Time in seconds over which temperature and humidity trends are fitted", "s", 60, 86400, 1800);
+    sys.cfg.addParam(TRENDWARNTIME, "Warn when a temperature or humidity trend will reach its limit within this time", "min", 1, 1440, 120);
+    sys.cfg.addParam(TRENDSHUTDOWNTIME, "Shut down when a temperature or humidity trend will reach its limit within this time", "min", 0, 1440, 20);
+    sys.cfg.addParam(HWPORT0RXBUF, "DMA receive buffer size for HWPORT0, 0 = Uart buffer, needs restart", "bytes", 0, 4096, 0);
+    sys.cfg.addParam(HWPORT1RXBUF, "DMA receive buffer size for HWPORT1, 0 = Uart buffer, needs restart", "bytes", 0, 4096, 0);
+    sys.cfg.addParam(HWPORT2RXBUF, "DMA receive buffer size for HWPORT2, 0 = Uart buffer, needs restart", "bytes", 0, 4096, 1024);
+    sys.cfg.addParam(HWPORT3RXBUF, "DMA receive buffer size for HWPORT3, 0 = Uart buffer, needs restart", "bytes", 0, 4096, 1024);
+    sys.cfg.addParam(HBTIMEOUT, "Time in seconds without a Jetson heartbeat before the camera is power cycled, 0 = off", "s", 0, 3600, 0);
+    sys.cfg.addParam(HBBOOTGRACE, "Time in seconds after camera power on for the first Jetson heartbeat", "s", 30, 1800, 300);
+    sys.cfg.addParam(HALTGRACE, "Time in seconds between the Jetson reporting halted and cutting camera power", "s", 0, 60, 3);
+    sys.cfg.addParam(IDLESTANDBY, "1 = sleep in standby between log events while the camera is off and USB is not connected", "", 0, 1, 1);
+    sys.cfg.addParam(SEQORINDELAY, "Time in ms before the Orin rail is switched on at camera power on", "ms", 0, 5000, 0);
+    sys.cfg.addParam(SEQDISPDELAY, "Time in ms between the Orin and display rails switching on", "ms", 0, 5000, 100);
+    sys.cfg.addParam(SEQCAMDELAY, "Time in ms between the display and camera rails switching on", "ms", 0, 5000, 100);
+    sys.cfg.addParam(SEQOFFDELAY, "Time in ms between rails switching off at camera power off", "ms", 0, 5000, 20);
+    sys.cfg.addParam(SEQSETTLE, "Longest time in ms a rail may take to settle after switching on", "ms", 10, 2000, 250);
+    sys.cfg.addParam(SEQSETTLEMA, "Change in mA between rail current readings that counts as settled", "mA", 1, 2000, 50);
+    sys.cfg.addParam(JETSONSETTLE, "Time in seconds of steady Orin power after boot that counts as ready, 0 = heartbeat or banner only", "s", 0, 600, 30);
+    sys.cfg.addParam(STROBEMAXDUTY, "Highest duty cycle of a strobe in 0.01 %", "0.01%", 1, 10000, 200, false, updateStrobes);
+    sys.cfg.addParam(STROBEPOWER, "Power drawn by one strobe while it fires", "mW", 0, 500000, 50000, false, updateStrobes);
+    sys.cfg.addParam(STROBEBUDGET, "Average power budget for both strobes together", "mW", 100, 100000, 10000, false, updateStrobes);
+    sys.cfg.addParam(FLASHTYPE, "0 = color flash, 1 = red flash", "", 0, 1, 0, false, updateStrobes);
+    sys.cfg.addParam(LOWMAGCOLORFLASH, "Low mag color flash duration", "us", 1, 10000, 50, false, updateStrobes);
+    sys.cfg.addParam(LOWMAGREDFLASH, "Low mag red flash duration", "us", 1, 10000, 50, false, updateStrobes);
+    sys.cfg.addParam(HIGHMAGCOLORFLASH, "High mag color flash duration", "us", 1, 10000, 50, false, updateStrobes);
+    sys.cfg.addParam(HIGHMAGREDFLASH, "High mag red flash duration", "us", 1, 10000, 50, false, updateStrobes);
+    sys.cfg.addParam(TRIGWIDTH, "Camera trigger pulse width", "us", 1, 10000, 100, false, updateStrobes);
+    sys.cfg.addParam(FRAMERATE, "Camera frame rate, clamped to the strobe budget", "Hz", 1, 60, 10, false, updateStrobes);
+    sys.cfg.addParam(LOGIDLE, "Time in ms between log lines while the camera is off", "ms", 0, 600000, 5000);
+    sys.cfg.addParam(LOGBOOT, "Time in ms between log lines while the Jetson boots", "ms", 0, 600000, 250);
+    sys.cfg.addParam(LOGIMAGING, "Time in ms between log lines while imaging", "ms", 0, 600000, 1000);
+    sys.cfg.addParam(LOGSHUTDOWN, "Time in ms between log lines while the Jetson shuts down", "ms", 0, 600000, 250);
+    sys.cfg.addParam(LOGFAULT, "Time in ms between log lines on low voltage or an environment limit or trend", "ms", 0, 600000, 250);
+    sys.cfg.addParam(LOGHEARTBEAT, "Longest time in seconds between log lines when nothing changes, 0 = no heartbeat", "s", 0, 3600, 60);
+    sys.cfg.addParam(LOGDBTEMP, "Temperature change in 0.01 C that sends a log line, 0 = every interval", "0.01C", 0, 10000, 10);
+    sys.cfg.addParam(LOGDBPRES, "Pressure change in Pa that sends a log line, 0 = every interval", "Pa", 0, 100000, 100);
+    sys.cfg.addParam(LOGDBHUM, "Humidity change in 0.01 % that sends a log line, 0 = every interval", "0.01%", 0, 10000, 50);
+    sys.cfg.addParam(LOGDBVOLT, "Rail voltage change in mV that sends a log line, 0 = every interval", "mV", 0, 10000, 50);
+    sys.cfg.addParam(LOGDBPOWER, "Rail power change in mW that sends a log line, 0 = every interval", "mW", 0, 100000, 250);
+    sys.cfg.addParam(RAILALERTPINS, "1 = arm the rail alert pin interrupts at boot, only once their routing is checked", "", 0, 1, 0);
+    sys.cfg.addParam(LOGINTIDLE, "Time in ms between sensor passes while the camera is off and IDLESTANDBY allows standby, 3000 or more to reach standby", "ms", 250, 10000, 5000);
+}
 
-    // configure watchdog timer if enabled
-    sys.configWatchdog();
+// Boot steps, run by _boot in dependency order, see BootSequencer.h
+enum BootStepId {
+    BOOT_RAILS,
+    BOOT_PARAMS,
+    BOOT_FLASH,
+    BOOT_CRASHLOG,
+    BOOT_JOURNAL,
+    BOOT_CONFIG,
+    BOOT_PORTS,
+    BOOT_CLOCK,
+    BOOT_FIRSTPOWER,
+    BOOT_PROTECTION,
+    BOOT_ENERGY,
+    BOOT_ENV,
+    BOOT_IDLE
+};
+
+// The rail monitors go first so their first averaged conversion runs while
+// the config is loaded from flash and the ports are started
+BootStatus bootRails() {
+    return sys.beginRails() ? BOOT_DONE : BOOT_FAILED;
+}
+
+BootStatus bootParams() {
+    addParams();
+    return BOOT_DONE;
+}
+
+BootStatus bootFlash() {
+    return sys.beginFlash() ? BOOT_DONE : BOOT_FAILED;
+}
+
+// Store what the last run left in RAM before anything else writes there
+BootStatus bootCrashLog() {
+    sys.beginCrashLog();
+    return BOOT_DONE;
+}
+
+BootStatus bootJournal() {
+    sys.beginJournal();
+    return BOOT_DONE;
+}
+
+// Load the last config from EEPROM
+BootStatus bootConfig() {
+    sys.readConfig();
+    return BOOT_DONE;
+}
 
-    // Start the remaining serial ports
+// Start the serial ports with the loaded baud rates
+BootStatus bootPorts() {
     HWPORT0.begin(sys.cfg.getInt(HWPORT0BAUD));
     HWPORT1.begin(sys.cfg.getInt(HWPORT1BAUD));
     HWPORT2.begin(sys.cfg.getInt(HWPORT2BAUD));
@@ -97,8 +203,103 @@ void setup() {
     // Config the SERCOM muxes AFTER starting the ports
     configSerialPins();
 
-    // Load the last config from EEPROM
-    sys.readConfig();
+    // Move the ports that have a receive buffer size onto DMA
+    sys.configureSerialRx();
+    return BOOT_DONE;
+}
+
+BootStatus bootClock() {
+    return sys.beginClock() ? BOOT_DONE : BOOT_FAILED;
+}
+
+// Wait for the first system rail conversion and publish it
+BootStatus bootFirstPower() {
+    if (!sys.powerReady())
+        return BOOT_PENDING;
+    sys.readPower();
+    return BOOT_DONE;
+}
+
+BootStatus bootProtection() {
+    // configure watchdog timer if enabled
+    sys.configWatchdog();
+
+    // Check the loaded strobe settings against the budget
+    sys.applyStrobeBudget();
+
+    // Set the rail sampling for the current power state
+    sys.applyRailProfiles();
+
+    // Program the rail alerts and start the hardware protection path
+    sys.configureRailAlerts();
+    attachRailAlerts(sys.cfg.getInt(RAILALERTPINS) == 1);
+    return BOOT_DONE;
+}
+
+BootStatus bootEnergy() {
+    sys.beginEnergy();
+    return BOOT_DONE;
+}
+
+// The BME280 start takes over 100 ms, it goes after the protection
+BootStatus bootEnv() {
+    return sys.beginEnv() ? BOOT_DONE : BOOT_FAILED;
+}
+
+// Clocks for standby with UART and EIC wake
+BootStatus bootIdle() {
+    sys.configureIdle();
+    return BOOT_DONE;
+}
+
+const BootStepConfig BOOT_STEPS[] = {
+    // name, step, needs, timeout in ms
+    { "rails", bootRails, 0, 0 },
+    { "params", bootParams, 0, 0 },
+    { "flash", bootFlash, 0, 0 },
+    { "crashlog", bootCrashLog, BOOT_NEEDS(BOOT_FLASH), 0 },
+    { "journal", bootJournal, BOOT_NEEDS(BOOT_FLASH), 0 },
+    { "config", bootConfig, BOOT_NEEDS(BOOT_PARAMS) | BOOT_NEEDS(BOOT_FLASH), 0 },
+    { "ports", bootPorts, BOOT_NEEDS(BOOT_CONFIG), 0 },
+    { "clock", bootClock, 0, 0 },
+    { "firstpower", bootFirstPower, BOOT_NEEDS(BOOT_RAILS), 1000 },
+    { "protection", bootProtection, BOOT_NEEDS(BOOT_CONFIG) | BOOT_NEEDS(BOOT_FIRSTPOWER), 0 },
+    { "energy", bootEnergy, BOOT_NEEDS(BOOT_FLASH), 0 },
+    { "env", bootEnv, BOOT_NEEDS(BOOT_PROTECTION), 0 },
+    { "idle", bootIdle, BOOT_NEEDS(BOOT_PORTS) | BOOT_NEEDS(BOOT_CLOCK), 0 },
+};
+
+void setup() {
+
+    //Turn off strobe and camera power
+    pinMode(CAM_POWER, OUTPUT);
+    pinMode(DISP_POWER, OUTPUT);
+    pinMode(ORIN_POWER, OUTPUT);
+    pinMode(PROBE_POWER, OUTPUT);
+
+    digitalWrite(CAM_POWER, LOW);
+    digitalWrite(DISP_POWER, LOW);
+    digitalWrite(ORIN_POWER, LOW);
+    digitalWrite(PROBE_POWER, HIGH);
+
+    // Setup Sd Card Pins
+    //pinMode(SDCARD_DETECT, INPUT_PULLUP);
+
+    // Power On Pin
+    pinMode(POWER_SWITCH, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(POWER_SWITCH), powerButtonEvent, CHANGE);
+
+    // Start the debug port. Nothing waits for a host to open it, the boot
+    // messages it misses are summed up by the BOOTLOG command.
+    DEBUGPORT.begin(115200);
+
+    // Bring up the peripherals, the safety checks are active once the
+    // protection step is done
+    _boot.run(BOOT_STEPS, sizeof(BOOT_STEPS) / sizeof(BOOT_STEPS[0]),
+        BOOT_NEEDS(BOOT_FIRSTPOWER) | BOOT_NEEDS(BOOT_PROTECTION));
+
+    // Say how and where the last run stopped
+    sys.reportLastRun();
 
     //sys.loadScheduler();
     
@@ -106,27 +307,45 @@ void setup() {
 
 void loop() {
 
+    // Each task checks in with the supervisor, the watchdog is only fed
+    // while all of them do
     sys.update();
+
+    _supervisor.start(TASK_SAFETY);
+    sys.checkAlerts();
+    _supervisor.checkIn(TASK_SAFETY);
+
+    _supervisor.start(TASK_CLI);
     sys.checkInput();
+    _supervisor.checkIn(TASK_CLI);
+
+    _supervisor.start(TASK_SAFETY);
+    checkPowerButton();
     sys.checkVoltage();
     sys.checkEnv();
     sys.checkCameraPower();
+    _supervisor.checkIn(TASK_SAFETY);
+
+    _supervisor.start(TASK_BATTERY);
+    sys.checkBattery();
+    _supervisor.checkIn(TASK_BATTERY);
 
     powerButtonTimer++;
-    batteryCheckTimer++;
 
     if (powerButtonTimer > 10) {
         powerButtonTimer = 0;
         powerButtonCounter = 0;
     } 
 
-    if (batteryCheckTimer > 5) {
-        sys.estimateBatteryCharge();
-    }
+    int logInt = sys.loopPeriod();
+    _supervisor.setLoopPeriod(logInt + 20);
 
-    int logInt = sys.cfg.getInt(LOGINT);
+    sys.wait(logInt);
 
-    delay(logInt);
-    Blink(10, 1);
+    // Status LED blink, sleeping rather than spinning
+    digitalWrite(LED_BUILTIN, HIGH);
+    sys.wait(10);
+    digitalWrite(LED_BUILTIN, LOW);
+    sys.wait(10);
 
 }
@@ -0,0 +1,533 @@
+#ifndef _BUMLOG
+
+#define _BUMLOG
+
+// Host side decoder for console controller output. Reads captured serial logs
+// holding $BUMCTRL text lines and control protocol frames, checks them and
+// hands the records to a Sink as text fields.
+//
+// Text lines are "$TAG,field,...*XX" where XX is the NMEA style XOR of the
+// characters between '$' and '*'. The controller sends a $BUMHDR line with the
+// column names of $BUMCTRL at startup and every LOG_HEADER_INTERVAL lines, so
+// the decoder follows field order changes between firmware versions. Logs from
+// firmware without checksums or headers are still read, with generated column
+// names.
+//
+// Protocol frames are COBS encoded between 0x00 bytes, see ControlProtocol.h in
+// the firmware. EVT_SNAPSHOT events are decoded into a second record stream.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace bumlog {
+
+// Frame constants, must match ControlProtocol.h
+const uint8_t OP_EVENT = 0x40;
+const uint8_t EVT_SNAPSHOT = 0x04;
+const int MAX_FRAME = 512;
+
+// Read only memory map of a whole file
+class MappedFile {
+
+    private:
+    const char * ptr;
+    size_t len;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    MappedFile(const MappedFile &);
+    MappedFile & operator=(const MappedFile &);
+
+    public:
+
+    MappedFile() {
+        ptr = NULL;
+        len = 0;
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+#endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const char * path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size))
+            return false;
+        len = (size_t)size.QuadPart;
+        if (len == 0)
+            return true;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL)
+            return false;
+        ptr = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        return ptr != NULL;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        len = (size_t)st.st_size;
+        if (len > 0) {
+            void * p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                len = 0;
+                return false;
+            }
+            madvise(p, len, MADV_SEQUENTIAL);
+            ptr = (const char *)p;
+        }
+        ::close(fd);
+        return true;
+#endif
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (ptr != NULL)
+            UnmapViewOfFile(ptr);
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (ptr != NULL)
+            munmap((void *)ptr, len);
+#endif
+        ptr = NULL;
+        len = 0;
+    }
+
+    const char * data() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return len;
+    }
+};
+
+// A field of a record, pointing into the input or the decoder's scratch buffer
+struct Field {
+    const char * p;
+    int n;
+};
+
+// Receives the decoded records of one stream
+class Sink {
+    public:
+    virtual ~Sink() {}
+
+    // Column names of the following rows, called again when they change
+    virtual void schema(const std::vector<std::string> & names) = 0;
+
+    // One row with as many fields as the last schema, field 0 is the time
+    virtual void row(const Field * fields, int n) = 0;
+};
+
+// XOR of the bytes, the NMEA 0183 checksum
+inline uint8_t xorChecksum(const char * p, size_t n) {
+    uint8_t x = 0;
+    for (size_t i = 0; i < n; i++)
+        x ^= (uint8_t)p[i];
+    return x;
+}
+
+inline int hexValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// CRC-16/CCITT-FALSE, same as crc16() in the firmware Utils.h
+inline uint16_t crc16(const uint8_t * p, size_t n) {
+    uint16_t crc = 0xFFFF;
+    while (n--) {
+        crc ^= (uint16_t)(*p++) << 8;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+// COBS decode n bytes to out, returns the decoded length or -1 if malformed
+inline int cobsDecode(const uint8_t * in, int n, uint8_t * out) {
+    int i = 0;
+    int o = 0;
+    while (i < n) {
+        uint8_t code = in[i++];
+        if (code == 0 || i + code - 1 > n)
+            return -1;
+        for (int j = 1; j < code; j++)
+            out[o++] = in[i++];
+        if (code != 0xFF && i < n)
+            out[o++] = 0;
+    }
+    return o;
+}
+
+// Parse a plain decimal number, NaN if the field is not one
+inline double parseNumber(const char * p, int n) {
+    int i = 0;
+    bool neg = false;
+    if (i < n && (p[i] == '-' || p[i] == '+'))
+        neg = p[i++] == '-';
+    uint64_t mant = 0;
+    int digits = 0;
+    int scale = 0;
+    while (i < n && p[i] >= '0' && p[i] <= '9' && digits < 18) {
+        mant = mant * 10 + (p[i++] - '0');
+        digits++;
+    }
+    if (i < n && p[i] == '.') {
+        i++;
+        while (i < n && p[i] >= '0' && p[i] <= '9' && digits < 18) {
+            mant = mant * 10 + (p[i++] - '0');
+            digits++;
+            scale++;
+        }
+    }
+    if (digits == 0 || i != n)
+        return NAN;
+    static const double pow10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+        1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+    double v = (double)mant / pow10[scale];
+    return neg ? -v : v;
+}
+
+// Days since 1970-01-01 of a civil date
+inline int64_t daysFromCivil(int y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// Parse "YYYY-MM-DD hh:mm:ss[.mmm]" (or with a 'T') to Unix seconds, NaN if
+// malformed
+inline double parseTime(const char * p, int n) {
+    if (n < 19 || p[4] != '-' || p[7] != '-' || (p[10] != ' ' && p[10] != 'T') || p[13] != ':' || p[16] != ':')
+        return NAN;
+    int v[6];
+    static const int pos[6] = { 0, 5, 8, 11, 14, 17 };
+    for (int f = 0; f < 6; f++) {
+        int len = f == 0 ? 4 : 2;
+        int x = 0;
+        for (int i = 0; i < len; i++) {
+            char c = p[pos[f] + i];
+            if (c < '0' || c > '9')
+                return NAN;
+            x = x * 10 + (c - '0');
+        }
+        v[f] = x;
+    }
+    double t = (double)(daysFromCivil(v[0], v[1], v[2]) * 86400 + v[3] * 3600 + v[4] * 60 + v[5]);
+    if (n > 19) {
+        if (p[19] != '.')
+            return NAN;
+        double frac = parseNumber(p + 19, n - 19);
+        if (std::isnan(frac))
+            return NAN;
+        t += frac;
+    }
+    return t;
+}
+
+struct DecoderStats {
+    uint64_t bytes;
+    uint64_t lines; // text records starting with '$'
+    uint64_t rows; // $BUMCTRL rows passed on
+    uint64_t unchecked; // rows without a checksum
+    uint64_t badChecksum;
+    uint64_t badFields; // field count does not match the header
+    uint64_t headers;
+    uint64_t other; // lines that are not ours, prompts, echoes, other tags
+    uint64_t frames;
+    uint64_t badFrames;
+    uint64_t snapshots;
+
+    DecoderStats() {
+        memset(this, 0, sizeof(*this));
+    }
+};
+
+// Stream decoder, feed it whole buffers with decode(). Records split between
+// two decode() calls are not joined, map whole files instead.
+class Decoder {
+
+    private:
+    Sink * logSink;
+    Sink * snapshotSink;
+    bool strict; // drop rows without a checksum
+    std::vector<std::string> header; // from the last $BUMHDR
+    std::string headerText;
+    bool headerChanged; // header not given to logSink yet
+    std::vector<std::string> current; // last schema given to logSink
+    int snapshotRails; // rail count of the last snapshot schema, -1 if none
+    std::vector<Field> fields;
+    uint8_t frame[MAX_FRAME];
+    char scratch[64 + 256 * 3 * 16];
+
+    static bool startsWith(const char * p, int n, const char * tag) {
+        int t = (int)strlen(tag);
+        return n >= t && memcmp(p, tag, t) == 0 && (n == t || p[t] == ',');
+    }
+
+    void split(const char * p, int n) {
+        fields.clear();
+        int start = 0;
+        for (int i = 0; i <= n; i++) {
+            if (i == n || p[i] == ',') {
+                Field f = { p + start, i - start };
+                fields.push_back(f);
+                start = i + 1;
+            }
+        }
+    }
+
+    void setSchema(Sink * sink, std::vector<std::string> & cur, const std::vector<std::string> & names) {
+        if (sink != NULL && names != cur) {
+            cur = names;
+            sink->schema(cur);
+        }
+    }
+
+    void line(const char * p, int n) {
+        while (n > 0 && (p[n - 1] == '\r' || p[n - 1] == ' '))
+            n--;
+        if (n < 2 || p[0] != '$') {
+            stats.other++;
+            return;
+        }
+        stats.lines++;
+
+        // Body between '$' and '*'
+        const char * body = p + 1;
+        int len = n - 1;
+        if (n >= 4 && p[n - 3] == '*') {
+            int hi = hexValue(p[n - 2]);
+            int lo = hexValue(p[n - 1]);
+            len = n - 4;
+            if (hi < 0 || lo < 0 || xorChecksum(body, len) != (hi << 4 | lo)) {
+                stats.badChecksum++;
+                return;
+            }
+        }
+        else if (strict) {
+            stats.badChecksum++;
+            return;
+        }
+        else if (startsWith(body, len, "BUMCTRL")) {
+            stats.unchecked++;
+        }
+
+        if (startsWith(body, len, "BUMHDR")) {
+            stats.headers++;
+            // The same header comes round every LOG_HEADER_INTERVAL lines
+            if (headerText.size() == (size_t)len && memcmp(headerText.data(), body, len) == 0)
+                return;
+            headerText.assign(body, len);
+            split(body, len);
+            header.clear();
+            for (size_t i = 1; i < fields.size(); i++)
+                header.push_back(std::string(fields[i].p, fields[i].n));
+            headerChanged = true;
+            return;
+        }
+        if (!startsWith(body, len, "BUMCTRL")) {
+            stats.other++;
+            return;
+        }
+
+        split(body, len);
+        int n_fields = (int)fields.size() - 1;
+        if (header.empty()) {
+            // Older firmware, make up names for the columns
+            if ((int)current.size() != n_fields) {
+                std::vector<std::string> names;
+                names.push_back("time");
+                for (int i = 1; i < n_fields; i++)
+                    names.push_back("c" + std::to_string(i));
+                setSchema(logSink, current, names);
+            }
+        }
+        else if ((int)header.size() == n_fields) {
+            if (headerChanged)
+                setSchema(logSink, current, header);
+            headerChanged = false;
+        }
+        else {
+            stats.badFields++;
+            return;
+        }
+        stats.rows++;
+        if (logSink != NULL)
+            logSink->row(&fields[1], n_fields);
+    }
+
+    static int32_t get32(const uint8_t * p) {
+        return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    }
+
+    // Append v / 10^decimals to scratch as a field, unknown values are left empty
+    int put(int pos, int64_t v, int decimals, bool known = true) {
+        static const int64_t scales[] = { 1, 10, 100, 1000 };
+        Field f;
+        f.p = scratch + pos;
+        if (!known) {
+            f.n = 0;
+        }
+        else if (decimals == 0) {
+            f.n = sprintf(scratch + pos, "%lld", (long long)v);
+        }
+        else {
+            int64_t s = scales[decimals];
+            int64_t a = v < 0 ? -v : v;
+            f.n = sprintf(scratch + pos, "%s%lld.%0*lld", v < 0 ? "-" : "", (long long)(a / s), decimals, (long long)(a % s));
+        }
+        fields.push_back(f);
+        return pos + f.n;
+    }
+
+    // Snapshot layout from SystemControl::writeSnapshot(), after op, id and
+    // event type
+    void snapshot(const uint8_t * f, int n) {
+        if (n < 26 || n != 26 + f[25] * 12 + 8) {
+            stats.badFrames++;
+            return;
+        }
+        int rails = f[25];
+        stats.snapshots++;
+        if (snapshotSink == NULL)
+            return;
+
+        if (rails != snapshotRails) {
+            const char * fixed[] = { "unixtime", "millis", "power_state", "flags", "temp_c", "pressure_kpa", "humidity_pct" };
+            std::vector<std::string> names(fixed, fixed + 7);
+            for (int i = 0; i < rails; i++) {
+                std::string r = "rail" + std::to_string(i);
+                names.push_back(r + "_v");
+                names.push_back(r + "_a");
+                names.push_back(r + "_w");
+            }
+            names.push_back("charge_pct");
+            names.push_back("runtime_min");
+            snapshotSink->schema(names);
+            snapshotRails = rails;
+        }
+
+        fields.clear();
+        int pos = 0;
+        pos = put(pos, (uint32_t)get32(f + 7), 0);
+        pos = put(pos, (uint32_t)get32(f + 3), 0);
+        pos = put(pos, f[11], 0);
+        pos = put(pos, f[12], 0);
+        pos = put(pos, get32(f + 13), 2);
+        pos = put(pos, get32(f + 17), 3);
+        pos = put(pos, get32(f + 21), 2);
+        const uint8_t * r = f + 26;
+        for (int i = 0; i < rails; i++, r += 12) {
+            pos = put(pos, get32(r), 3);
+            pos = put(pos, get32(r + 4), 3);
+            pos = put(pos, get32(r + 8), 3);
+        }
+        int32_t charge = get32(r);
+        int32_t runtime = get32(r + 4);
+        pos = put(pos, charge, 2, charge >= 0);
+        put(pos, runtime, 0, runtime >= 0);
+        snapshotSink->row(&fields[0], (int)fields.size());
+    }
+
+    void handleFrame(const uint8_t * p, int n) {
+        int len = cobsDecode(p, n, frame);
+        if (len < 4 || crc16(frame, len - 2) != (frame[len - 2] | frame[len - 1] << 8)) {
+            stats.badFrames++;
+            return;
+        }
+        stats.frames++;
+        len -= 2;
+        if (frame[0] == OP_EVENT && len >= 3 && frame[2] == EVT_SNAPSHOT)
+            snapshot(frame, len);
+    }
+
+    public:
+    DecoderStats stats;
+
+    Decoder(Sink * logSink, Sink * snapshotSink = NULL, bool strict = false) {
+        this->logSink = logSink;
+        this->snapshotSink = snapshotSink;
+        this->strict = strict;
+        snapshotRails = -1;
+        headerChanged = false;
+    }
+
+    void decode(const char * data, size_t size) {
+        const char * p = data;
+        const char * end = data + size;
+        stats.bytes += size;
+        while (p < end) {
+            if (*p == 0) {
+                // Frame up to the next delimiter, empty ones are just padding
+                const char * q = (const char *)memchr(p + 1, 0, end - p - 1);
+                if (q == NULL)
+                    q = end;
+                int n = (int)(q - p - 1);
+                if (n > 0) {
+                    if (n > MAX_FRAME + MAX_FRAME / 254 + 1)
+                        stats.badFrames++;
+                    else
+                        handleFrame((const uint8_t *)p + 1, n);
+                }
+                // The controller sends a delimiter on both sides of a frame
+                p = q + 1;
+                continue;
+            }
+            const char * q = (const char *)memchr(p, '\n', end - p);
+            if (q == NULL)
+                q = end;
+            line(p, (int)(q - p));
+            p = q + 1;
+        }
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,235 @@
+// bumlog, decode console controller logs to CSV or columnar binary
+//
+//   bumlog [-f csv|col] [-o prefix] [-s] [-q] log...
+//
+// Logs are decoded in the order given, as one stream. Rows go to
+// prefix.csv / prefix.col, snapshot frames to prefix.snap.csv / .snap.col, both
+// only created when there is something to write. When the column set changes
+// a new file prefix.N.csv is started, the columnar format just starts a new
+// schema block.
+//
+// Columnar format, little endian:
+//
+//   "BUMCOL1\n"
+//   'S' u32 ncols, ncols x (u16 length, name)       schema block
+//   'R' u32 nrows, ncols x nrows x f64              row group
+//
+// Row groups hold up to ROW_GROUP rows stored column by column, the time is in
+// Unix seconds and fields that are empty or not numbers are NaN.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "BumLog.h"
+
+using namespace bumlog;
+
+#define ROW_GROUP 65536
+#define OUT_BUFFER (1 << 20)
+
+static FILE * openOutput(const std::string & path) {
+    FILE * f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+        fprintf(stderr, "bumlog: can't write %s\n", path.c_str());
+        exit(1);
+    }
+    setvbuf(f, NULL, _IOFBF, OUT_BUFFER);
+    return f;
+}
+
+// Rows as they came in, a header line per file
+class CsvSink : public Sink {
+
+    private:
+    std::string prefix;
+    FILE * out;
+    int files;
+
+    public:
+
+    CsvSink(const std::string & prefix) {
+        this->prefix = prefix;
+        out = NULL;
+        files = 0;
+    }
+
+    ~CsvSink() {
+        if (out != NULL)
+            fclose(out);
+    }
+
+    void schema(const std::vector<std::string> & names) {
+        if (out != NULL)
+            fclose(out);
+        std::string path = prefix + (files > 0 ? "." + std::to_string(files) : "") + ".csv";
+        out = openOutput(path);
+        files++;
+        for (size_t i = 0; i < names.size(); i++) {
+            if (i > 0)
+                fputc(',', out);
+            fputs(names[i].c_str(), out);
+        }
+        fputc('\n', out);
+    }
+
+    void row(const Field * fields, int n) {
+        char line[4096];
+        int len = 0;
+        for (int i = 0; i < n; i++) {
+            if (len + fields[i].n + 2 > (int)sizeof(line))
+                break;
+            if (i > 0)
+                line[len++] = ',';
+            memcpy(line + len, fields[i].p, fields[i].n);
+            len += fields[i].n;
+        }
+        line[len++] = '\n';
+        fwrite(line, 1, len, out);
+    }
+};
+
+// Parsed f64 columns in row groups
+class ColumnSink : public Sink {
+
+    private:
+    std::string path;
+    FILE * out;
+    bool timeFirst; // column 0 is a date and time string
+    std::vector<std::vector<double> > columns;
+    uint32_t rows;
+
+    void put32(uint32_t v) {
+        uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+        fwrite(b, 1, 4, out);
+    }
+
+    void flush() {
+        if (rows == 0)
+            return;
+        fputc('R', out);
+        put32(rows);
+        for (size_t c = 0; c < columns.size(); c++)
+            fwrite(&columns[c][0], sizeof(double), rows, out);
+        rows = 0;
+    }
+
+    public:
+
+    ColumnSink(const std::string & path, bool timeFirst) {
+        this->path = path;
+        this->timeFirst = timeFirst;
+        out = NULL;
+        rows = 0;
+    }
+
+    ~ColumnSink() {
+        if (out != NULL) {
+            flush();
+            fclose(out);
+        }
+    }
+
+    void schema(const std::vector<std::string> & names) {
+        if (out == NULL) {
+            out = openOutput(path);
+            fwrite("BUMCOL1\n", 1, 8, out);
+        }
+        flush();
+        fputc('S', out);
+        put32(names.size());
+        for (size_t i = 0; i < names.size(); i++) {
+            uint16_t n = names[i].size();
+            uint8_t b[2] = { (uint8_t)n, (uint8_t)(n >> 8) };
+            fwrite(b, 1, 2, out);
+            fwrite(names[i].data(), 1, n, out);
+        }
+        columns.assign(names.size(), std::vector<double>(ROW_GROUP));
+    }
+
+    void row(const Field * fields, int n) {
+        for (int i = 0; i < n; i++) {
+            if (i == 0 && timeFirst)
+                columns[i][rows] = parseTime(fields[i].p, fields[i].n);
+            else
+                columns[i][rows] = parseNumber(fields[i].p, fields[i].n);
+        }
+        if (++rows == ROW_GROUP)
+            flush();
+    }
+};
+
+static void usage() {
+    fprintf(stderr,
+        "usage: bumlog [-f csv|col] [-o prefix] [-s] [-q] log...\n"
+        "  -f  output format, csv (default) or col for columnar f64 binary\n"
+        "  -o  output file prefix, default bumlog\n"
+        "  -s  strict, drop lines without a checksum\n"
+        "  -q  no statistics\n");
+    exit(2);
+}
+
+int main(int argc, char ** argv) {
+    std::string format = "csv";
+    std::string prefix = "bumlog";
+    bool strict = false;
+    bool quiet = false;
+    std::vector<const char *> inputs;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            format = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            prefix = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0)
+            strict = true;
+        else if (strcmp(argv[i], "-q") == 0)
+            quiet = true;
+        else if (argv[i][0] == '-')
+            usage();
+        else
+            inputs.push_back(argv[i]);
+    }
+    if (inputs.empty() || (format != "csv" && format != "col"))
+        usage();
+
+    Sink * log;
+    Sink * snap;
+    if (format == "csv") {
+        log = new CsvSink(prefix);
+        snap = new CsvSink(prefix + ".snap");
+    }
+    else {
+        log = new ColumnSink(prefix + ".col", true);
+        snap = new ColumnSink(prefix + ".snap.col", false);
+    }
+
+    Decoder decoder(log, snap, strict);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        MappedFile file;
+        if (!file.open(inputs[i])) {
+            fprintf(stderr, "bumlog: can't read %s\n", inputs[i]);
+            return 1;
+        }
+        decoder.decode(file.data(), file.size());
+    }
+    delete log;
+    delete snap;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!quiet) {
+        const DecoderStats & s = decoder.stats;
+        fprintf(stderr, "%llu bytes in %.3f s, %.1f MB/s\n", (unsigned long long)s.bytes, seconds,
+            seconds > 0 ? s.bytes / seconds / 1e6 : 0.0);
+        fprintf(stderr, "rows %llu (no checksum %llu), headers %llu, bad checksum %llu, bad field count %llu, other lines %llu\n",
+            (unsigned long long)s.rows, (unsigned long long)s.unchecked, (unsigned long long)s.headers,
+            (unsigned long long)s.badChecksum, (unsigned long long)s.badFields, (unsigned long long)s.other);
+        fprintf(stderr, "frames %llu, bad frames %llu, snapshots %llu\n", (unsigned long long)s.frames,
+            (unsigned long long)s.badFrames, (unsigned long long)s.snapshots);
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+// Tests of the BumLog.h decoder: the checksum, CRC, COBS and number parsers
+// against known values, then the whole fixture.log (see make_fixture.py)
+// through a Decoder with sinks that keep every record.
+//
+//   bumlog_test fixture.log
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "BumLog.h"
+
+using namespace bumlog;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// Keeps the schemas and rows it is given as strings
+class RecordSink : public Sink {
+
+    public:
+    std::vector<std::vector<std::string> > schemas;
+    std::vector<std::vector<std::string> > rows;
+
+    void schema(const std::vector<std::string> & names) {
+        schemas.push_back(names);
+    }
+
+    void row(const Field * fields, int n) {
+        std::vector<std::string> r;
+        for (int i = 0; i < n; i++)
+            r.push_back(std::string(fields[i].p, fields[i].n));
+        rows.push_back(r);
+    }
+};
+
+static void testPrimitives() {
+    // CRC-16/CCITT-FALSE check value
+    CHECK(crc16((const uint8_t *)"123456789", 9) == 0x29B1);
+
+    // Checksum of the GPS NMEA example "$GPGLL,5300.97914,N,00259.98174,E,125926,A*28"
+    const char * nmea = "GPGLL,5300.97914,N,00259.98174,E,125926,A";
+    CHECK(xorChecksum(nmea, strlen(nmea)) == 0x28);
+
+    // 11 22 00 33 encodes to 03 11 22 02 33
+    const uint8_t encoded[] = { 0x03, 0x11, 0x22, 0x02, 0x33 };
+    uint8_t out[8];
+    CHECK(cobsDecode(encoded, 5, out) == 4);
+    CHECK(out[0] == 0x11 && out[1] == 0x22 && out[2] == 0x00 && out[3] == 0x33);
+
+    // A code byte pointing past the end is a truncated frame
+    const uint8_t truncated[] = { 0x05, 0x11, 0x22 };
+    CHECK(cobsDecode(truncated, 3, out) == -1);
+
+    CHECK(parseNumber("12.50", 5) == 12.5);
+    CHECK(parseNumber("-0.25", 5) == -0.25);
+    CHECK(std::isnan(parseNumber("12a", 3)));
+    CHECK(std::isnan(parseNumber("", 0)));
+
+    CHECK(parseTime("1970-01-02 00:00:01", 19) == 86401);
+    CHECK(parseTime("2026-10-19T12:00:00.250", 23) == 1792411200.25);
+    CHECK(std::isnan(parseTime("2026-10-19 12:00", 16)));
+}
+
+static void testFixture(const char * path) {
+    MappedFile file;
+    CHECK(file.open(path));
+    if (file.data() == NULL)
+        return;
+
+    RecordSink log;
+    RecordSink snap;
+    Decoder decoder(&log, &snap);
+    decoder.decode(file.data(), file.size());
+    const DecoderStats & s = decoder.stats;
+
+    CHECK(s.headers == 1);
+    CHECK(s.rows == 2);
+    CHECK(s.unchecked == 1); // the truncated line
+    CHECK(s.badChecksum == 1);
+    CHECK(s.badFields == 2); // the short row and the truncated line
+    CHECK(s.other == 1);
+    CHECK(s.frames == 1);
+    CHECK(s.badFrames == 2); // truncated and bad CRC
+    CHECK(s.snapshots == 1);
+
+    CHECK(log.schemas.size() == 1);
+    if (log.schemas.size() == 1) {
+        const char * names[] = { "time", "temp_c", "sys_v", "sys_w" };
+        CHECK(log.schemas[0] == std::vector<std::string>(names, names + 4));
+    }
+    CHECK(log.rows.size() == 2);
+    if (log.rows.size() == 2) {
+        CHECK(log.rows[0][0] == "2026-10-19 12:00:00.250");
+        CHECK(log.rows[0][3] == "18.00");
+        CHECK(log.rows[1][2] == "11.99");
+    }
+
+    CHECK(snap.rows.size() == 1);
+    if (snap.rows.size() == 1) {
+        const std::vector<std::string> & r = snap.rows[0];
+        CHECK(snap.schemas.size() == 1 && snap.schemas[0].size() == r.size());
+        CHECK(r.size() == 7 + 2 * 3 + 2);
+        if (r.size() == 15) {
+            CHECK(r[0] == "1760875200");
+            CHECK(r[1] == "123456");
+            CHECK(r[4] == "21.50");
+            CHECK(r[5] == "101.325");
+            CHECK(r[6] == "45.50");
+            CHECK(r[7] == "12.000");
+            CHECK(r[10] == "-0.050");
+            CHECK(r[13] == "81.25");
+            CHECK(r[14] == ""); // runtime unknown
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: bumlog_test fixture.log\n");
+        return 2;
+    }
+    testPrimitives();
+    testFixture(argv[1]);
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
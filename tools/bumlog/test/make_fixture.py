@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+# Writes fixture.log for the bumlog tests: $BUMCTRL lines with good and bad
+# checksums, a short row, a truncated line, one good snapshot frame, a
+# truncated frame and a frame with a bad CRC. Checksums, CRC and COBS are
+# computed here independently of BumLog.h.
+#
+#   python3 make_fixture.py > fixture.log
+
+import struct
+import sys
+
+
+def nmea(body):
+    x = 0
+    for c in body.encode():
+        x ^= c
+    return "$%s*%02X\r\n" % (body, x)
+
+
+def crc16(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs(data):
+    out = bytearray()
+    block = bytearray()
+    for b in data:
+        if b == 0:
+            out.append(len(block) + 1)
+            out += block
+            block = bytearray()
+        else:
+            block.append(b)
+            if len(block) == 254:
+                out.append(255)
+                out += block
+                block = bytearray()
+    out.append(len(block) + 1)
+    out += block
+    return bytes(out)
+
+
+def frame(payload):
+    body = payload + struct.pack("<H", crc16(payload))
+    return b"\x00" + cobs(body) + b"\x00"
+
+
+def snapshot():
+    # op, id, event, millis, unixtime, power state, flags, temp, pressure, humidity
+    p = struct.pack("<BBBIIBBiiiB", 0x40, 0, 0x04, 123456, 1760875200, 2, 0x01, 2150, 101325, 4550, 2)
+    p += struct.pack("<iii", 12000, 1500, 18000)  # SYS
+    p += struct.pack("<iii", -50, 0, 0)  # second rail
+    p += struct.pack("<ii", 8125, -1)  # charge, runtime unknown
+    return p
+
+
+out = sys.stdout.buffer
+out.write(nmea("BUMHDR,time,temp_c,sys_v,sys_w").encode())
+out.write(nmea("BUMCTRL,2026-10-19 12:00:00.250,21.50,12.00,18.00").encode())
+out.write(b"cmd> cfg\r\n")
+out.write(nmea("BUMCTRL,2026-10-19 12:00:00.500,21.51,11.99,18.10").encode())
+bad = nmea("BUMCTRL,2026-10-19 12:00:00.750,21.52,11.98,18.20")
+out.write((bad[:-4] + ("%02X" % (int(bad[-4:-2], 16) ^ 0x01)) + "\r\n").encode())
+out.write(nmea("BUMCTRL,2026-10-19 12:00:01.000,21.53").encode())
+out.write(b"$BUMCTRL,2026-10-19 12:00:01.250,21.5\r\n")
+out.write(frame(snapshot()))
+good = frame(snapshot())
+out.write(good[:len(good) // 2] + b"\x00")
+corrupt = bytearray(snapshot())
+body = bytes(corrupt) + struct.pack("<H", crc16(bytes(corrupt)) ^ 0x0100)
+out.write(b"\x00" + cobs(body) + b"\x00")
@@ -0,0 +1,52 @@
+// Host build of the BENCHMATH kernels in include/MathBench.h. Runs the same
+// synthetic INA260 stream through the float and the fixed point pipelines and
+// prints the same checksums and threshold hit counts as the command on the
+// target, with wall clock ns per sample in place of SysTick cycles. Exits
+// non-zero if the two pipelines disagree on the threshold hits.
+//
+//   mathbench [lowVoltage_mV] [passes]
+
+#include <chrono>
+
+#include "MathBench.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double nsPerSample(Clock::time_point start, Clock::time_point end, int passes) {
+    return std::chrono::duration<double, std::nano>(end - start).count() / passes / BENCH_SAMPLES;
+}
+
+int main(int argc, char ** argv) {
+    int lowVoltage = argc > 1 ? atoi(argv[1]) : 12500;
+    int passes = argc > 2 ? atoi(argv[2]) : 1000;
+    if (passes < 1)
+        passes = 1;
+
+    static BenchInput in[BENCH_SAMPLES];
+    benchInputs(in, BENCH_SAMPLES);
+
+    int floatHits = 0, fixedHits = 0;
+    uint32_t floatSum = 0, fixedSum = 0;
+
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < passes; i++)
+        floatSum = benchFloat(in, BENCH_SAMPLES, (float)lowVoltage, &floatHits);
+    double floatNs = nsPerSample(start, Clock::now(), passes);
+
+    start = Clock::now();
+    for (int i = 0; i < passes; i++)
+        fixedSum = benchFixed(in, BENCH_SAMPLES, MilliVolts(lowVoltage), &fixedHits);
+    double fixedNs = nsPerSample(start, Clock::now(), passes);
+
+    printf("Samples: %d\n", BENCH_SAMPLES);
+    printf("Float: %.1f ns/sample, checksum 0x%08lX, %d below threshold\n",
+        floatNs, (unsigned long)floatSum, floatHits);
+    printf("Fixed: %.1f ns/sample, checksum 0x%08lX, %d below threshold\n",
+        fixedNs, (unsigned long)fixedSum, fixedHits);
+
+    if (floatHits != fixedHits) {
+        fprintf(stderr, "Threshold hits differ\n");
+        return 1;
+    }
+    return 0;
+}
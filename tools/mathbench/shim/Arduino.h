@@ -0,0 +1,20 @@
+#ifndef _HOST_ARDUINO
+
+#define _HOST_ARDUINO
+
+// Just enough of Arduino.h for the math kernels of MathBench.h and Stats.h to
+// build on the host
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct HostPort {
+    void println(const char * s) {
+        puts(s);
+    }
+};
+
+#endif
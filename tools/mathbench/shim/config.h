@@ -0,0 +1,10 @@
+#ifndef _HOST_CONFIG
+
+#define _HOST_CONFIG
+
+#include "Arduino.h"
+
+// Stats.h reports a bad buffer size on the debug port
+static HostPort DEBUGPORT;
+
+#endif